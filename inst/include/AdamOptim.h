@@ -2,6 +2,11 @@
 #define MONGREL_ADAM_H
 
 #include <RcppNumerical.h>
+#include <OptimTrace.h>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <stdexcept>
+#include <vector>
 
 using namespace Rcpp;
 using Eigen::Map;
@@ -29,6 +34,37 @@ namespace adam{
     }
   };
 
+  // Functor evaluating a low precision model (e.g., float) until switched 
+  //   to the high precision (double) model, used by optim_adam_mixed
+  class MixedPrecisionFun : public Numer::MFuncGrad
+  {
+  private:
+    Numer::MFuncGrad& flo;
+    Numer::MFuncGrad& fhi;
+    bool high;
+  public:
+    MixedPrecisionFun(Numer::MFuncGrad& flo_, Numer::MFuncGrad& fhi_) : 
+      flo(flo_), fhi(fhi_), high(false) {}
+    void switchToHigh(){ high = true; }
+    bool isHigh(){ return high; }
+    double f_grad(Numer::Constvec& x, Numer::Refvec grad){
+      if (high) return fhi.f_grad(x, grad);
+      return flo.f_grad(x, grad);
+    }
+  };
+
+  // State of an ADAM optimizer (moments and timestep) so that optimization 
+  //   can be resumed (e.g., warm starts after small changes to the model)
+  //   t : next timestep (0 if no steps have been taken)
+  //   tblock : per column timesteps (optim_adam_minibatch only)
+  struct ADAMState {
+    VectorXd mt;
+    VectorXd vt;
+    int t;
+    Eigen::VectorXi tblock;
+    ADAMState() : t(0) {}
+  };
+
   // Class for Adam Optimizer
   class ADAMOptim
   {
@@ -57,6 +93,13 @@ namespace adam{
       bool verbose;
       int verbose_rate;
       
+      // must be false if run off the main thread
+      bool check_interrupt;
+      
+      // per iteration trace (null if off)
+      optimtrace::OptimTrace* trace;
+      double stepnorm; // norm of the last step
+      
     public:
       // Main constructor 
       //   fun_ : ADAMFun object (functor)
@@ -70,10 +113,13 @@ namespace adam{
       //   max_iter : maximum number of iterations before stopping
       //   verbose : if true will print stats for stopping criteria and iter no.
       //   verbose_rate : rate to print verbose stats to screen
+      //   check_interrupt : if true checks for user interrupts each step
+      //     (set to false when called from within a parallel region)
       ADAMOptim(ADAMFun& fun_, Numer::Refvec& thetainit, 
                 double b1, double b2, double eta, double epsilon, 
                 double eps_f, double eps_g, int max_iter, 
-                bool verbose, int verbose_rate) : fun(fun_){
+                bool verbose, int verbose_rate, 
+                bool check_interrupt=true) : fun(fun_){
         p = thetainit.size();
         thetat = thetainit;
         mt = ArrayXd::Zero(p);
@@ -92,10 +138,13 @@ namespace adam{
         val=0;
         this -> verbose = verbose;
         this -> verbose_rate = verbose_rate;
+        this -> check_interrupt = check_interrupt;
+        trace = 0;
+        stepnorm = 0;
       }
       
       int step(){
-        R_CheckUserInterrupt();
+        if (check_interrupt) R_CheckUserInterrupt();
         double val2 = fun(thetat, gt); // update gradient and value based on init
         double gnorm = gt.norm();
         double xnorm = thetat.norm();
@@ -111,15 +160,20 @@ namespace adam{
                   << eps_g*std::max(xnorm, 1.0) << std::endl;
           }
         }
+        int status = 0;
         if (gnorm <= eps_g*std::max(xnorm, 1.0)){
-          return 1; // gradient below threshold
-        }
-        if ((((val2 - val)/val2) > -eps_f) && (((val2 - val)/val2) != 1)){
-          return 2; // function value improvement below threshold
+          status = 1; // gradient below threshold
+        } else if ((((val2 - val)/val2) > -eps_f) && (((val2 - val)/val2) != 1)){
+          status = 2; // function value improvement below threshold
+        } else if (t > max_iter){
+          status = -1;    // max iter warning is -1
         }
-        if (t > max_iter){
-          return -1;    // max iter warning is -1
+        if (trace){
+          trace->record(val2, gnorm, (val == 0) ? 
+                          std::numeric_limits<double>::quiet_NaN() : 
+                          (val - val2)/std::abs(val2), stepnorm);
         }
+        if (status != 0) return status;
         val = val2;
     
         // if no stopping criteria met -- meat of algorithm
@@ -131,10 +185,32 @@ namespace adam{
         vthat = vt/(1-pow(b2,t));
         ArrayXd tmp(eta/(vthat.sqrt()+epsilon) * mthat);
         thetat -= tmp.matrix();
+        if (trace) stepnorm = tmp.matrix().norm();
         t++;
         return 0;
       }
       
+      // forget the last function value (so the next step does not compare 
+      //   against it, e.g., after changing the precision of fun)
+      void resetVal(){val = 0;}
+      // resume from the moments and timestep of a previous optimizer
+      void setState(const ADAMState& s){
+        if ((s.mt.size() != p) || (s.vt.size() != p) || (s.t < 1)) 
+          throw std::runtime_error("ADAM state does not match number of parameters");
+        mt = s.mt.array();
+        vt = s.vt.array();
+        t = s.t;
+      }
+      ADAMState getState(){
+        ADAMState s;
+        s.mt = mt.matrix();
+        s.vt = vt.matrix();
+        s.t = t;
+        return s;
+      }
+      // record every step in trace (not owned, may be null)
+      void setTrace(optimtrace::OptimTrace* trace){this -> trace = trace;}
+      int getIter(){return t;} // current timestep
       double getVal(){return val;} // get optimal value
       VectorXd getTheta(){return thetat;} // get optimal parameter
   };
@@ -151,6 +227,10 @@ namespace adam{
   //   max_iter : maximum number of iterations before stopping
   //   verbose : if true will print stats for stopping criteria and iter no.
   //   verbose_rate : rate to print verbose stats to screen
+  //   state : if not null and state->t > 0 optimization resumes from that 
+  //     state (max_iter further iterations are allowed), if not null 
+  //     overwritten with the final state
+  //   trace : if not null each iteration is recorded in trace
   inline int optim_adam(Numer::MFuncGrad& f, 
                         Numer::Refvec theta, // initial value and thing returned 
                         double& fx_opt, 
@@ -162,18 +242,82 @@ namespace adam{
                         double eps_g= 1e-5, 
                         int max_iter= 10000, 
                         bool verbose=false, 
-                        int verbose_rate=10){
+                        int verbose_rate=10, 
+                        ADAMState* state=0, 
+                        optimtrace::OptimTrace* trace=0){
     
     // create functor
     ADAMFun fun(f);
     
     // Solver
+    int t0 = (state && (state->t > 0)) ? state->t : 1;
+    ADAMOptim optim(fun, theta, b1, b2, eta, epsilon, 
+                    eps_f, eps_g, max_iter + t0 - 1, verbose, verbose_rate);
+    if (t0 > 1) optim.setState(*state);
+    optim.setTrace(trace);
+    
+    int status = 0; 
+    while (status == 0){
+      status = optim.step();
+    }
+    if (status == -1){
+      Rcpp::warning("Max iterations hit, may not be at optima");
+    } else if ((status == 1) && verbose){
+      Rcout << "Optimization terminated: change in gradient below threshold" 
+            << std::endl;
+    } else if ((status ==2) && verbose){
+      Rcout << "Optimization terminated: change in function value below threshold" 
+            << std::endl;
+    }
+    fx_opt = optim.getVal();
+    theta = optim.getTheta();
+    if (state) *state = optim.getState();
+    return status;
+  }
+  
+  // Mixed precision ADAM: steps using flo (e.g., a float model) until a 
+  //   stopping criteria is met, then continues from the same optimizer 
+  //   state (moments and timestep) using fhi (double) until stopping criteria 
+  //   are met again. max_iter is the total over both phases. If resuming 
+  //   from state (state->t > 0) only fhi is used. 
+  //   Other parameters as in optim_adam. 
+  inline int optim_adam_mixed(Numer::MFuncGrad& flo, 
+                              Numer::MFuncGrad& fhi, 
+                              Numer::Refvec theta, // initial value and thing returned 
+                              double& fx_opt, 
+                              double b1=0.9, 
+                              double b2=0.99,
+                              double eta=0.003,
+                              double epsilon=10e-7,
+                              double eps_f= 1e-8, 
+                              double eps_g= 1e-5, 
+                              int max_iter= 10000, 
+                              bool verbose=false, 
+                              int verbose_rate=10, 
+                              ADAMState* state=0, 
+                              optimtrace::OptimTrace* trace=0){
+    MixedPrecisionFun mixed(flo, fhi);
+    ADAMFun fun(mixed);
+    int t0 = (state && (state->t > 0)) ? state->t : 1;
     ADAMOptim optim(fun, theta, b1, b2, eta, epsilon, 
-                    eps_f, eps_g, max_iter, verbose, verbose_rate);
+                    eps_f, eps_g, max_iter + t0 - 1, verbose, verbose_rate);
+    if (t0 > 1){ // already near an optima
+      optim.setState(*state);
+      mixed.switchToHigh();
+    }
+    optim.setTrace(trace);
     
     int status = 0; 
     while (status == 0){
       status = optim.step();
+      if ((status > 0) && !mixed.isHigh()){
+        if (verbose) 
+          Rcout << "Switching to double precision at iter : " 
+                << optim.getIter() << std::endl;
+        mixed.switchToHigh();
+        optim.resetVal();
+        status = 0;
+      }
     }
     if (status == -1){
       Rcpp::warning("Max iterations hit, may not be at optima");
@@ -186,6 +330,138 @@ namespace adam{
     }
     fx_opt = optim.getVal();
     theta = optim.getTheta();
+    if (state) *state = optim.getState();
+    return status;
+  }
+  
+  // Stochastic (mini-batch) ADAM over samples: each step updates only 
+  //   batch_size randomly chosen columns (samples) of theta (viewed as a 
+  //   blocksize x nblocks matrix), moments and bias correction are kept per 
+  //   column (lazy ADAM). Stopping criteria are evaluated on the full 
+  //   function and gradient once per pass over the samples 
+  //   (nblocks/batch_size steps). 
+  //   model : provides nblocks(), blocksize(), reset(theta) (returns 
+  //     function value), grad() (full gradient at last reset), 
+  //     gradBlocks(idx) (gradient of columns idx) and updateBlocks(idx, 
+  //     thetaB) (e.g., PibbleCollapsedIncremental), minimizes
+  //   batch_size : number of columns updated per step
+  //   seed : seed for the random column selection
+  //   max_iter : maximum number of (mini-batch) steps before stopping
+  //   state : as in optim_adam (moments are per column, state->tblock 
+  //     holds per column timesteps)
+  //   trace : if not null each full check (once per pass) is recorded in 
+  //     trace, the step norm is then the change in theta over the pass
+  //   Other parameters as in optim_adam. 
+  template <typename ModelT>
+  int optim_adam_minibatch(ModelT& model, 
+                           Numer::Refvec theta, // initial value and thing returned 
+                           double& fx_opt, 
+                           int batch_size, 
+                           long seed=0, 
+                           double b1=0.9, 
+                           double b2=0.99,
+                           double eta=0.003,
+                           double epsilon=10e-7,
+                           double eps_f= 1e-8, 
+                           double eps_g= 1e-5, 
+                           int max_iter= 10000, 
+                           bool verbose=false, 
+                           int verbose_rate=10, 
+                           ADAMState* state=0, 
+                           optimtrace::OptimTrace* trace=0){
+    int N = model.nblocks();
+    int P = model.blocksize();
+    if (batch_size < 1 || batch_size > N) batch_size = N;
+    int check_rate = (N + batch_size - 1)/batch_size; // steps per pass
+    boost::random::mt19937 rng(seed);
+    std::vector<int> perm(N);
+    for (int j=0; j<N; j++) perm[j] = j;
+    std::vector<int> idx(batch_size);
+    Map<MatrixXd> thetamat(theta.data(), P, N);
+    MatrixXd mt = MatrixXd::Zero(P, N); // first moment
+    MatrixXd vt = MatrixXd::Zero(P, N); // second moment
+    Eigen::VectorXi tj = Eigen::VectorXi::Zero(N); // per column timestep
+    if (state && (state->t > 0)){
+      if ((state->mt.size() != P*N) || (state->vt.size() != P*N) || 
+          (state->tblock.size() != N))
+        throw std::runtime_error("ADAM state does not match number of parameters");
+      mt = Map<const MatrixXd>(state->mt.data(), P, N);
+      vt = Map<const MatrixXd>(state->vt.data(), P, N);
+      tj = state->tblock;
+    }
+    MatrixXd thetaB(P, batch_size);
+    VectorXd thetaprev; // theta at last full check (if traced)
+    double val = 0;
+    int t = 0;
+    int status = 0;
+    while (status == 0){
+      if (t % check_rate == 0){ // full stopping criteria
+        R_CheckUserInterrupt();
+        double val2 = model.reset(theta); // also clears accumulated rounding
+        VectorXd g = model.grad();
+        double gnorm = g.norm();
+        double xnorm = theta.norm();
+        if (verbose && ((t/check_rate) % verbose_rate == 0)){
+          Rcout << "iter : " << t << std::endl;
+          Rcout << "-Log Like: " << val2 << std::endl;
+          Rcout << "normalized rel improvement: " << ((val2 - val)/val2) 
+                << std::endl;
+          Rcout << "gnorm, gradient threshold " << gnorm << "," 
+                << eps_g*std::max(xnorm, 1.0) << std::endl;
+        }
+        if (gnorm <= eps_g*std::max(xnorm, 1.0)){
+          status = 1; // gradient below threshold
+        } else if ((t > 0) && (std::abs((val2 - val)/val2) < eps_f)){
+          status = 2; // function value change below threshold (the value 
+                      //   may increase over a pass so only small changes stop)
+        } else if (t >= max_iter){
+          status = -1;
+        }
+        if (trace){
+          trace->record(val2, gnorm, (t > 0) ? (val - val2)/std::abs(val2) : 
+                          std::numeric_limits<double>::quiet_NaN(), 
+                        (t > 0) ? (theta - thetaprev).norm() : 0);
+          thetaprev = theta;
+        }
+        val = val2;
+        if (status != 0) break;
+      }
+      
+      // draw batch without replacement (partial fisher-yates)
+      for (int k=0; k<batch_size; k++){
+        boost::random::uniform_int_distribution<int> unif(k, N-1);
+        std::swap(perm[k], perm[unif(rng)]);
+        idx[k] = perm[k];
+      }
+      MatrixXd gB = model.gradBlocks(idx);
+      for (int k=0; k<batch_size; k++){
+        int j = idx[k];
+        tj(j)++;
+        mt.col(j) = b1*mt.col(j) + (1-b1)*gB.col(k);
+        vt.col(j) = b2*vt.col(j) + (1-b2)*gB.col(k).cwiseAbs2();
+        thetamat.col(j).array() -= eta*(mt.col(j).array()/(1-pow(b1,tj(j))))/
+          ((vt.col(j).array()/(1-pow(b2,tj(j)))).sqrt() + epsilon);
+        thetaB.col(k) = thetamat.col(j);
+      }
+      model.updateBlocks(idx, thetaB);
+      t++;
+    }
+    if (status == -1){
+      Rcpp::warning("Max iterations hit, may not be at optima");
+    } else if ((status == 1) && verbose){
+      Rcout << "Optimization terminated: change in gradient below threshold" 
+            << std::endl;
+    } else if ((status ==2) && verbose){
+      Rcout << "Optimization terminated: change in function value below threshold" 
+            << std::endl;
+    }
+    fx_opt = val;
+    if (state){
+      state->mt = Map<VectorXd>(mt.data(), mt.size());
+      state->vt = Map<VectorXd>(vt.data(), vt.size());
+      state->tblock = tj;
+      state->t = std::max(tj.maxCoeff(), 1);
+    }
     return status;
   }
   
@@ -8,6 +8,13 @@
 
 #include <RcppEigen.h>
 #include <MatDist.h>
+#include <PhiloxRNG.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 using namespace Rcpp;
 using Eigen::Map;
 using Eigen::MatrixXd;
@@ -22,113 +29,735 @@ namespace lapap{
   {
     double eigvalthresh;
     double logInvNegHessDet;
+    // for "krylov" (krylov_invsqrt, krylov_logdet) 
+    int krylov_max_iter;  // max lanczos steps per sample / probe
+    double krylov_tol;    // relative change in sample for stopping 
+    int krylov_probes;    // number of probes for log determinant 
+    // for "lowrank" (lowrank_decompose)
+    int lowrank_rank;     // number of eigenpairs kept (k)
+    // source of unit normals, fillUnitNormal (ziggurat, not thread safe) 
+    //   unless a seed is given to init_lappars in which case successive 
+    //   calls take the next columns of philox::fillUnitNormal streams 
+    std::function<void(Eigen::Ref<MatrixXd>)> fillnormal;
+    bool quiet; // if true no warnings / printing (e.g., inside threads)
   };
 
-  inline lappars init_lappars(double eigvalthresh){
+  // @param seed if not -1 normals come from philox streams keyed by seed 
+  //   (reproducible regardless of threads, safe to use concurrently), 
+  //   starting with stream stream0 (e.g., to give concurrent fits sharing a 
+  //   seed disjoint streams) 
+  inline lappars init_lappars(double eigvalthresh, long seed=-1, 
+                              uint64_t stream0=0){
     lappars lap;
     lap.eigvalthresh=eigvalthresh;
     lap.logInvNegHessDet=0.0;
+    lap.krylov_max_iter=100;
+    lap.krylov_tol=1e-6;
+    lap.krylov_probes=30;
+    lap.lowrank_rank=20;
+    if (seed != -1){
+      std::shared_ptr<uint64_t> next = std::make_shared<uint64_t>(stream0);
+      lap.fillnormal=[seed, next](Eigen::Ref<MatrixXd> Z){ 
+        philox::fillUnitNormal(Z, seed, *next);
+        *next += Z.cols();
+      };
+    } else {
+      lap.fillnormal=[](Eigen::Ref<MatrixXd> Z){ fillUnitNormal(Z); };
+    }
+    lap.quiet=false;
     return lap;
   }
 
-  template <typename T1, typename T2, typename T3> 
-  // @param z is object derived from class MatrixBase to overwrite with sample
-  // @param m MAP estimate
-  // @param S the hessian of the NEGATIVE log-likelihood evaluated at m
+  template <typename T>
+  // Products with the hessian of the NEGATIVE log-likelihood (plus jitter) 
+  //   given an operator (e.g., mongrel::StructuredHessian) whose matvec() 
+  //   gives products with the hessian of the POSITIVE log-likelihood
+  class NegHessOp {
+    private:
+      const T& H;
+      double jitter;
+    public:
+      NegHessOp(const T& H_, double jitter_=0) : H(H_), jitter(jitter_) {}
+      int rows() const { return H.rows(); }
+      VectorXd matvec(const Ref<const VectorXd>& v) const {
+        VectorXd out = -H.matvec(v);
+        if (jitter > 0) out += jitter*v;
+        return out;
+      }
+  };
+  
+  // Computes f(T)e_1 = Q*f(theta)*Q'e_1 for the tridiagonal lanczos matrix T 
+  //   with f(theta) = theta^{-1/2}. Ritz values that fail eigvalthresh 
+  //   signal failure, small negative ones are chopped (as in eigen_lap)
+  // @param alpha diagonal of T (length k)
+  // @param beta subdiagonal of T (length k-1)
+  // @param c overwritten with f(T)e_1
+  // @return int 0 success, 1 failure
+  inline int lanczos_invsqrt_e1(const Ref<const VectorXd>& alpha, 
+                                const Ref<const VectorXd>& beta, 
+                                VectorXd& c, lappars &pars){
+    Eigen::SelfAdjointEigenSolver<MatrixXd> eh;
+    eh.computeFromTridiagonal(alpha, beta);
+    const VectorXd& theta = eh.eigenvalues();
+    VectorXd ftau(alpha.size());
+    for (int i=0; i<alpha.size(); i++){
+      if (1.0/theta(i) < pars.eigvalthresh) return 1;
+      ftau(i) = (theta(i) > 0) ? eh.eigenvectors()(0,i)/sqrt(theta(i)) : 0.0;
+    }
+    c.noalias() = eh.eigenvectors()*ftau;
+    return 0;
+  }
+  
+  template <typename Op>
+  // Overwrites b with S^{-1/2}b using the lanczos approximation 
+  //   S^{-1/2}b ~ ||b||*V_k*T_k^{-1/2}*e_1 (no reorthogonalization, loss of
+  //   orthogonality only delays convergence). Stops once the sample changes 
+  //   by less than krylov_tol (relative). 
+  // @param b vector to overwrite
+  // @param S operator with products with the hessian of the NEGATIVE 
+  //    log-likelihood (must provide matvec() and rows())
   // @param pars structure of type pars
   // @return int 0 success, 1 failure
-  inline int eigen_lap(Eigen::PlainObjectBase<T1>& z, Eigen::MatrixBase<T2>& m, 
-                Eigen::PlainObjectBase<T3>& S,  
-                            lappars &pars){
-    int p=S.rows();
-    int nc=z.cols();
-    Eigen::SelfAdjointEigenSolver<MatrixXd> eh(S); // negative hessian
-    VectorXd evalinv(eh.eigenvalues().array().inverse().matrix());
-    
-    int excess=0;
-    for (int i=0; i<p; i++){
-      if (evalinv(i) < pars.eigvalthresh) {
-        excess++;
+  inline int krylov_invsqrt(Eigen::Ref<VectorXd> b, const Op& S, lappars &pars){
+    int p = b.size();
+    int kmax = std::min(pars.krylov_max_iter, p);
+    double bnorm = b.norm();
+    if (bnorm == 0.0) return 0;
+    MatrixXd V(p, kmax);
+    VectorXd alpha(kmax);
+    VectorXd beta(kmax);
+    VectorXd w(p);
+    VectorXd c;
+    VectorXd cold;
+    int k = 0;
+    bool done = false;
+    V.col(0) = b/bnorm;
+    while (!done){
+      w = S.matvec(V.col(k));
+      if (k > 0) w -= beta(k-1)*V.col(k-1);
+      alpha(k) = w.dot(V.col(k));
+      w -= alpha(k)*V.col(k);
+      beta(k) = w.norm();
+      k++;
+      bool breakdown = beta(k-1) <= 1e-12*std::abs(alpha(k-1));
+      done = breakdown || (k == kmax);
+      if (done || (k % 5 == 0)){
+        if (lanczos_invsqrt_e1(alpha.head(k), beta.head(k-1), c, pars) == 1) 
+          return 1;
+        if (cold.size() > 0){
+          double diff = (c.head(cold.size()) - cold).squaredNorm() + 
+            c.tail(k-cold.size()).squaredNorm();
+          if (sqrt(diff) <= pars.krylov_tol*c.norm()) done = true;
+        }
+        cold = c;
       }
+      if (!done) V.col(k) = w/beta(k-1);
+    }
+    b.noalias() = bnorm*(V.leftCols(k)*c);
+    return 0;
+  }
+  
+  template <typename Op>
+  // Stochastic lanczos quadrature estimate of log|S| added (with sign 
+  //   flipped) to pars.logInvNegHessDet, uses krylov_probes rademacher probes
+  //   and up to krylov_max_iter lanczos steps per probe. 
+  // @param S operator with products with the hessian of the NEGATIVE 
+  //    log-likelihood (must provide matvec() and rows())
+  // @param pars structure of type pars
+  // @return int 0 success, 1 failure
+  inline int krylov_logdet(const Op& S, lappars &pars){
+    int p = S.rows();
+    int kmax = std::min(pars.krylov_max_iter, p);
+    VectorXd z(p);
+    VectorXd vold(p);
+    VectorXd v(p);
+    VectorXd w(p);
+    VectorXd alpha(kmax);
+    VectorXd beta(kmax);
+    double ld = 0.0;
+    for (int l=0; l<pars.krylov_probes; l++){
+      pars.fillnormal(z);
+      v = z.array().sign().matrix()/sqrt((double) p); // rademacher
+      vold.setZero();
+      int k=0;
+      while (k < kmax){
+        w = S.matvec(v);
+        if (k > 0) w -= beta(k-1)*vold;
+        alpha(k) = w.dot(v);
+        w -= alpha(k)*v;
+        beta(k) = w.norm();
+        k++;
+        if (beta(k-1) <= 1e-12*std::abs(alpha(k-1))) break;
+        vold = v;
+        v = w/beta(k-1);
+      }
+      Eigen::SelfAdjointEigenSolver<MatrixXd> eh;
+      eh.computeFromTridiagonal(alpha.head(k), beta.head(k-1));
+      for (int i=0; i<k; i++){
+        double theta = eh.eigenvalues()(i);
+        if (1.0/theta < pars.eigvalthresh) return 1;
+        if (theta <= 0) continue;
+        ld += p*pow(eh.eigenvectors()(0,i), 2)*log(theta);
+      }
+    }
+    pars.logInvNegHessDet -= ld/pars.krylov_probes;
+    return 0;
+  }
+  
+  // Laplace approximation for one block of a block diagonal hessian
+  // @param z unit normals (one row per row of S) overwritten with the 
+  //   (mean zero) samples 
+  // @param S block of the hessian of the NEGATIVE log-likelihood 
+  //   (overwritten)
+  // @param decomp_method "eigen" or "cholesky" 
+  // @param eigvalthresh (for "eigen") threshold for negative eigenvalues 
+  // @param logdet on return log determinant of S^{-1} (over the eigenvalues 
+  //   kept for "eigen")
+  // @return int 0 success, 1 failure, 2 success after eigenvalues were 
+  //   chopped ("eigen" only)
+  // Safe to call from multiple threads (no R API calls)
+  inline int block_lap(Eigen::Ref<MatrixXd> z, MatrixXd& S, 
+                       const std::string& decomp_method, double eigvalthresh, 
+                       double& logdet){
+    if (decomp_method=="cholesky"){
+      Eigen::LLT<Eigen::Ref<MatrixXd> > hesssqrt(S);
+      if (hesssqrt.info() != Eigen::Success) return 1;
+      logdet = -2.0*hesssqrt.matrixLLT().diagonal().array().log().sum();
+      hesssqrt.matrixU().solveInPlace(z);
+      return 0;
+    } else if (decomp_method=="eigen"){
+      Eigen::SelfAdjointEigenSolver<MatrixXd> eh(S);
+      VectorXd evalinv = eh.eigenvalues().array().inverse().matrix();
+      if ((evalinv.array() < eigvalthresh).any()) return 1;
+      int status = 0;
+      logdet = 0.0;
+      for (int i=0; i<evalinv.size(); i++){
+        if (evalinv(i) > 0){
+          logdet += std::log(evalinv(i));
+          evalinv(i) = std::sqrt(evalinv(i));
+        } else {
+          evalinv(i) = 0.0; // chopped
+          status = 2;
+        }
+      }
+      MatrixXd zl = eh.eigenvectors()*evalinv.asDiagonal()*z;
+      z = zl;
+      return status;
+    }
+    return 1;
+  }
+  
+  // Overwrites the P x P diagonal blocks of the hessian of the NEGATIVE 
+  //   log-likelihood (row bound together, N*P x P) with their lower 
+  //   cholesky factors L_i (in place, in parallel)
+  // @return int 0 success, otherwise 1 + index of the first failed block
+  inline int block_llt(MatrixXd& B){
+    int b = B.cols();
+    int q = B.rows()/b;
+    std::vector<int> blockstatus(q, 0);
+    #pragma omp parallel for
+    for (int i=0; i < q; i++){
+      Eigen::Ref<MatrixXd> Bi = B.middleRows(b*i, b);
+      Eigen::LLT<Eigen::Ref<MatrixXd> > llt(Bi);
+      if (llt.info() != Eigen::Success) blockstatus[i] = 1;
     }
-    if (excess > 0){
-      Rcpp::warning("Some eigenvalues are below eigvalthresh");
-      Rcout << "Eigenvalues" << evalinv.transpose() << std::endl;
+    for (int i=0; i < q; i++){
+      if (blockstatus[i] == 1) return i+1;
+    }
+    return 0;
+  }
+  
+  // Overwrites Z with L^{-1}Z (trans=false) or L^{-T}Z (trans=true) for L 
+  //   block diagonal with lower cholesky factors from block_llt
+  inline void block_llt_solve(const MatrixXd& L, Eigen::Ref<MatrixXd> Z, 
+                              bool trans){
+    int b = L.cols();
+    int q = L.rows()/b;
+    #pragma omp parallel for
+    for (int i=0; i < q; i++){
+      Eigen::Ref<MatrixXd> Zi = Z.middleRows(b*i, b);
+      if (trans){
+        L.middleRows(b*i, b).transpose().triangularView<Eigen::Upper>().solveInPlace(Zi);
+      } else {
+        L.middleRows(b*i, b).triangularView<Eigen::Lower>().solveInPlace(Zi);
+      }
+    }
+  }
+  
+  template <typename Op>
+  // Low rank plus block diagonal factorization of the hessian of the 
+  //   NEGATIVE log-likelihood S ~ L(I + U*diag(theta-1)*U')L' where LL' is 
+  //   the (block) cholesky of the block diagonal part of S and 
+  //   (theta, U) are the pars.lowrank_rank ritz pairs of L^{-1}SL^{-T} 
+  //   furthest from 1 (largest |log(theta)|), found by lanczos with full 
+  //   reorthogonalization over products with S. Exact when k >= rows of S. 
+  //   Ritz values that fail eigvalthresh signal failure, small negative 
+  //   ones are chopped (as in eigen_lap). 
+  // @param S operator with products with the hessian of the NEGATIVE 
+  //    log-likelihood (must provide matvec() and rows())
+  // @param L diagonal blocks of S row bound together, overwritten with 
+  //    their lower cholesky factors
+  // @param U overwritten with the (orthonormal) p x k ritz vectors
+  // @param s overwritten with theta^{-1/2} - 1 (-1 for chopped values) so 
+  //    that S^{-1/2} = L^{-T}(I + U*diag(s)*U')
+  // @param pars structure of type pars
+  // @return int 0 success, 1 failure
+  inline int lowrank_decompose(const Op& S, MatrixXd& L, MatrixXd& U, 
+                               VectorXd& s, lappars &pars){
+    int p = S.rows();
+    int blockstatus = block_llt(L);
+    if (blockstatus != 0){
+      if (!pars.quiet)
+        Rcpp::warning("Decomposition of block " + std::to_string(blockstatus) + 
+          " of the Hessian failed");
       return 1;
     }
-    int pos = 0;
-    for (int i=0; i<p; i++){
-      if (evalinv(pos) > 0)
-        pos++;
+    int b = L.cols();
+    for (int i=0; i < p/b; i++)
+      pars.logInvNegHessDet -= 2.0*L.middleRows(b*i, b).diagonal().array().log().sum();
+    
+    // lanczos on L^{-1}SL^{-T}, extra steps so the extreme ritz pairs converge
+    int k = std::min(pars.lowrank_rank, p);
+    if (k <= 0){ // block diagonal only (as "partial")
+      U.resize(p, 0);
+      s.resize(0);
+      return 0;
+    }
+    int kmax = std::min(p, std::max(2*k, k+20));
+    MatrixXd V(p, kmax);
+    VectorXd alpha(kmax);
+    VectorXd beta(kmax);
+    VectorXd w(p);
+    pars.fillnormal(V.col(0));
+    V.col(0).normalize();
+    int j = 0;
+    while (j < kmax){
+      w = V.col(j);
+      block_llt_solve(L, w, true);
+      w = S.matvec(w);
+      block_llt_solve(L, w, false);
+      alpha(j) = w.dot(V.col(j));
+      for (int pass=0; pass<2; pass++) // full reorthogonalization
+        w.noalias() -= V.leftCols(j+1)*(V.leftCols(j+1).transpose()*w);
+      beta(j) = w.norm();
+      j++;
+      if ((j == kmax) || (beta(j-1) <= 1e-12*std::abs(alpha(j-1)))) break;
+      V.col(j) = w/beta(j-1);
+    }
+    Eigen::SelfAdjointEigenSolver<MatrixXd> eh;
+    eh.computeFromTridiagonal(alpha.head(j), beta.head(j-1));
+    const VectorXd& theta = eh.eigenvalues();
+    for (int i=0; i<j; i++){
+      if (1.0/theta(i) < pars.eigvalthresh){
+        if (!pars.quiet){
+          Rcpp::warning("Some eigenvalues are below eigvalthresh");
+          Rcout << "Ritz values" << theta.transpose() << std::endl;
+        }
+        return 1;
+      }
+    }
+    
+    // keep the k ritz pairs furthest from 1
+    k = std::min(k, j);
+    std::vector<int> idx(j);
+    for (int i=0; i<j; i++) idx[i] = i;
+    auto dist = [&theta](int i){ 
+      return (theta(i) > 0) ? std::abs(std::log(theta(i))) : INFINITY; 
+    };
+    std::partial_sort(idx.begin(), idx.begin()+k, idx.end(), 
+                      [&dist](int a, int b){ return dist(a) > dist(b); });
+    MatrixXd Y(j, k);
+    s.resize(k);
+    int nchopped = 0;
+    for (int i=0; i<k; i++){
+      Y.col(i) = eh.eigenvectors().col(idx[i]);
+      if (theta(idx[i]) > 0){
+        pars.logInvNegHessDet -= std::log(theta(idx[i]));
+        s(i) = 1.0/std::sqrt(theta(idx[i])) - 1.0;
+      } else {
+        s(i) = -1.0; // chopped
+        nchopped++;
+      }
     }
-    if (pos < p) {
+    if ((nchopped > 0) && !pars.quiet) {
       Rcpp::warning("Some small negative eigenvalues are being chopped");
-      Rcout << p-pos << " out of " << p <<
+      Rcout << nchopped << " out of " << k <<
         " passed eigenvalue threshold" << std::endl;
     }
-    
-    pars.logInvNegHessDet += evalinv.array().log().sum();
-    
-    MatrixXd invhesssqrt(p, pos);
-    invhesssqrt = eh.eigenvectors().rightCols(pos)*
-      evalinv.tail(pos).cwiseSqrt().asDiagonal(); //V*D^{-1/2}
-    typename T1::PlainObject samp(pos, nc);
-    fillUnitNormal(samp);
-    z.noalias() = invhesssqrt*samp;
-    z.colwise() += m;
+    U.noalias() = V.leftCols(j)*Y;
     return 0;
   }
   
-  template <typename T1, typename T2, typename T3> 
+  // Overwrites unit normals z with (mean zero) samples 
+  //   L^{-T}(I + U*diag(s)*U')z from the factors of lowrank_decompose, 
+  //   O(k*p + p*P) per sample for P x P blocks 
+  inline void lowrank_sample(Eigen::Ref<MatrixXd> z, const MatrixXd& L, 
+                             const MatrixXd& U, const VectorXd& s){
+    MatrixXd Uz(U.cols(), z.cols());
+    Uz.noalias() = U.transpose()*z;
+    z.noalias() += U*(s.asDiagonal()*Uz);
+    block_llt_solve(L, z, true);
+  }
+  
+  // Operator given by a function (products with the hessian of the 
+  //   NEGATIVE log-likelihood) e.g., a NegHessOp held by LaplaceSampler
+  class FunctionOp {
+    private:
+      int p;
+      std::function<VectorXd(const Ref<const VectorXd>&)> f;
+    public:
+      FunctionOp() : p(0) {}
+      template <typename Op>
+      FunctionOp(const Op& S) : p(S.rows()), 
+        f([S](const Ref<const VectorXd>& v){ return S.matvec(v); }) {}
+      int rows() const { return p; }
+      VectorXd matvec(const Ref<const VectorXd>& v) const { return f(v); }
+  };
+  
+  // Laplace approximation that decomposes the hessian once and then draws 
+  //   samples in chunks of any size (e.g., so samples can be used and 
+  //   discarded chunk by chunk rather than all n_samples held at once). 
+  //   Normals come from pars.fillnormal. The single call functions below 
+  //   (LaplaceApproximation and its Krylov and LowRank counterparts) 
+  //   decompose and sample once on a LaplaceSampler, so with the same seed 
+  //   their samples equal the chunks concatenated. 
+  class LaplaceSampler {
+    private:
+      VectorXd m;
+      std::string method;       // "cholesky", "eigen", "partial", "krylov" 
+                                //   or "lowrank"
+      MatrixXd L;               // "cholesky" lower cholesky factor (in the 
+                                //   memory of the S passed to decompose), 
+                                //   "lowrank" block cholesky factors 
+      MatrixXd W;               // "eigen" V*D^{-1/2}, "partial" S_i^{-1/2} 
+                                //   row bound together (in the memory of 
+                                //   the S passed to decompose)
+      FunctionOp S;             // "krylov" 
+      MatrixXd U;               // "lowrank" ritz vectors and coefficients 
+      VectorXd s;               //   (see lowrank_decompose)
+      
+    public:
+      lappars pars;
+      
+      LaplaceSampler(const Ref<const VectorXd>& m_, double eigvalthresh, 
+                     long seed=-1) : 
+      m(m_), pars(init_lappars(eigvalthresh, seed)) {}
+      
+      // @param pars_ copied (the normals continue the stream of pars_)
+      LaplaceSampler(const Ref<const VectorXd>& m_, const lappars& pars_) : 
+      m(m_), pars(pars_) {}
+      
+      // @param S the hessian of the NEGATIVE log-likelihood evaluated at m 
+      //   (only the lower triangle is read) or its diagonal blocks row bound 
+      //   together as in LaplaceApproximation, for "cholesky" and for blocks 
+      //   S is factored in place and its memory taken over by the sampler, 
+      //   leaving S empty, otherwise S is overwritten 
+      // @param decomp_method "eigen" or "cholesky" (of S or of each block)
+      // @param jitter amount of jitter to add to diagonal
+      // @return int 0 success, 1 failure
+      int decompose(MatrixXd& S, std::string decomp_method, double jitter){
+        int nr = S.rows();
+        int nc = S.cols();
+        if (nr != nc){
+          if ((nr % nc) != 0)
+            Rcpp::stop("Rectangular Hessian of wrong dimension passed");
+          method = "partial";
+          int q = nr/nc;
+          W.swap(S);
+          std::vector<int> blockstatus(q, 0);
+          double logdet = 0.0;
+          #pragma omp parallel for reduction(+:logdet)
+          for (int i=0; i < q; i++){
+            MatrixXd Sl = W.middleRows(nc*i, nc);
+            if (jitter > 0)
+              Sl.diagonal().array() += jitter;
+            double ldl = 0.0;
+            W.middleRows(nc*i, nc).setIdentity();
+            blockstatus[i] = block_lap(W.middleRows(nc*i, nc), Sl, 
+                                       decomp_method, pars.eigvalthresh, ldl);
+            logdet += ldl;
+          }
+          int nchopped = 0;
+          for (int i=0; i < q; i++){
+            if (blockstatus[i] == 1){
+              if (!pars.quiet)
+                Rcpp::warning("Decomposition of block " + std::to_string(i+1) + 
+                  " of the Hessian failed");
+              return 1;
+            }
+            if (blockstatus[i] == 2) nchopped++;
+          }
+          if ((nchopped > 0) && !pars.quiet){
+            Rcpp::warning("Some small negative eigenvalues are being chopped");
+            Rcout << "in " << nchopped << " out of " << q << " blocks" << std::endl;
+          }
+          pars.logInvNegHessDet += logdet;
+          return 0;
+        }
+        if (jitter > 0)
+          S.diagonal().array() += jitter;
+        method = decomp_method;
+        if (decomp_method=="cholesky"){
+          L.swap(S);
+          #ifdef FIDO_USE_MKL
+            if (LAPACKE_dpotrf(LAPACK_COL_MAJOR, 'L', L.rows(), L.data(), 
+                               L.rows()) != 0){
+              if (!pars.quiet) Rcpp::warning("Cholesky of Hessian failed");
+              return 1;
+            }
+          #else
+            Eigen::LLT<Eigen::Ref<MatrixXd> > llt(L); // in place
+            if (llt.info() == Eigen::NumericalIssue){
+              if (!pars.quiet)
+                Rcpp::warning("Cholesky of Hessian failed with status status Eigen::NumericalIssue");
+              return 1;
+            }
+          #endif
+          pars.logInvNegHessDet -= 2.0*L.diagonal().array().log().sum();
+          return 0;
+        } else if (decomp_method=="eigen"){
+          Eigen::SelfAdjointEigenSolver<MatrixXd> eh(S);
+          VectorXd evalinv(eh.eigenvalues().array().inverse().matrix());
+          if ((evalinv.array() < pars.eigvalthresh).any()){
+            if (!pars.quiet){
+              Rcpp::warning("Some eigenvalues are below eigvalthresh");
+              Rcout << "Eigenvalues" << evalinv.transpose() << std::endl;
+            }
+            return 1;
+          }
+          int p = S.rows();
+          int pos = (evalinv.array() > 0).count();
+          if ((pos < p) && !pars.quiet) {
+            Rcpp::warning("Some small negative eigenvalues are being chopped");
+            Rcout << p-pos << " out of " << p <<
+              " passed eigenvalue threshold" << std::endl;
+          }
+          pars.logInvNegHessDet += evalinv.tail(pos).array().log().sum();
+          W = eh.eigenvectors().rightCols(pos)*
+            evalinv.tail(pos).cwiseSqrt().asDiagonal(); //V*D^{-1/2}
+          return 0;
+        }
+        return 1;
+      }
+      
+      template <typename T>
+      // Matrix free counterpart of decompose (decomp_method "krylov"), only 
+      //   the log determinant is computed here (see krylov_logdet)
+      // @param H operator (e.g., mongrel::StructuredHessian) providing 
+      //    matvec() and rows() for the hessian of the POSITIVE log-likelihood 
+      //    evaluated at m, must outlive the sampler
+      // @param jitter amount of jitter to add to diagonal
+      // @return int 0 success, 1 failure
+      int decompose(const T& H, double jitter){
+        method = "krylov";
+        S = FunctionOp(NegHessOp<T>(H, jitter));
+        if (krylov_logdet(S, pars) == 1){
+          if (!pars.quiet) Rcpp::warning("Lanczos found eigenvalues below eigvalthresh");
+          return 1;
+        }
+        return 0;
+      }
+      
+      template <typename T>
+      // Low rank plus block diagonal counterpart of decompose (decomp_method 
+      //   "lowrank", see lowrank_decompose) 
+      // @param H operator (e.g., mongrel::StructuredHessian) providing 
+      //    matvec() and rows() for the hessian of the POSITIVE log-likelihood 
+      //    evaluated at m, only used within this call
+      // @param blocks diagonal blocks of the hessian of the NEGATIVE 
+      //    log-likelihood row bound together, memory taken over by the 
+      //    sampler (left empty)
+      // @param jitter amount of jitter to add to diagonal
+      // @return int 0 success, 1 failure
+      int decompose(const T& H, MatrixXd& blocks, double jitter){
+        method = "lowrank";
+        int b = blocks.cols();
+        if ((b == 0) || (blocks.rows() != H.rows()) || ((blocks.rows() % b) != 0))
+          Rcpp::stop("Hessian blocks of wrong dimension passed");
+        L.swap(blocks);
+        if (jitter > 0){
+          for (int i=0; i < L.rows()/b; i++)
+            L.middleRows(b*i, b).diagonal().array() += jitter;
+        }
+        return lowrank_decompose(NegHessOp<T>(H, jitter), L, U, s, pars);
+      }
+      
+      // number of rows of the samples (length of m)
+      int rows() const { return m.size(); }
+      
+      // normals for subsequent samples from seed (as init_lappars), e.g., 
+      //   to draw further samples after decomposing once 
+      void reseed(long seed, uint64_t stream0=0){
+        pars.fillnormal = init_lappars(pars.eigvalthresh, seed, stream0).fillnormal;
+      }
+      
+      // Log density of the laplace approximation N(m, S^{-1}) (S as 
+      //   decomposed, chopped directions ignored so the density is that of 
+      //   the normal over the kept directions) at each column of eta, 
+      //   O(p^2) per column for "cholesky" and "eigen", O((k+P)*p) for 
+      //   "lowrank" and O(p*P^2) for "partial" (P x P blocks)
+      // @param eta length(m) x K 
+      // @param out overwritten with the K log densities
+      // @return int 0 success, 1 failure ("krylov" is not supported)
+      int logdensity(const Ref<const MatrixXd>& eta, Ref<VectorXd> out) const {
+        int p = m.size();
+        int kept = p; // directions not chopped (dimension of the normal)
+        MatrixXd X = eta.colwise() - m;
+        VectorXd quad(X.cols());
+        if (method=="cholesky"){ // S = LL'
+          MatrixXd Y = L.triangularView<Eigen::Lower>().transpose()*X;
+          quad = Y.colwise().squaredNorm();
+        } else if (method=="eigen"){ // W = V*D^{-1/2}
+          VectorXd d = W.colwise().squaredNorm().cwiseInverse();
+          MatrixXd Y = d.asDiagonal()*(W.transpose()*X);
+          quad = Y.colwise().squaredNorm();
+          kept = W.cols();
+        } else if (method=="partial"){ // block i of S is (W_i W_i')^{-1}
+          int b = W.cols();
+          kept = 0;
+          #pragma omp parallel for reduction(+:kept)
+          for (int i=0; i < p/b; i++){
+            Eigen::CompleteOrthogonalDecomposition<MatrixXd> 
+              cod(W.middleRows(b*i, b));
+            MatrixXd Xi = cod.solve(X.middleRows(b*i, b));
+            X.middleRows(b*i, b) = Xi;
+            kept += cod.rank();
+          }
+          quad = X.colwise().squaredNorm();
+        } else if (method=="lowrank"){ // S = L(I + U*diag(theta-1)*U')L'
+          int b = L.cols();
+          #pragma omp parallel for
+          for (int i=0; i < p/b; i++){
+            MatrixXd Xi = L.middleRows(b*i, b).transpose()
+              .triangularView<Eigen::Upper>()*X.middleRows(b*i, b);
+            X.middleRows(b*i, b) = Xi;
+          }
+          VectorXd theta(s.size());
+          for (int i=0; i<s.size(); i++){ // 0 for chopped
+            theta(i) = (s(i) > -1.0) ? 1.0/((1.0+s(i))*(1.0+s(i))) : 0.0;
+            if (!(s(i) > -1.0)) kept--;
+          }
+          MatrixXd UX = U.transpose()*X;
+          quad = X.colwise().squaredNorm();
+          quad += ((theta.array()-1.0).matrix().transpose()*
+            UX.array().square().matrix()).transpose();
+        } else {
+          return 1;
+        }
+        out = -0.5*(quad.array() + kept*std::log(2*M_PI) + pars.logInvNegHessDet);
+        return 0;
+      }
+      
+      // @param z overwritten with samples (one per column), must have 
+      //   length(m) rows
+      // @return int 0 success, 1 failure
+      int sample(Ref<MatrixXd> z){
+        int nc = z.cols();
+        if (method=="cholesky"){
+          pars.fillnormal(z);
+          #ifdef FIDO_USE_MKL
+            LAPACKE_dtrtrs(LAPACK_COL_MAJOR, 'L', 'T', 'N', L.cols(), nc, 
+                           L.data(), L.rows(), z.data(), z.outerStride());
+          #else
+            L.triangularView<Eigen::Lower>().transpose().solveInPlace(z);
+          #endif
+        } else if (method=="eigen"){
+          MatrixXd samp(W.cols(), nc);
+          pars.fillnormal(samp);
+          z.noalias() = W*samp;
+        } else if (method=="partial"){
+          int b = W.cols();
+          int q = W.rows()/b;
+          pars.fillnormal(z);
+          #pragma omp parallel for
+          for (int i=0; i < q; i++){
+            MatrixXd zl = W.middleRows(b*i, b)*z.middleRows(b*i, b);
+            z.middleRows(b*i, b) = zl;
+          }
+        } else if (method=="lowrank"){
+          pars.fillnormal(z);
+          lowrank_sample(z, L, U, s);
+        } else if (method=="krylov"){
+          pars.fillnormal(z);
+          for (int i=0; i<nc; i++){
+            if (krylov_invsqrt(z.col(i), S, pars) == 1){
+              if (!pars.quiet) Rcpp::warning("Lanczos found eigenvalues below eigvalthresh");
+              return 1;
+            }
+          }
+        } else {
+          return 1;
+        }
+        z.colwise() += m;
+        return 0;
+      }
+  };
+  
+  // Draws z from a sampler whose decompose returned status and passes 
+  //   logInvNegHessDet back to pars (the sampler was constructed from pars, 
+  //   so the normals continue the same stream) 
+  inline int sample_once(Ref<MatrixXd> z, LaplaceSampler& sampler, int status, 
+                         lappars &pars){
+    if (status == 0) status = sampler.sample(z);
+    pars.logInvNegHessDet = sampler.pars.logInvNegHessDet;
+    return status;
+  }
+  
+  template <typename T1, typename T2> 
   // @param z is object derived from class MatrixBase to overwrite with sample
   // @param m MAP estimate
-  // @param S the hessian of the NEGATIVE log-likelihood evaluated at m
+  // @param S the hessian of the NEGATIVE log-likelihood evaluated at m (only
+  //   the lower triangle is read, overwritten)
   // @param pars structure of type pars
   // @return int 0 success, 1 failure
-  inline int cholesky_lap(Eigen::PlainObjectBase<T1>& z, Eigen::MatrixBase<T2>& m, 
-                   Eigen::PlainObjectBase<T3>& S,  
-                   lappars &pars){ 
-    #ifdef FIDO_USE_MKL
-      LAPACKE_dpotrf(LAPACK_COL_MAJOR, 'U', S.rows(), S.data() , S.cols());
-      pars.logInvNegHessDet -=  2.0*S.diagonal().array().log().sum();
-      fillUnitNormal(z);
-      LAPACKE_dtrtrs(LAPACK_COL_MAJOR, 'U', 'N', 'N', S.cols(), z.cols(), S.data(),
-                    S.rows(), z.data(), z.rows());
-    #else 
-      Eigen::LLT<MatrixXd> hesssqrt;
-      hesssqrt.compute(S);
-      if (hesssqrt.info() == Eigen::NumericalIssue){
-          Rcpp::warning("Cholesky of Hessian failed with status status Eigen::NumericalIssue");
-          return 1;
-      }
-      pars.logInvNegHessDet -=  2.0*hesssqrt.matrixLLT().diagonal().array().log().sum();
-      fillUnitNormal(z);
-      hesssqrt.matrixU().solveInPlace(z);
-    #endif
-    z.colwise() += m;
-    return 0;
+  inline int eigen_lap(Eigen::PlainObjectBase<T1>& z, Eigen::MatrixBase<T2>& m, 
+                       MatrixXd& S, lappars &pars){
+    LaplaceSampler sampler(m, pars);
+    return sample_once(z, sampler, sampler.decompose(S, "eigen", 0), pars);
   }
   
-  template <typename T1, typename T2, typename T3> 
-  // chooses which laplace function to call based on parameter decomp_method
-  // @param decomp_method "eigen" or "cholesky"
-  inline int lap_picker(Eigen::PlainObjectBase<T1>& z, Eigen::MatrixBase<T2>& m, 
-                 Eigen::PlainObjectBase<T3>& S, 
-                 lappars &pars, String decomp_method){
-    if (decomp_method=="eigen"){
-      return eigen_lap(z, m, S, pars);
-    } else if (decomp_method=="cholesky"){
-      return cholesky_lap(z, m, S, pars);
-    }
-    return 1;
+  template <typename T1, typename T2> 
+  // @param z is object derived from class MatrixBase to overwrite with sample
+  // @param m MAP estimate
+  // @param S the hessian of the NEGATIVE log-likelihood evaluated at m, only
+  //   the lower triangle is read and it is factored in place (no copy is 
+  //   made, S is left empty)
+  // @param pars structure of type pars
+  // @return int 0 success, 1 failure
+  inline int cholesky_lap(Eigen::PlainObjectBase<T1>& z, Eigen::MatrixBase<T2>& m, 
+                          MatrixXd& S, lappars &pars){ 
+    LaplaceSampler sampler(m, pars);
+    return sample_once(z, sampler, sampler.decompose(S, "cholesky", 0), pars);
   }
   
+  template <typename T1, typename T2>
+  // @param z an object derived from class MatrixBase to overwrite with samples
+  // @param m MAP estimate (as a vector)
+  // @param S the hessian of the NEGATIVE log-likelihood evaluated at m 
+  //    block diagonal forms (e.g., StructuredHessian::diagonalBlocks) 
+  //    should be given as blocks row bound together, blocks must be 
+  //    square and of the same size! Blocks are then decomposed 
+  //    independently (in parallel), O(q*b^3) for q blocks of size b. 
+  //    S is left empty or overwritten (see LaplaceSampler::decompose)
+  // @param decomp_method  "eigen" or "cholesky"
+  // @param jitter amount of jitter to add to diagonal
+  // @param pars structure of type pars (eigvalthresh, source of normals, 
+  //   and on return logInvNegHessDet)
+  // @return int 0 success, 1 failure
+  inline int LaplaceApproximation(Eigen::PlainObjectBase<T1>& z, Eigen::MatrixBase<T2>& m, 
+                           MatrixXd& S,
+                           std::string decomp_method, 
+                           double jitter, 
+                           lappars &pars){
+    LaplaceSampler sampler(m, pars);
+    return sample_once(z, sampler, sampler.decompose(S, decomp_method, jitter), 
+                       pars);
+  }
   
-  
-  template <typename T1, typename T2, typename T3>
+  template <typename T1, typename T2>
   // @param z an object derived from class MatrixBase to overwrite with samples
   // @param m MAP estimate (as a vector)
-  // @param S the hessian of the POSITIVE log-likelihood evaluated at m 
+  // @param S the hessian of the NEGATIVE log-likelihood evaluated at m 
   //    block forms should be given as blocks row bound together, blocks 
   //    must be square and of the same size!
   // @param decomp_method  "eigen" or "cholesky"
@@ -137,61 +766,111 @@ namespace lapap{
   // @param jitter amount of jitter to add to diagonal
   // @parameter logInvNegHessDet if passed will return Log of Determinant of 
   //   Laplace Approximation Covariance
-  // @parameter seed (random seed) 
+  // @parameter seed (random seed, normals from philox streams keyed by seed, 
+  //   if -1 from the ziggurat generator) 
   // @return MatrixXd columns are samples 
   inline int LaplaceApproximation(Eigen::PlainObjectBase<T1>& z, Eigen::MatrixBase<T2>& m, 
-                           Eigen::PlainObjectBase<T3>& S,
-                           String decomp_method, 
+                           MatrixXd& S,
+                           std::string decomp_method, 
                            double eigvalthresh, 
                            double jitter, 
                            double& logInvNegHessDet, 
                            long seed=-1){
-    if (seed != -1) zigSetSeed(seed);
-    
-    lappars pars = init_lappars(eigvalthresh);
-    int nr = S.rows();
-    int nc = S.cols();
-    int n_samples=z.cols();
-    bool partial=false;
-    int status; 
-    if (nr != nc){
-      //Rcout << "Detected Block Digonal" << std::endl;
-      if ( (nr % nc) != 0 ) {
-        Rcpp::stop("Rectangular Hessian of wrong dimension passed"); 
-      }
-      else {
-        partial=true;
-      }
-    }
- 
-    if (partial){
-      Rcpp::stop("Partial Hessian Not Implemented for MKL");
-      int q = nr/nc;
-      int pos=0;
-      MatrixXd zl = MatrixXd::Zero(nc, n_samples);
-      VectorXd ml = VectorXd::Zero(nc);
-      MatrixXd Sl = MatrixXd::Zero(nc, nc);
-      for (int i=0; i < q; i++){
-        pos = nc*i;
-        ml = m.segment(pos,nc);
-        Sl = S.middleRows(pos, nc);
-        if (jitter > 0)
-          Sl.diagonal().array() += jitter;
-        status = lap_picker(zl, ml, Sl, pars, decomp_method);
-        z.middleRows(pos,nc) = zl.eval();
-        if (status == 1) { return status; } // stop early if failure
-      }
-    } else {
-      if (jitter > 0)
-        S.diagonal().array() += jitter; 
-      status = lap_picker(z, m, S, pars, decomp_method);
-    }
+    lappars pars = init_lappars(eigvalthresh, seed);
+    int status = LaplaceApproximation(z, m, S, decomp_method, jitter, pars);
+    logInvNegHessDet = pars.logInvNegHessDet;
+    return status;
+  }
+  
+  template <typename T1, typename T2, typename T3>
+  // Matrix free counterpart of LaplaceApproximation taking a lappars 
+  //   structure (eigvalthresh, source of normals, and on return 
+  //   logInvNegHessDet) 
+  inline int LaplaceApproximationKrylov(Eigen::PlainObjectBase<T1>& z, 
+                                        Eigen::MatrixBase<T2>& m, 
+                                        const T3& H, 
+                                        double jitter, 
+                                        lappars &pars){
+    LaplaceSampler sampler(m, pars);
+    return sample_once(z, sampler, sampler.decompose(H, jitter), pars);
+  }
+  
+  template <typename T1, typename T2, typename T3>
+  // Matrix free counterpart of LaplaceApproximation (decomp_method "krylov")
+  // @param z an object derived from class MatrixBase to overwrite with samples
+  // @param m MAP estimate (as a vector)
+  // @param H operator (e.g., mongrel::StructuredHessian) providing matvec() 
+  //    and rows() for the hessian of the POSITIVE log-likelihood evaluated at m
+  // @param eigvalthresh threshold for negative ritz values dictates 
+  //    clipping vs. stopping behavior
+  // @param jitter amount of jitter to add to diagonal
+  // @parameter logInvNegHessDet (stochastic estimate of) Log of Determinant of 
+  //   Laplace Approximation Covariance
+  // @parameter seed (random seed, normals from philox streams keyed by seed, 
+  //   if -1 from the ziggurat generator) 
+  // @return int 0 success, 1 failure
+  inline int LaplaceApproximationKrylov(Eigen::PlainObjectBase<T1>& z, 
+                                        Eigen::MatrixBase<T2>& m, 
+                                        const T3& H, 
+                                        double eigvalthresh, 
+                                        double jitter, 
+                                        double& logInvNegHessDet, 
+                                        long seed=-1){
+    lappars pars = init_lappars(eigvalthresh, seed);
+    int status = LaplaceApproximationKrylov(z, m, H, jitter, pars);
+    logInvNegHessDet = pars.logInvNegHessDet;
+    return status;
+  }
+  
+  template <typename T1, typename T2, typename T3>
+  // Low rank plus block diagonal counterpart of LaplaceApproximation taking 
+  //   a lappars structure (eigvalthresh, lowrank_rank, source of normals, 
+  //   and on return logInvNegHessDet), see LaplaceSampler::decompose 
+  inline int LaplaceApproximationLowRank(Eigen::PlainObjectBase<T1>& z, 
+                                         Eigen::MatrixBase<T2>& m, 
+                                         const T3& H, 
+                                         MatrixXd& blocks,
+                                         double jitter, 
+                                         lappars &pars){
+    LaplaceSampler sampler(m, pars);
+    return sample_once(z, sampler, sampler.decompose(H, blocks, jitter), pars);
+  }
+  
+  template <typename T1, typename T2, typename T3>
+  // Low rank plus block diagonal counterpart of LaplaceApproximation 
+  //   (decomp_method "lowrank")
+  // @param z an object derived from class MatrixBase to overwrite with samples
+  // @param m MAP estimate (as a vector)
+  // @param H operator (e.g., mongrel::StructuredHessian) providing matvec() 
+  //    and rows() for the hessian of the POSITIVE log-likelihood evaluated at m
+  // @param blocks diagonal blocks of the hessian of the NEGATIVE 
+  //    log-likelihood row bound together (e.g., -diagonalBlocks() of a 
+  //    StructuredHessian), left empty
+  // @param eigvalthresh threshold for negative ritz values dictates 
+  //    clipping vs. stopping behavior
+  // @param jitter amount of jitter to add to diagonal
+  // @parameter logInvNegHessDet Log of Determinant of the (approximate) 
+  //   Laplace Approximation Covariance
+  // @parameter seed (random seed, normals from philox streams keyed by seed, 
+  //   if -1 from the ziggurat generator) 
+  // @return int 0 success, 1 failure
+  inline int LaplaceApproximationLowRank(Eigen::PlainObjectBase<T1>& z, 
+                                         Eigen::MatrixBase<T2>& m, 
+                                         const T3& H, 
+                                         MatrixXd& blocks,
+                                         double eigvalthresh, 
+                                         double jitter, 
+                                         double& logInvNegHessDet, 
+                                         long seed=-1){
+    lappars pars = init_lappars(eigvalthresh, seed);
+    int status = LaplaceApproximationLowRank(z, m, H, blocks, jitter, pars);
     logInvNegHessDet = pars.logInvNegHessDet;
     return status;
   }
+  
 }
 
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,263 @@
+#ifndef MALTIPOO_BLOCKCOORD_H
+#define MALTIPOO_BLOCKCOORD_H
+
+#include <RcppNumerical.h>
+#include <PibbleCollapsed.h>
+#include <AdamOptim.h>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+using namespace Rcpp;
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::ArrayXXd;
+using Eigen::ArrayXd;
+using Eigen::VectorXd;
+
+namespace maltipoo{
+
+  /* Block coordinate optimization of the collapsed Maltipoo model (see
+   *  MaltipooCollapsed) alternating between
+   *   1. eta with ell fixed: for fixed ell the model is the collapsed pibble
+   *      model with AInv = A(ell) = (I + sum_i e^{ell_i} G_i)^{-1},
+   *      G_i = X'U_iX, so A is set once and block_iter ADAM steps are
+   *      taken on a PibbleCollapsed model (no O(N^3) work per step).
+   *   2. ell with eta fixed: a cyclic pass over coordinates of (at most 5)
+   *      damped 1-D newton steps each, for coordinate i with B = I + sum_{j!=i} e^{ell_j} G_j = LL' and
+   *      L^{-1}G_iL^{-T} = W diag(lambda) W' (computed once per pass, or
+   *      only once overall if P=1 as then B = I)
+   *        A(s) = V diag(d) V', V = L^{-T}W, d_k = 1/(1 + e^s lambda_k)
+   *        log|AInv(s)| = log|B| + sum_k log(1 + e^s lambda_k)
+   *      so with T = EV each newton iteration costs O(N^2(D-1)) rather than
+   *      O(N^3). The last pass also gives A for the next eta block.
+   *  For P=1 (B = I, V orthonormal) A is handed to the eta block in Woodbury 
+   *  form A = I - F'F, F = diag(sqrt(1 - d))V' over the lambda_k > 0, so an 
+   *  ell update is O(N^2(D-1)) overall and A is never formed. For P>1 each 
+   *  pass decomposes B and G_i (O(N^3) per coordinate) and A is formed 
+   *  densely.
+   */
+  class EllCoordinate {
+    private:
+      int N;
+      int D;
+      double delta;
+      const MatrixXd& K;
+      MatrixXd V;        // L^{-T}W
+      VectorXd lambda;   // eigenvalues (>= 0)
+      double logdetB;
+      MatrixXd T;        // E*V
+      MatrixXd KT;       // K*T
+      bool orthonormal;  // V orthonormal (B = I)
+
+    public:
+      EllCoordinate(int D_, int N_, double upsilon, const MatrixXd& K_) :
+      N(N_), D(D_), K(K_) {
+        delta = 0.5*(upsilon + N + D - 2.0);
+      }
+
+      // decomposition for coordinate with G given B (B empty for identity)
+      void decompose(const MatrixXd& B, const MatrixXd& G){
+        Eigen::SelfAdjointEigenSolver<MatrixXd> eig;
+        if (B.size() == 0){
+          eig.compute(G);
+          V = eig.eigenvectors();
+          logdetB = 0;
+          orthonormal = true;
+        } else {
+          Eigen::LLT<MatrixXd> Bllt(B);
+          if (Bllt.info() != Eigen::Success)
+            throw std::runtime_error("Decomposition of I + sum_j e^ell_j X'U_jX failed");
+          MatrixXd M = Bllt.matrixL().solve(G);
+          M = Bllt.matrixL().solve(M.transpose()); // L^{-1}GL^{-T}
+          eig.compute(M);
+          V = Bllt.matrixL().transpose().solve(eig.eigenvectors());
+          logdetB = 2*Bllt.matrixLLT().diagonal().array().log().sum();
+          orthonormal = false;
+        }
+        lambda = eig.eigenvalues().cwiseMax(0.0);
+      }
+
+      // eta changed (E = eta - ThetaX)
+      void setE(const MatrixXd& E){
+        T.noalias() = E*V;
+        KT.noalias() = K*T;
+      }
+
+      // negative log-likelihood (terms depending on ell) at s, with 1st and
+      //   2nd derivatives if requested
+      double f(double s, double* df=0, double* d2f=0) const {
+        double a = exp(s);
+        ArrayXd al = a*lambda.array();
+        ArrayXd d = 1/(1 + al);
+        MatrixXd S = KT*d.matrix().asDiagonal()*T.transpose();
+        S.diagonal().array() += 1;
+        Eigen::PartialPivLU<MatrixXd> Sdec(S);
+        double ld = Sdec.matrixLU().diagonal().cwiseAbs().array().log().sum();
+        double val = delta*ld + 0.5*(D-1)*(logdetB + al.log1p().sum());
+        if (df){
+          MatrixXd H = T.transpose()*Sdec.solve(KT); // T'S^{-1}KT
+          ArrayXd u = -al*d.square();             // d/ds d
+          *df = delta*(u*H.diagonal().array()).sum() +
+            0.5*(D-1)*(al*d).sum();
+          if (d2f){
+            ArrayXd du = u*(1 - 2*al*d);
+            MatrixXd UH = u.matrix().asDiagonal()*H;
+            *d2f = delta*((du*H.diagonal().array()).sum() -
+              (UH.array()*UH.transpose().array()).sum()) +
+              0.5*(D-1)*(al*d.square()).sum();
+          }
+        }
+        return val;
+      }
+
+      // safeguarded (steps at most 1, backtracking) newton minimization of 
+      //   f from s
+      double minimize(double s, int max_iter=50, double tol=1e-8) const {
+        double fs = f(s);
+        for (int it=0; it<max_iter; it++){
+          double df, d2f;
+          f(s, &df, &d2f);
+          if (std::abs(df) < tol) break;
+          double step = (d2f > 0) ? -df/d2f : -df;
+          step = std::max(std::min(step, 1.0), -1.0);
+          double ftrial = f(s + step);
+          while (!(ftrial <= fs) && (std::abs(step) > tol)){
+            step *= 0.5;
+            ftrial = f(s + step);
+          }
+          if (!(ftrial <= fs)) break;
+          s += step;
+          fs = ftrial;
+          if (std::abs(step) < tol) break;
+        }
+        return s;
+      }
+
+      // A(s) and log|AInv(s)|, if V is orthonormal A is returned as its 
+      //   Woodbury factor F (A = I - F'F, see PibbleCollapsed lowrank) in 
+      //   O(N*rank(G)) and lowrank is set, otherwise A is formed densely
+      MatrixXd getA(double s, double& logdetAinv, bool& lowrank) const {
+        ArrayXd al = exp(s)*lambda.array();
+        logdetAinv = logdetB + al.log1p().sum();
+        lowrank = orthonormal;
+        if (!lowrank)
+          return V*(1/(1 + al)).matrix().asDiagonal()*V.transpose();
+        double thresh = 1e-12*lambda.maxCoeff();
+        int r = (lambda.array() > thresh).count();
+        MatrixXd F(r, N);
+        for (int k=0, i=0; k<N; k++){
+          if (!(lambda(k) > thresh)) continue;
+          F.row(i++) = sqrt(al(k)/(1 + al(k)))*V.col(k).transpose();
+        }
+        return F;
+      }
+  };
+
+  // Optimizes eta (D-1 x N, as a vector) and ell (P) of the collapsed
+  //   Maltipoo model by block coordinate descent (see EllCoordinate)
+  //   XTUX : PN x N stacked X'U_iX
+  //   block_iter : ADAM steps on eta between ell updates
+  //   useChol : as in PibbleCollapsed
+  //   nllopt : negative LogLik at optima (as MaltipooCollapsed)
+  //   Other parameters as in adam::optim_adam, max_iter counts ADAM steps.
+  //   Stops once an eta block meets the ADAM stopping criteria after an
+  //   ell update that moved ell less than eps_g*max(|ell|, 1).
+  //   Returns 1 or 2 (converged) or -1 (max iterations hit).
+  inline int optim_block_coordinate(const ArrayXXd& Y, const double upsilon,
+                                    const MatrixXd& ThetaX, const MatrixXd& K,
+                                    const MatrixXd& XTUX,
+                                    Numer::Refvec eta, VectorXd& ell,
+                                    double& nllopt, int block_iter,
+                                    double b1, double b2, double step_size,
+                                    double epsilon, double eps_f, double eps_g,
+                                    int max_iter, bool verbose,
+                                    int verbose_rate, bool useChol){
+    int D = Y.rows();
+    int N = Y.cols();
+    int P = ell.size();
+    EllCoordinate ec(D, N, upsilon, K);
+    if (P == 1) ec.decompose(MatrixXd(), XTUX);
+    adam::ADAMState state;
+    MatrixXd A;
+    double logdetAinv = 0;
+    bool lowrankA = false;
+    int status = 0;
+    int outer = 0;
+    if (P == 1){ // A at initial ell
+      A = ec.getA(ell(0), logdetAinv, lowrankA);
+    } else {
+      MatrixXd Ainv = MatrixXd::Identity(N, N);
+      for (int i=0; i<P; i++) Ainv += exp(ell(i))*XTUX.middleRows(N*i, N);
+      Eigen::LLT<MatrixXd> Ainvllt(Ainv);
+      if (Ainvllt.info() != Eigen::Success)
+        throw std::runtime_error("Decomposition of I + sum_j e^ell_j X'U_jX failed");
+      A = Ainvllt.solve(MatrixXd::Identity(N, N));
+      logdetAinv = 2*Ainvllt.matrixLLT().diagonal().array().log().sum();
+    }
+    std::unique_ptr<PibbleCollapsed> cm(new PibbleCollapsed(Y, upsilon, 
+                                                            ThetaX, K, A, true, 
+                                                            useChol, lowrankA));
+    while (status == 0){
+      R_CheckUserInterrupt();
+      // eta block with A fixed
+      adam::ADAMFun fun(*cm);
+      adam::ADAMOptim optim(fun, eta, b1, b2, step_size, epsilon, eps_f,
+                            eps_g, max_iter, false, verbose_rate);
+      if (state.t > 0) optim.setState(state);
+      int estatus = 0;
+      for (int k=0; (k<block_iter) && (estatus==0); k++){
+        estatus = optim.step();
+      }
+      state = optim.getState();
+      eta = optim.getTheta();
+      if (estatus < 0){
+        status = -1;
+        break;
+      }
+
+      // ell update with eta fixed (a few damped newton steps per block so 
+      //   that ell does not run ahead of eta)
+      MatrixXd E = Map<MatrixXd>(eta.data(), D-1, N) - ThetaX;
+      double ellchange = 0;
+      for (int i=0; i<P; i++){
+        if (P > 1){
+          MatrixXd B = MatrixXd::Identity(N, N);
+          for (int j=0; j<P; j++){
+            if (j != i) B += exp(ell(j))*XTUX.middleRows(N*j, N);
+          }
+          ec.decompose(B, XTUX.middleRows(N*i, N));
+        }
+        ec.setE(E);
+        double s = ec.minimize(ell(i), 5);
+        ellchange = std::max(ellchange, std::abs(s - ell(i)));
+        ell(i) = s;
+        if (i == P-1) A = ec.getA(s, logdetAinv, lowrankA);
+      }
+      // model for the next eta block, evaluated at the current (eta, ell)
+      cm.reset(new PibbleCollapsed(Y, upsilon, ThetaX, K, A, true, useChol, 
+                                   lowrankA));
+      cm->updateWithEtaLL(eta);
+      nllopt = -cm->calcLogLik(eta) + 0.5*(D-1)*logdetAinv;
+      outer++;
+      if (verbose && (outer % verbose_rate == 0)){
+        Rcout << "block : " << outer << ", iter : " << state.t << std::endl;
+        Rcout << "-Log Like: " << nllopt << std::endl;
+        Rcout << "max change in ell: " << ellchange << std::endl;
+      }
+      if ((estatus > 0) &&
+          (ellchange <= eps_g*std::max(ell.lpNorm<Eigen::Infinity>(), 1.0))){
+        status = estatus;
+      }
+    }
+    if (status == -1){
+      Rcpp::warning("Max iterations hit, may not be at optima");
+    } else if (verbose){
+      Rcout << "Optimization terminated: eta and ell converged" << std::endl;
+    }
+    return status;
+  }
+
+}
+
+#endif
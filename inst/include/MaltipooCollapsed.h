@@ -3,6 +3,8 @@
 
 #include <RcppNumerical.h>
 #include <MatrixAlgebra.h>
+#include <StructuredHessian.h>
+#include <stdexcept>
 using namespace Rcpp;
 using Eigen::Map;
 using Eigen::MatrixXd;
@@ -27,6 +29,11 @@ using Eigen::Ref;
  *  by MAP. 
  *  
  *  matrix, and U_1,...U_P are Q x Q covariance matrix
+ *  
+ *  If chol=true S (and AInv) are factored in symmetric positive definite 
+ *  form with LLT rather than LU (see PibbleCollapsedT), with K = LL', 
+ *  S is similar to I + L'EAE'L (with the sylvester identity A = LL' and 
+ *  S is similar to I + L'E'KEL). 
  */
 class MaltipooCollapsed : public Numer::MFuncGrad
 {
@@ -54,6 +61,9 @@ class MaltipooCollapsed : public Numer::MFuncGrad
     //Eigen::ColPivHouseholderQR<MatrixXd> Ainvdec;
     Eigen::PartialPivLU<MatrixXd> Sdec;
     Eigen::PartialPivLU<MatrixXd> Ainvdec;
+    Eigen::LLT<MatrixXd> Sllt;    // used in place of Sdec if chol
+    Eigen::LLT<MatrixXd> Ainvllt; // used in place of Ainvdec if chol
+    MatrixXd L; // cholesky factor of K (of A for sylvester) if chol
     MatrixXd E;  // eta-ThetaX
     ArrayXXd O;  // exp{eta}
     // only needed for gradient and hessian
@@ -63,6 +73,7 @@ class MaltipooCollapsed : public Numer::MFuncGrad
     MatrixXd R;
     MatrixXd M; // for maltipoo specifically
     bool sylv;
+    bool chol;
     
   public:
     MaltipooCollapsed(const ArrayXXd Y_,          // constructor
@@ -71,7 +82,8 @@ class MaltipooCollapsed : public Numer::MFuncGrad
                         const MatrixXd X_,
                         const MatrixXd K_,
                         const MatrixXd U_,
-                        bool sylv=false) :
+                        bool sylv=false,
+                        bool chol=false) :
     Y(Y_), upsilon(upsilon_), Theta(Theta_), X(X_), K(K_), U(U_)
     {
       D = Y.rows();           // number of multinomial categories
@@ -82,6 +94,13 @@ class MaltipooCollapsed : public Numer::MFuncGrad
       n = Y.colwise().sum();  // total number of counts per sample
       delta = 0.5*(upsilon + N + D - 2.0);
       this->sylv = sylv;
+      this->chol = chol;
+      if (chol && !(sylv & (N < (D-1)))){
+        Eigen::LLT<MatrixXd> Kllt(K);
+        if (Kllt.info() != Eigen::Success)
+          throw std::runtime_error("KInv must be positive definite for chol=true");
+        L = Kllt.matrixL();
+      }
       XTUX = MatrixXd::Zero(P*N, N);
       for (int i=0; i<P; i++){
         XTUX.middleRows(N*i, N).noalias() = X.transpose()*U.middleRows(Q*i, Q)*X;
@@ -98,17 +117,39 @@ class MaltipooCollapsed : public Numer::MFuncGrad
       for (int i=0; i<P; i++){
         Ainv += exp(ell(i))*XTUX.middleRows(N*i, N);
       }
-      Ainvdec.compute(Ainv);
-      A = Ainvdec.inverse(); 
+      if (chol){
+        Ainvllt.compute(Ainv);
+        A = Ainvllt.solve(MatrixXd::Identity(N, N));
+      } else {
+        Ainvdec.compute(Ainv);
+        A = Ainvdec.inverse(); 
+      }
       
-      if (sylv & (N < (D-1))){
+      if (chol){
+        MatrixXd LE, CL;
+        if (sylv & (N < (D-1))){
+          Eigen::LLT<MatrixXd> Allt(A);
+          L = Allt.matrixL();
+          C.noalias() = K*E;
+          LE.noalias() = L.triangularView<Eigen::Lower>().transpose()*E.transpose();
+        } else {
+          C.noalias() = A*E.transpose();
+          LE.noalias() = L.triangularView<Eigen::Lower>().transpose()*E;
+        }
+        CL.noalias() = C*L.triangularView<Eigen::Lower>();
+        S.noalias() = LE*CL;
+        S.diagonal().array() += 1;
+        Sllt.compute(S);
+        if (Sllt.info() != Eigen::Success)
+          throw std::runtime_error("Cholesky decomposition of I + L'EAE'L failed");
+      } else if (sylv & (N < (D-1))){
         S.noalias() = A*E.transpose()*K*E;
         S.diagonal() += VectorXd::Ones(N);
       } else {
         S.noalias() = K*E*A*E.transpose();
         S.diagonal() += VectorXd::Ones(D-1);
       }
-      Sdec.compute(S);
+      if (!chol) Sdec.compute(S);
       O = eta.array().exp();
       m = O.colwise().sum();
       m += Eigen::ArrayXd::Ones(N);
@@ -121,12 +162,23 @@ class MaltipooCollapsed : public Numer::MFuncGrad
       rho = rhovec; // probably could be done in one line rather than 2 (above)
       if (sylv & (N < (D-1))){
         C.noalias() = K*E;
-        R.noalias() = Sdec.solve(A); // S^{-1}AInv
-        MatrixXd SinvK = Sdec.solve(K);
-        M.noalias() = A*E.transpose()*SinvK*E*A;
       } else {
         C.noalias() = A*E.transpose();
+      }
+      if (chol){
+        // S^{-1}K = L*T^{-1}*L' = W'W with W = U^{-1}L' and T = UU'
+        MatrixXd W = L.transpose();
+        Sllt.matrixL().solveInPlace(W);
+        R.noalias() = W.transpose()*W;
+      } else if (sylv & (N < (D-1))){
+        R.noalias() = Sdec.solve(A); // S^{-1}AInv
+      } else {
         R.noalias() = Sdec.solve(K); // S^{-1}K
+      }
+      if (sylv & (N < (D-1))){
+        // A*E'*S_{D-1}^{-1}*K*E*A = A*E'*K*E*S_N^{-1}*A (push-through)
+        M.noalias() = A*E.transpose()*C*R;
+      } else {
         M.noalias() = A*E.transpose()*R*E*A;
       }
     }
@@ -137,6 +189,13 @@ class MaltipooCollapsed : public Numer::MFuncGrad
       double ll=0.0;
       // start with multinomial ll
       ll += (Y.topRows(D-1)*eta.array()).sum() - n*m.log().matrix();
+      if (chol){
+        double ld = Sllt.matrixLLT().diagonal().array().log().sum();
+        ll -= 2.0*delta*ld;
+        ld = Ainvllt.matrixLLT().diagonal().array().log().sum();
+        ll -= (D-1)*ld;
+        return ll;
+      }
       // Now compute collapsed prior ll
       //ll -= delta*Sdec.logAbsDeterminant();
       // Following was adapted from : 
@@ -188,66 +247,29 @@ class MaltipooCollapsed : public Numer::MFuncGrad
     }
     
     // Must have called updateWithEtaLL and then updateWithEtaGH first 
-    MatrixXd calcHess(const Ref<const VectorXd>& ell){
-      bool tmp_sylv = sylv;
+    // Hessian (with respect to eta) in factored form 
+    mongrel::StructuredHessian calcStructuredHess(){
       if (sylv & (N < (D-1))){
-        MatrixXd eta = E + ThetaX;
-        Map<VectorXd> etavec(eta.data(), N*(D-1));
-        this->sylv=false;
-        updateWithEtaLL(etavec, ell);
-        updateWithEtaGH();
-      }
-      // for MatrixVariate T
-      MatrixXd H(N*(D-1), N*(D-1));
-      MatrixXd RCT(D-1, N);
-      MatrixXd CR(N, D-1);
-      MatrixXd L(N*(D-1), N*(D-1));
-      RCT.noalias() = R*C.transpose();
-      CR.noalias() = C*R;
-      L.noalias() = krondense(C*RCT, R.transpose());
-      H.noalias() = krondense(A, R+R.transpose());
-      H.noalias() -= L+L.transpose();
-      L.noalias() = krondense(RCT, RCT.transpose()); // reuse L
-      L.noalias() += krondense(CR.transpose(), CR); // reuse L
-      H.noalias() -= tveclmult(N, D-1, L);
-      H.noalias() = -delta * H;
-      
-      // For Multinomial
-      VectorXd rho_parallel;
-      VectorXd n_parallel;
-      rho_parallel = rho; 
-      n_parallel = n;
-      
-      #pragma omp parallel shared(rho_parallel, n_parallel)
-      {
-      MatrixXd W(D-1, D-1);
-      //VectorXd rhoseg(D-1);
-      #pragma omp for 
-      for (int j=0; j<N; j++){
-        //rhoseg = rho.segment(j*(D-1), D-1);
-        Eigen::Ref<VectorXd> rhoseg = rho_parallel.segment(j*(D-1), D-1);
-        W.noalias() = rhoseg*rhoseg.transpose();
-        W.diagonal() -= rhoseg;
-        H.block(j*(D-1), j*(D-1), D-1, D-1).noalias()  += n_parallel(j)*W;
-      }
+        // Hessian is written in terms of C and R without sylvester identity
+        //   Woodbury: S_{D-1}^{-1}K = K - K*E*S_N^{-1}*A*E'*K
+        MatrixXd Cf = A*E.transpose();
+        MatrixXd Rf = K;
+        Rf.noalias() -= C*R*C.transpose();
+        return mongrel::StructuredHessian(A, Rf, Cf, rhomat, n, delta);
       }
-      // Turn back on sylv option if it was wanted:
-      this->sylv = tmp_sylv;
-      return H;
+      return mongrel::StructuredHessian(A, R, C, rhomat, n, delta);
+    }
+    
+    // Must have called updateWithEtaLL and then updateWithEtaGH first 
+    MatrixXd calcHess(const Ref<const VectorXd>& ell){
+      return calcStructuredHess().toDense();
     }
     
     // should return blocks of size D-1 x D-1 stacked in a N(D-1) x D-1 matrix
     MatrixXd calcPartialHess(){
       // For Multinomial only
       MatrixXd H = ArrayXXd::Zero(N*(D-1), D-1);
-      MatrixXd W(D-1, D-1);
-      VectorXd rhoseg(D-1);
-      for (int j=0; j<N; j++){
-        rhoseg = rho.segment(j*(D-1), D-1); // rho calculated in updateWithEtaGH()
-        W.noalias() = rhoseg*rhoseg.transpose();
-        W.diagonal() -= rhoseg;
-        H.block(j*(D-1), 0, D-1, D-1).noalias() += n(j)*W;
-      }
+      mongrel::add_multinomial_blocks(H, rhomat, n, false);
       return H;
     }
     
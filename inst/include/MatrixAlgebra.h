@@ -14,5 +14,7 @@ void krondense_inplace_add(Ref<MatrixXd> A, const Ref<const MatrixXd>& L,
                        const Ref<const MatrixXd>& R);
 MatrixXd tveclmult(const int m, const int n, const Ref<const MatrixXd>& A);
 void tveclmult_minus(const int m, const int n, Ref<MatrixXd> A, Ref<MatrixXd> B);
+MatrixXd woodbury_ainv_factor(const Ref<const MatrixXd>& X, 
+                              const Ref<const MatrixXd>& Gamma);
 
 #endif
\ No newline at end of file
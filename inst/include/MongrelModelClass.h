@@ -18,7 +18,7 @@ public:
   virtual int getN() = 0; // rows in hessian
   virtual int getD() = 0; // cols in hessian
   virtual VectorXd calcHessVectorProd(const Ref<const VectorXd>& etavec,
-                                      VectorXd v, double r) = 0;
+                                      const Ref<const VectorXd>& v) = 0;
   virtual ~MongrelModel(){}
 };
 
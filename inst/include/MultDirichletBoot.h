@@ -2,6 +2,8 @@
 #define MONGREL_MULTDIRICHLETBOOT_H
 
 #include <RcppEigen.h>
+#include <PhiloxRNG.h>
+#include <boost/random/gamma_distribution.hpp>
 using namespace Rcpp;
 using Eigen::Map;
 using Eigen::MatrixXd;
@@ -51,15 +53,45 @@ namespace MultDirichletBoot{
   }
   
   
+  // Sample dirichlet using rng (e.g., philox::PhiloxEngine) rather than R's 
+  //   generator (no R API calls so safe to call from multiple threads)
+  template <typename Derived, typename RNG>
+  MatrixXd rDirichlet(int n_samples, const Eigen::MatrixBase<Derived>& alpha, 
+                      RNG& rng){
+    int D = alpha.rows();
+    MatrixXd s(D, n_samples);
+    for (int j=0; j<n_samples; j++){
+      for (int i=0; i<D; i++){
+        boost::random::gamma_distribution<> rgamma(alpha(i), 1);
+        s(i,j) = rgamma(rng);
+      }
+    }
+    s.array().rowwise() /= s.colwise().sum().array();
+    return s;
+  }
+  
+  // @param seed if not -1 sample i (column of eta) is drawn from philox 
+  //   stream i of seed (in parallel, reproducible regardless of threads) 
+  //   otherwise from R's generator
   template <typename T1>
   MatrixXd MultDirichletBoot(int n_samples, Eigen::MatrixBase<T1>& eta, 
-                             ArrayXXd Y, double pseudocount){
+                             ArrayXXd Y, double pseudocount, long seed=-1){
     int D = eta.rows()+1;
     int N = eta.cols();
     MatrixXd alpha = alrInv_default(eta);
     alpha.array().rowwise() *= Y.colwise().sum();
     alpha.array() += pseudocount; 
     MatrixXd samp(N*(D-1), n_samples);
+    if (seed != -1){
+      #pragma omp parallel for
+      for (int i=0; i<N; i++){
+        philox::PhiloxEngine rng(seed, i);
+        MatrixXd s = rDirichlet(n_samples, alpha.col(i), rng);
+        // transform to eta
+        samp.middleRows(i*(D-1), D-1) = alr_default(s);
+      }
+      return samp;
+    }
     MatrixXd s(D, n_samples);
     VectorXd a;
     for (int i=0; i<N; i++){
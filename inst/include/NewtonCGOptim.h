@@ -0,0 +1,275 @@
+#ifndef MONGREL_NEWTONCG_H
+#define MONGREL_NEWTONCG_H
+
+#include <RcppNumerical.h>
+#include <StructuredHessian.h>
+#include <OptimTrace.h>
+
+using namespace Rcpp;
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::ArrayXXd;
+using Eigen::VectorXd;
+using Eigen::RowVectorXd;
+using Eigen::Ref;
+
+
+namespace newtoncg{
+
+  // Iteration counts of a call to optim_newton_cg and its final trust 
+  //   region radius (delta, if > 0 on input used as the initial radius so 
+  //   that optimization can be resumed)
+  struct NewtonCGStats {
+    int iter;    // outer (newton) iterations
+    int cg_iter; // total inner (conjugate gradient) iterations
+    int nfeval;  // function (and gradient) evaluations
+    double delta; // trust region radius
+    NewtonCGStats() : iter(0), cg_iter(0), nfeval(0), delta(-1) {}
+  };
+
+  /* Block diagonal preconditioner for the negative hessian of the collapsed
+   *  models. Block j is the multinomial part n_j*(diag(rho_j) - rho_j*rho_j')
+   *  plus the absolute value of the diagonal of the remaining (matrix-t)
+   *  part, i.e., M_j = diag(g_j) - n_j*rho_j*rho_j' which is applied (and
+   *  inverted with sherman-morrison) in O(P) per block rather than O(P^3).
+   *  Blocks are set up and applied in parallel over samples.
+   */
+  class BlockDiagPreconditioner {
+    private:
+      int N;
+      int P;
+      MatrixXd rhomat; // P x N
+      RowVectorXd n;
+      MatrixXd G;      // P x N diagonals
+      MatrixXd S;      // P x N G^{-1}rho
+      RowVectorXd c;   // n_j/(1 - n_j rho_j'G^{-1}rho_j)
+
+    public:
+      BlockDiagPreconditioner(const mongrel::StructuredHessian& H) :
+      rhomat(H.getRhomat()), n(H.getN())
+      {
+        P = rhomat.rows();
+        N = rhomat.cols();
+        const VectorXd dH = H.diagonal();
+        const Map<const MatrixXd> d(dH.data(), P, N);
+        // multinomial part of the (negative) hessian has diagonal n*rho*(1-rho)
+        // so the matrix-t part has diagonal -(d + dm)
+        MatrixXd dm = (rhomat.array()*(1-rhomat.array())).rowwise()*n.array();
+        G = (rhomat.array().rowwise()*n.array()) + (d.array() + dm.array()).abs();
+        G = G.array().max(1e-8);
+        S = rhomat.array()/G.array();
+        c.resize(N);
+        #pragma omp parallel for
+        for (int j=0; j<N; j++){
+          double denom = 1 - n(j)*rhomat.col(j).dot(S.col(j));
+          c(j) = n(j)/std::max(denom, 1e-12);
+        }
+      }
+
+      // M^{-1}*r
+      VectorXd solve(const Ref<const VectorXd>& r) const {
+        VectorXd y(r.size());
+        const Map<const MatrixXd> R(r.data(), P, N);
+        Map<MatrixXd> Y(y.data(), P, N);
+        Y = R.array()/G.array();
+        #pragma omp parallel for shared(Y)
+        for (int j=0; j<N; j++){
+          Y.col(j) += (c(j)*rhomat.col(j).dot(Y.col(j)))*S.col(j);
+        }
+        return y;
+      }
+
+      // M*v
+      VectorXd multiply(const Ref<const VectorXd>& v) const {
+        VectorXd y(v.size());
+        const Map<const MatrixXd> V(v.data(), P, N);
+        Map<MatrixXd> Y(y.data(), P, N);
+        Y = G.cwiseProduct(V);
+        #pragma omp parallel for shared(Y)
+        for (int j=0; j<N; j++){
+          Y.col(j) -= (n(j)*rhomat.col(j).dot(V.col(j)))*rhomat.col(j);
+        }
+        return y;
+      }
+  };
+
+  // tau >= 0 such that ||z + tau*d||_M = delta
+  inline double to_boundary(const VectorXd& z, const VectorXd& d,
+                            const BlockDiagPreconditioner& M, double delta){
+    VectorXd Md = M.multiply(d);
+    double dd = d.dot(Md);
+    double zd = z.dot(Md);
+    double zz = z.dot(M.multiply(z));
+    return (-zd + std::sqrt(std::max(zd*zd + dd*(delta*delta - zz), 0.0)))/dd;
+  }
+
+  /* Steihaug-Toint truncated (preconditioned) conjugate gradient
+   *  approximately minimizes g'p + 0.5*p'Hp subject to ||p||_M <= delta
+   *  (H the negative of the StructuredHessian), returns number of CG
+   *  iterations. onboundary set to true if the step hit the trust region
+   *  boundary (or direction of negative curvature).
+   */
+  inline int steihaug_cg(const mongrel::StructuredHessian& H,
+                         const BlockDiagPreconditioner& M,
+                         const VectorXd& g, double delta, double tol,
+                         int max_cg, VectorXd& p, bool& onboundary){
+    p = VectorXd::Zero(g.size());
+    onboundary = false;
+    VectorXd r = g;
+    VectorXd y = M.solve(r);
+    VectorXd d = -y;
+    double ry = r.dot(y);
+    int k = 0;
+    while (k < max_cg){
+      if (r.norm() <= tol) break;
+      VectorXd Hd = -H.matvec(d);
+      double dHd = d.dot(Hd);
+      k++;
+      if (dHd <= 0){ // negative curvature, go to the boundary
+        p += to_boundary(p, d, M, delta)*d;
+        onboundary = true;
+        break;
+      }
+      double alpha = ry/dHd;
+      VectorXd pnext = p + alpha*d;
+      if (pnext.dot(M.multiply(pnext)) >= delta*delta){
+        p += to_boundary(p, d, M, delta)*d;
+        onboundary = true;
+        break;
+      }
+      p = pnext;
+      r += alpha*Hd;
+      y = M.solve(r);
+      double rynext = r.dot(y);
+      d = -y + (rynext/ry)*d;
+      ry = rynext;
+    }
+    return k;
+  }
+
+  // Main Function to Call from other C++ functions
+  //   Trust region newton method with steps from steihaug_cg using the
+  //   closed form hessian (in StructuredHessian form, never made dense)
+  //   model : model providing f_grad (negative log-likelihood) and
+  //     calcStructuredHess (hessian of the log-likelihood at the last point
+  //     f_grad was called at) e.g., PibbleCollapsed
+  //   theta : initial parameter estimates (overwritten with optima)
+  //   fx_opt : negative log-likelihood at optima
+  //   eps_f : normalized function improvement for stopping
+  //   eps_g : normalized gradient magnitute for stopping
+  //   max_iter : maximum number of (outer) iterations before stopping
+  //   verbose : if true will print stats for stopping criteria and iter no.
+  //   verbose_rate : rate to print verbose stats to screen
+  //   stats : if not null filled with iteration counts and final trust 
+  //     region radius (stats->delta > 0 on input is the initial radius)
+  //   check_interrupt : if true checks for user interrupts each iteration
+  //     (set to false when called from within a parallel region)
+  //   trace : if not null the starting point (unless stats->iter > 0, i.e., 
+  //     continuing a previous call) and each (outer) iteration are recorded 
+  //     in trace (a rejected step has step norm 0)
+  //   returns 1 (gradient below threshold), 2 (function value improvement
+  //     below threshold) or -1 (max iterations hit, left to the caller to
+  //     report) as does optim_adam
+  template <typename ModelT>
+  int optim_newton_cg(ModelT& model,
+                      Numer::Refvec theta,
+                      double& fx_opt,
+                      double eps_f=1e-10,
+                      double eps_g=1e-4,
+                      int max_iter=1000,
+                      bool verbose=false,
+                      int verbose_rate=1,
+                      NewtonCGStats* stats=0,
+                      bool check_interrupt=true,
+                      optimtrace::OptimTrace* trace=0){
+    NewtonCGStats s;
+    int dim = theta.size();
+    VectorXd x = theta;
+    VectorXd g(dim), gtrial(dim), step(dim);
+    double f = model.f_grad(x, g);
+    s.nfeval++;
+    if (trace && !(stats && (stats->iter > 0)))
+      trace->record(f, g.norm(), std::numeric_limits<double>::quiet_NaN(), 0);
+    bool current = true; // is the model last evaluated at x
+    double delta = stats ? stats->delta : -1;
+    int status = 0;
+    while (status == 0){
+      if (check_interrupt) R_CheckUserInterrupt();
+      double gnorm = g.norm();
+      if (gnorm <= eps_g*std::max(x.norm(), 1.0)){
+        status = 1; // gradient below threshold
+        break;
+      }
+      if (s.iter >= max_iter){
+        status = -1;
+        break;
+      }
+      if (!current){
+        model.f_grad(x, g);
+        s.nfeval++;
+        current = true;
+      }
+      mongrel::StructuredHessian H = model.calcStructuredHess();
+      BlockDiagPreconditioner M(H);
+      if (delta < 0) delta = std::sqrt(g.dot(M.solve(g))); // ||M^{-1}g||_M
+      double tol = std::min(0.5, std::sqrt(gnorm))*gnorm;
+      bool onboundary;
+      s.cg_iter += steihaug_cg(H, M, g, delta, tol, dim, step, onboundary);
+      double pred = -(g.dot(step) - 0.5*step.dot(H.matvec(step)));
+      if (!(pred > 0)){
+        status = 2; // no further improvement possible within precision
+        break;
+      }
+      VectorXd xtrial = x + step;
+      double ftrial = model.f_grad(xtrial, gtrial);
+      s.nfeval++;
+      s.iter++;
+      double rho = (f - ftrial)/pred;
+      if (!std::isfinite(ftrial) || (rho < 0.25)){
+        delta *= 0.25;
+      } else if ((rho > 0.75) && onboundary){
+        delta *= 2;
+      }
+      if (verbose && (s.iter % verbose_rate == 0)){
+        Rcout << "iter : " << s.iter << std::endl;
+        Rcout << "-Log Like: " << ftrial << std::endl;
+        Rcout << "actual/predicted reduction: " << rho << std::endl;
+        Rcout << "gnorm, gradient threshold " << gnorm << ","
+              << eps_g*std::max(x.norm(), 1.0) << std::endl;
+        Rcout << "trust region radius: " << delta << std::endl;
+      }
+      if (std::isfinite(ftrial) && (rho > 1e-4)){
+        double rel = (f - ftrial)/std::abs(ftrial);
+        x = xtrial;
+        g = gtrial;
+        f = ftrial;
+        current = true;
+        if (rel < eps_f) status = 2; // function value improvement below threshold
+        if (trace) trace->record(f, g.norm(), rel, step.norm());
+      } else {
+        current = false;
+        if (delta <= 1e-12*std::max(x.norm(), 1.0)) status = 2;
+        if (trace) trace->record(f, g.norm(), 0, 0);
+      }
+    }
+    if ((status == 1) && verbose){
+      Rcout << "Optimization terminated: change in gradient below threshold"
+            << std::endl;
+    } else if ((status ==2) && verbose){
+      Rcout << "Optimization terminated: change in function value below threshold"
+            << std::endl;
+    }
+    if (!current){ // leave the model evaluated at the optima
+      model.f_grad(x, g);
+      s.nfeval++;
+    }
+    fx_opt = f;
+    theta = x;
+    s.delta = delta;
+    if (stats) *stats = s;
+    return status;
+  }
+
+}
+
+#endif
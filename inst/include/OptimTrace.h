@@ -0,0 +1,107 @@
+#ifndef MONGREL_OPTIMTRACE_H
+#define MONGREL_OPTIMTRACE_H
+
+#include <RcppNumerical.h>
+#include <chrono>
+#include <limits>
+
+using Eigen::VectorXd;
+using Eigen::VectorXi;
+
+namespace optimtrace{
+
+  /* Per-iteration optimizer trace kept in a preallocated ring buffer of
+   *  capacity records (once full the oldest records are overwritten). Every
+   *  call to record counts as one iteration, only every rate-th is stored.
+   *  Stored per record: iteration, negative log-likelihood, gradient norm,
+   *  relative improvement over the previous iteration ((f_prev - f)/|f|, NaN
+   *  if none), norm of the step that led to that iterate (0 if none) and
+   *  wall time (seconds since construction).
+   *  Optimizers take an OptimTrace* which is null when tracing is off.
+   */
+  class OptimTrace {
+    private:
+      int capacity;
+      int rate;
+      int calls;   // number of calls to record
+      int count;   // number of records stored (including overwritten)
+      VectorXi iter;
+      VectorXd nll;
+      VectorXd gnorm;
+      VectorXd relimp;
+      VectorXd stepnorm;
+      VectorXd time;
+      std::chrono::steady_clock::time_point start;
+
+    public:
+      OptimTrace(int capacity_, int rate_=1) :
+      capacity(std::max(capacity_, 1)), rate(std::max(rate_, 1)),
+      calls(0), count(0), iter(capacity), nll(capacity), gnorm(capacity),
+      relimp(capacity), stepnorm(capacity), time(capacity),
+      start(std::chrono::steady_clock::now()) {}
+
+      inline void record(double nll_, double gnorm_, double relimp_,
+                         double stepnorm_){
+        calls++;
+        if (calls % rate != 0) return;
+        int i = count % capacity;
+        iter(i) = calls;
+        nll(i) = nll_;
+        gnorm(i) = gnorm_;
+        relimp(i) = relimp_;
+        stepnorm(i) = stepnorm_;
+        time(i) = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+        count++;
+      }
+
+      // number of records held
+      int size() const { return std::min(count, capacity); }
+
+      // record k (0 is the oldest held)
+      int index(int k) const {
+        return (count > capacity) ? (count + k) % capacity : k;
+      }
+
+      // column of the trace in chronological order
+      template <typename T>
+      T ordered(const T& x) const {
+        int n = size();
+        T out(n);
+        for (int k=0; k<n; k++) out(k) = x(index(k));
+        return out;
+      }
+      VectorXi getIter() const { return ordered(iter); }
+      VectorXd getNll() const { return ordered(nll); }
+      VectorXd getGnorm() const { return ordered(gnorm); }
+      VectorXd getRelimp() const { return ordered(relimp); }
+      VectorXd getStepnorm() const { return ordered(stepnorm); }
+      VectorXd getTime() const { return ordered(time); }
+  };
+
+  // Functor recording every evaluation of f in trace, for optimizers that
+  //   only see the objective (e.g., Numer::optim_lbfgs, where records are
+  //   then per function evaluation, line search included)
+  class TracedFun : public Numer::MFuncGrad
+  {
+    private:
+      Numer::MFuncGrad& f;
+      OptimTrace& trace;
+      VectorXd xprev;
+      double fprev;
+    public:
+      TracedFun(Numer::MFuncGrad& f_, OptimTrace& trace_) :
+      f(f_), trace(trace_), fprev(std::numeric_limits<double>::quiet_NaN()) {}
+      double f_grad(Numer::Constvec& x, Numer::Refvec grad){
+        double fx = f.f_grad(x, grad);
+        double stepnorm = (xprev.size() == x.size()) ? (x - xprev).norm() : 0;
+        trace.record(fx, grad.norm(), (fprev - fx)/std::abs(fx), stepnorm);
+        xprev = x;
+        fprev = fx;
+        return fx;
+      }
+  };
+
+}
+
+#endif
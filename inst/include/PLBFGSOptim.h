@@ -0,0 +1,198 @@
+#ifndef MONGREL_PLBFGS_H
+#define MONGREL_PLBFGS_H
+
+#include <RcppNumerical.h>
+#include <StructuredHessian.h>
+#include <NewtonCGOptim.h>
+#include <OptimTrace.h>
+#include <deque>
+#include <memory>
+
+using namespace Rcpp;
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+
+
+namespace plbfgs{
+
+  /* Limited memory BFGS whose initial inverse hessian approximation is the
+   *  inverse of the block diagonal multinomial part of the negative hessian
+   *  (newtoncg::BlockDiagPreconditioner, blocks inverted per sample with
+   *  sherman-morrison) rather than a scaled identity. The multinomial
+   *  blocks n_j*(diag(rho_j) - rho_j*rho_j') scale with sequencing depth and
+   *  dominate the curvature, the m curvature pairs then only have to capture
+   *  the (matrix-t) coupling between samples. The preconditioner is rebuilt
+   *  from the model every precond_refresh iterations (curvature pairs are
+   *  kept, only H0 changes) and scaled by s'y/y'M^{-1}y of the newest pair.
+   */
+  class PLBFGS {
+    private:
+      int m;
+      std::deque<VectorXd> s;
+      std::deque<VectorXd> y;
+      std::deque<double> rho;
+      newtoncg::BlockDiagPreconditioner* M;
+
+    public:
+      PLBFGS(int m_=6) : m(m_), M(0) {}
+
+      void setPreconditioner(newtoncg::BlockDiagPreconditioner* M_){ M = M_; }
+
+      void clear(){
+        s.clear();
+        y.clear();
+        rho.clear();
+      }
+
+      // adds the pair (unless s'y is not sufficiently positive), returns
+      //   true if added
+      bool update(const VectorXd& sk, const VectorXd& yk){
+        double sy = sk.dot(yk);
+        if (!(sy > 1e-10*sk.norm()*yk.norm())) return false;
+        if ((int)s.size() == m){
+          s.pop_front();
+          y.pop_front();
+          rho.pop_front();
+        }
+        s.push_back(sk);
+        y.push_back(yk);
+        rho.push_back(1/sy);
+        return true;
+      }
+
+      // H*g by the two loop recursion with H0 = gamma*M^{-1}
+      VectorXd apply(const VectorXd& g) const {
+        int k = s.size();
+        VectorXd q = g;
+        VectorXd alpha(k);
+        for (int i=k-1; i>=0; i--){
+          alpha(i) = rho[i]*s[i].dot(q);
+          q -= alpha(i)*y[i];
+        }
+        VectorXd r = M ? M->solve(q) : q;
+        if (k > 0){
+          VectorXd My = M ? M->solve(y[k-1]) : y[k-1];
+          double yMy = y[k-1].dot(My);
+          if (yMy > 0) r *= 1/(rho[k-1]*yMy);
+        }
+        for (int i=0; i<k; i++){
+          double beta = rho[i]*y[i].dot(r);
+          r += (alpha(i) - beta)*s[i];
+        }
+        return r;
+      }
+  };
+
+  // Main Function to Call from other C++ functions
+  //   Preconditioned L-BFGS (see PLBFGS) with a backtracking (armijo) line
+  //   search
+  //   model : model providing f_grad (negative log-likelihood) and
+  //     calcStructuredHess (hessian of the log-likelihood at the last point
+  //     f_grad was called at) e.g., PibbleCollapsed
+  //   theta : initial parameter estimates (overwritten with optima)
+  //   fx_opt : negative log-likelihood at optima
+  //   eps_f : normalized function improvement for stopping
+  //   eps_g : normalized gradient magnitute for stopping
+  //   max_iter : maximum number of iterations before stopping
+  //   verbose : if true will print stats for stopping criteria and iter no.
+  //   verbose_rate : rate to print verbose stats to screen
+  //   precond_refresh : iterations between rebuilds of the preconditioner
+  //   m : number of curvature pairs kept
+  //   check_interrupt : if true checks for user interrupts each iteration
+  //     (set to false when called from within a parallel region)
+  //   trace : if not null the starting point and each iteration are
+  //     recorded in trace
+  //   returns 1 (gradient below threshold), 2 (function value improvement
+  //     below threshold) or -1 (max iterations hit, left to the caller to
+  //     report) as does optim_adam
+  template <typename ModelT>
+  int optim_plbfgs(ModelT& model,
+                   Numer::Refvec theta,
+                   double& fx_opt,
+                   double eps_f=1e-10,
+                   double eps_g=1e-4,
+                   int max_iter=1000,
+                   bool verbose=false,
+                   int verbose_rate=1,
+                   int precond_refresh=10,
+                   int m=6,
+                   bool check_interrupt=true,
+                   optimtrace::OptimTrace* trace=0){
+    int dim = theta.size();
+    VectorXd x = theta;
+    VectorXd g(dim), gtrial(dim), d(dim), xtrial(dim);
+    double f = model.f_grad(x, g);
+    if (trace)
+      trace->record(f, g.norm(), std::numeric_limits<double>::quiet_NaN(), 0);
+    PLBFGS H(m);
+    std::unique_ptr<newtoncg::BlockDiagPreconditioner> M;
+    int iter = 0;
+    int status = 0;
+    while (status == 0){
+      if (check_interrupt) R_CheckUserInterrupt();
+      double gnorm = g.norm();
+      if (gnorm <= eps_g*std::max(x.norm(), 1.0)){
+        status = 1; // gradient below threshold
+        break;
+      }
+      if (iter >= max_iter){
+        status = -1;
+        break;
+      }
+      if (iter % std::max(precond_refresh, 1) == 0){ // model is current at x
+        M.reset(new newtoncg::BlockDiagPreconditioner(model.calcStructuredHess()));
+        H.setPreconditioner(M.get());
+      }
+      d = -H.apply(g);
+      double gd = g.dot(d);
+      if (!(gd < 0)){ // not a descent direction, restart from H0
+        H.clear();
+        d = -H.apply(g);
+        gd = g.dot(d);
+      }
+      double alpha = 1;
+      double ftrial;
+      while (true){
+        xtrial = x + alpha*d;
+        ftrial = model.f_grad(xtrial, gtrial);
+        if (std::isfinite(ftrial) && (ftrial <= f + 1e-4*alpha*gd)) break;
+        alpha *= 0.5;
+        if (alpha*d.norm() <= 1e-12*std::max(x.norm(), 1.0)) break;
+      }
+      iter++;
+      if (!(std::isfinite(ftrial) && (ftrial <= f + 1e-4*alpha*gd))){
+        model.f_grad(x, g); // leave the model evaluated at x
+        status = 2; // no further improvement possible within precision
+        break;
+      }
+      double rel = (f - ftrial)/std::abs(ftrial);
+      H.update(xtrial - x, gtrial - g);
+      if (trace) trace->record(ftrial, gtrial.norm(), rel, alpha*d.norm());
+      x = xtrial;
+      g = gtrial;
+      f = ftrial;
+      if (verbose && (iter % verbose_rate == 0)){
+        Rcout << "iter : " << iter << std::endl;
+        Rcout << "-Log Like: " << f << std::endl;
+        Rcout << "step length: " << alpha << std::endl;
+        Rcout << "gnorm, gradient threshold " << g.norm() << ","
+              << eps_g*std::max(x.norm(), 1.0) << std::endl;
+      }
+      if (rel < eps_f) status = 2; // function value improvement below threshold
+    }
+    if ((status == 1) && verbose){
+      Rcout << "Optimization terminated: change in gradient below threshold"
+            << std::endl;
+    } else if ((status ==2) && verbose){
+      Rcout << "Optimization terminated: change in function value below threshold"
+            << std::endl;
+    }
+    fx_opt = f;
+    theta = x;
+    return status;
+  }
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef MONGREL_PHILOX_H
+#define MONGREL_PHILOX_H
+
+#include <RcppEigen.h>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+using Eigen::MatrixXd;
+
+
+namespace philox{
+
+  /* Counter based random numbers (Philox4x32-10, Salmon et al. 2011).
+   *  Output is a pure function of (key, counter) so any element of a stream
+   *  can be generated directly, streams never overlap and draws can be
+   *  split across threads in any way without changing them. Here the key
+   *  is the (64 bit) seed and the 128 bit counter is split into a 64 bit
+   *  stream index (high words) and a 64 bit block index within the stream
+   *  (low words), each block gives 4 32 bit words.
+   */
+  typedef std::array<uint32_t, 4> ctr_type;
+  typedef std::array<uint32_t, 2> key_type;
+
+  inline void mulhilo(uint32_t a, uint32_t b, uint32_t& hi, uint32_t& lo){
+    uint64_t p = (uint64_t)a*(uint64_t)b;
+    hi = (uint32_t)(p >> 32);
+    lo = (uint32_t)p;
+  }
+
+  inline ctr_type philox4x32(ctr_type ctr, key_type key){
+    for (int r=0; r<10; r++){
+      if (r > 0){
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
+      }
+      uint32_t hi0, lo0, hi1, lo1;
+      mulhilo(0xD2511F53, ctr[0], hi0, lo0);
+      mulhilo(0xCD9E8D57, ctr[2], hi1, lo1);
+      ctr = {{hi1 ^ ctr[1] ^ key[0], lo1, hi0 ^ ctr[3] ^ key[1], lo0}};
+    }
+    return ctr;
+  }
+
+  inline key_type make_key(uint64_t seed){
+    return {{(uint32_t)seed, (uint32_t)(seed >> 32)}};
+  }
+
+  // block b of stream s
+  inline ctr_type block(const key_type& key, uint64_t s, uint64_t b){
+    ctr_type ctr = {{(uint32_t)b, (uint32_t)(b >> 32),
+                     (uint32_t)s, (uint32_t)(s >> 32)}};
+    return philox4x32(ctr, key);
+  }
+
+  // uniform on (0,1) with 53 random bits from two words
+  inline double uniform53(uint32_t a, uint32_t b){
+    return ((a >> 5)*67108864.0 + (b >> 6) + 0.5)*(1.0/9007199254740992.0);
+  }
+
+  // two unit normals (box-muller) from one block
+  inline void normal2(const ctr_type& w, double& z0, double& z1){
+    double r = std::sqrt(-2.0*std::log(uniform53(w[0], w[1])));
+    double t = 6.283185307179586*uniform53(w[2], w[3]);
+    z0 = r*std::cos(t);
+    z1 = r*std::sin(t);
+  }
+
+  // Sequential engine over one stream (a UniformRandomBitGenerator, e.g.,
+  //   for boost::random distributions), discard is O(1)
+  class PhiloxEngine {
+    private:
+      key_type key;
+      uint64_t s;
+      uint64_t w;   // index of next word in the stream
+      ctr_type buf; // block w/4 (if w%4 != 0)
+
+    public:
+      typedef uint32_t result_type;
+      static constexpr result_type min() { return 0; }
+      static constexpr result_type max() { return 0xFFFFFFFF; }
+
+      PhiloxEngine(uint64_t seed=0, uint64_t stream=0) :
+      key(make_key(seed)), s(stream), w(0) {}
+
+      void seed(uint64_t seed, uint64_t stream=0){
+        key = make_key(seed);
+        s = stream;
+        w = 0;
+      }
+
+      result_type operator()(){
+        if (w % 4 == 0) buf = block(key, s, w/4);
+        return buf[w++ % 4];
+      }
+
+      void discard(uint64_t n){
+        uint64_t wn = w + n;
+        if ((wn % 4 != 0) && ((w % 4 == 0) || (wn/4 != w/4)))
+          buf = block(key, s, wn/4);
+        w = wn;
+      }
+  };
+
+  // Fills Z with unit normals, column j is stream stream0+j of seed and
+  //   rows 2b and 2b+1 come from block b of that stream. Results do not
+  //   depend on the number of threads (or on how Z is split into calls
+  //   as long as stream0 advances by the number of columns).
+  template <typename Derived>
+  inline void fillUnitNormal(Eigen::DenseBase<Derived>& Z, uint64_t seed,
+                             uint64_t stream0=0){
+    const key_type key = make_key(seed);
+    const int m = Z.rows();
+    const int n = Z.cols();
+    const int nb = (m+1)/2;
+    const long nblocks = (long)nb*n;
+    #pragma omp parallel for if(nblocks > 4096)
+    for (long k=0; k<nblocks; k++){
+      int j = k/nb;
+      int b = k % nb;
+      double z0, z1;
+      normal2(block(key, stream0 + j, b), z0, z1);
+      Z(2*b, j) = z0;
+      if (2*b+1 < m) Z(2*b+1, j) = z1;
+    }
+  }
+  
+  // Seed drawn from R's random number generator (so set.seed applies) for 
+  //   callers given seed -1 whose draws would otherwise repeat between 
+  //   calls. Uses the R API, call on the main thread (before any parallel 
+  //   region). 
+  inline long seed_from_R(){
+    return (long) std::floor(R::unif_rand()*2147483647.0);
+  }
+
+}
+
+#endif
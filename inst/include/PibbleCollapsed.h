@@ -3,6 +3,8 @@
 
 #include <MatrixAlgebra.h>
 #include <MongrelModelClass.h>
+#include <StructuredHessian.h>
+#include <stdexcept>
 
 #ifdef FIDO_USE_MKL
  #include <mkl.h>
@@ -27,79 +29,263 @@ using Eigen::Ref;
  *
  *  Where A = (I_N + X*Gamma*X'), K = Xi is a D-1xD-1 covariance 
  *  matrix, and Gamma is a Q x Q covariance matrix
+ *  
+ *  Templated on the Scalar type used internally (double or float), the 
+ *  interface (eta, gradient, hessian) is always in double. Use 
+ *  PibbleCollapsed (double) unless only a rough gradient is needed (e.g., 
+ *  early ADAM iterations), float halves memory traffic. 
+ *  
+ *  P may be set to D-1 at compile time for small D (see 
+ *  optimPibbleCollapsed) in which case the (D-1)x(D-1) quantities (S, Sdec, R) 
+ *  are fixed size (on the stack) and per-sample operations unroll. With P 
+ *  fixed the sylvester determinant identity is never used. 
+ *  
+ *  Y may be given as a sparse (CSC) matrix in which case the multinomial 
+ *  terms of the LogLik and gradient only touch non-zero counts. 
+ *  
+ *  If chol=true S is never factored directly. With KInv = LL' (cholesky), 
+ *  S = L*T*L^{-1} where T = I + L'EAInvE'L is symmetric positive definite, 
+ *  so det(S) = det(T) and S^{-1}KInv = L*T^{-1}*L'. T is factored with LLT 
+ *  (half the flops of LU) and the log determinant is read off its diagonal. 
+ *  With the sylvester identity the same is done with AInv = LL'. 
+ *  
+ *  If lowrank=true the AInv argument is a Q x N matrix V with 
+ *  AInv = I_N - V'V (Woodbury, see woodbury_ainv_factor, or construct from 
+ *  X and Gamma directly) and AInv is only ever applied as N x Q products 
+ *  (the N x N matrix is formed only if the sylvester identity is used). 
+ *  
+ *  The per-sample terms (exp and normalization giving rhomat, the 
+ *  multinomial LogLik and gradient) are computed in loops over samples 
+ *  split across OpenMP threads (number set with omp_set_num_threads, e.g., 
+ *  ncores in optimPibbleCollapsed) once there are enough of them to pay 
+ *  for the fork (see parcols), the LogLik is a reduction over samples. 
  */
-class PibbleCollapsed : public mongrel::MongrelModel {
+template <typename Scalar, int P=Eigen::Dynamic>
+class PibbleCollapsedT : public mongrel::MongrelModel {
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> MatrixXs;
+  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> VectorXs;
+  typedef Eigen::Matrix<Scalar, 1, Eigen::Dynamic> RowVectorXs;
+  typedef Eigen::Array<Scalar, Eigen::Dynamic, Eigen::Dynamic> ArrayXXs;
+  typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> ArrayXs;
+  typedef Eigen::Matrix<Scalar, P, P> MatrixPs;               // (D-1)x(D-1)
+  typedef Eigen::Matrix<Scalar, P, Eigen::Dynamic> MatrixPNs; // (D-1)xN
+  typedef Eigen::Array<Scalar, P, Eigen::Dynamic> ArrayPNs;   // (D-1)xN
+  typedef Eigen::SparseMatrix<Scalar> SparseMatrixs;
+  
   private:
-    const ArrayXXd Y;
+    const ArrayXXs Y;
+    const SparseMatrixs Ysp; // used in place of Y if sparseY
     const double upsilon;
-    const MatrixXd ThetaX;
-    const MatrixXd KInv;
-    const MatrixXd AInv;
+    const MatrixPNs ThetaX;
+    const MatrixPs KInv;
+    MatrixXs AInv; // empty if lowrank
+    MatrixXs Vlr;  // Q x N, AInv = I_N - Vlr'Vlr if lowrank
     // computed quantities 
     int D;
     int N;
-    double delta;
-    Eigen::ArrayXd m;
-    Eigen::RowVectorXd n;
-    MatrixXd S;  // I_D-1 + KEAE'
-    //Eigen::HouseholderQR<MatrixXd> Sdec;
-    Eigen::PartialPivLU<MatrixXd> Sdec;
-    MatrixXd E;  // eta-ThetaX
-    ArrayXXd O;  // exp{eta}
+    Scalar delta;
+    ArrayXs m;
+    RowVectorXs n;
+    MatrixPs S;  // I_D-1 + KEAE' (or I_D-1 + L'EAE'L if chol)
+    //Eigen::HouseholderQR<MatrixPs> Sdec;
+    Eigen::PartialPivLU<MatrixPs> Sdec;
+    Eigen::LLT<MatrixPs> Sllt; // used in place of Sdec if chol
+    MatrixPs L;   // cholesky factor of KInv (AInv if sylvester) if chol
+    MatrixPNs E;  // eta-ThetaX
+    MatrixPNs rhomat; // multinomial probabilities
+    MatrixXs C;
     // only needed for gradient and hessian
-    MatrixXd rhomat;
-    VectorXd rho; 
-    MatrixXd C;
-    MatrixXd R;
+    MatrixPs R;
+    // workspace (reused between calls to avoid reallocation)
+    MatrixPs EC;    // E*C (or E'*C for sylvester)
+    MatrixPs RRT;   // R + R'
+    MatrixPNs g;    // gradient
+    Eigen::VectorXi permvisit; // for sign of LU permutation
+    MatrixXs LE;    // L'*E (L'*E' for sylvester) if chol
+    MatrixXs CL;    // C*L if chol
+    MatrixPs W;     // Sllt.matrixL()^{-1}*L' if chol
+    MatrixXs VE;    // Vlr*E' if lowrank
     
     // testing
     bool sylv;
+    bool sparseY;
+    bool chol;
+    bool lowrank;
     
+    // AInv given by its woodbury factor, only kept in that form if it is 
+    //   never needed densely (must be called before initChol)
+    void initLowRank(bool lowrank){
+      this->lowrank = lowrank;
+      if (!lowrank) return;
+      Vlr = AInv;
+      AInv.resize(0, 0);
+      if (sylv & (N < (D-1))){
+        AInv = MatrixXs::Identity(N, N);
+        AInv.noalias() -= Vlr.transpose()*Vlr;
+        this->lowrank = false;
+      }
+    }
+    
+    // C = AInv*E'
+    void updateC(){
+      if (lowrank){
+        C = E.transpose();
+        VE.noalias() = Vlr*C;
+        C.noalias() -= Vlr.transpose()*VE;
+      } else {
+        C.noalias() = AInv*E.transpose();
+      }
+    }
+    
+    // cholesky factor of whichever of KInv or AInv S is similar to
+    void initChol(bool chol){
+      this->chol = chol;
+      if (!chol) return;
+      Eigen::LLT<MatrixPs> Fllt;
+      if (sylv & (N < (D-1))){
+        Fllt.compute(AInv);
+      } else {
+        Fllt.compute(KInv);
+      }
+      if (Fllt.info() != Eigen::Success)
+        throw std::runtime_error("KInv and AInv must be positive definite for chol=true");
+      L = Fllt.matrixL();
+    }
+    
+    // split loops over samples across threads? (per sample work is O(D) so
+    //   small problems stay on one thread)
+    bool parcols() const { return N*(D-1) >= 16384; }
+    
+    // double precision copies for the StructuredHessian (float only)
+    MatrixXd AInvd;
+    MatrixXd Vlrd;
+    const MatrixXd& toDouble(const MatrixXd& X, MatrixXd& store){ return X; }
+    const MatrixXd& toDouble(const Eigen::MatrixXf& X, MatrixXd& store){
+      store = X.template cast<double>();
+      return store;
+    }
     
   public:
-    PibbleCollapsed(const ArrayXXd Y_,          // constructor
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    
+    PibbleCollapsedT(const ArrayXXd Y_,          // constructor
                         const double upsilon_,
                         const MatrixXd ThetaX_,
                         const MatrixXd KInv_,
                         const MatrixXd AInv_, 
-                        bool sylv=false) :
-    Y(Y_), upsilon(upsilon_), ThetaX(ThetaX_), KInv(KInv_), AInv(AInv_)
+                        bool sylv=false,
+                        bool chol=false, 
+                        bool lowrank=false) :
+    Y(Y_.template cast<Scalar>()), upsilon(upsilon_), 
+    ThetaX(ThetaX_.template cast<Scalar>()), KInv(KInv_.template cast<Scalar>()), 
+    AInv(AInv_.template cast<Scalar>())
     {
       D = Y.rows();           // number of multinomial categories
       N = Y.cols();           // number of samples
       n = Y.colwise().sum();  // total number of counts per sample
       delta = 0.5*(upsilon + N + D - 2.0);
-      this->sylv = sylv;
+      this->sylv = (P == Eigen::Dynamic) && sylv;
+      sparseY = false;
+      initLowRank(lowrank);
+      initChol(chol);
+    }
+    
+    PibbleCollapsedT(const Eigen::SparseMatrix<double>& Y_, // sparse counts
+                        const double upsilon_,
+                        const MatrixXd ThetaX_,
+                        const MatrixXd KInv_,
+                        const MatrixXd AInv_, 
+                        bool sylv=false,
+                        bool chol=false, 
+                        bool lowrank=false) :
+    Ysp(Y_.template cast<Scalar>()), upsilon(upsilon_), 
+    ThetaX(ThetaX_.template cast<Scalar>()), KInv(KInv_.template cast<Scalar>()), 
+    AInv(AInv_.template cast<Scalar>())
+    {
+      D = Ysp.rows();         // number of multinomial categories
+      N = Ysp.cols();         // number of samples
+      n = RowVectorXs::Zero(N);
+      for (int j=0; j<N; j++){
+        for (typename SparseMatrixs::InnerIterator it(Ysp, j); it; ++it)
+          n(j) += it.value();
+      }
+      delta = 0.5*(upsilon + N + D - 2.0);
+      this->sylv = (P == Eigen::Dynamic) && sylv;
+      sparseY = true;
+      initLowRank(lowrank);
+      initChol(chol);
     }
-    ~PibbleCollapsed(){}                      // destructor
+    // prior given as X (Q x N) and Gamma (Q x Q) rather than AInv, 
+    //   AInv = (I_N + X'*Gamma*X)^{-1} is applied through woodbury
+    template <typename YType>
+    PibbleCollapsedT(const YType& Y_, 
+                        const double upsilon_,
+                        const MatrixXd ThetaX_,
+                        const MatrixXd KInv_,
+                        const MatrixXd X_, 
+                        const MatrixXd Gamma_, 
+                        bool sylv=false,
+                        bool chol=false) :
+    PibbleCollapsedT(Y_, upsilon_, ThetaX_, KInv_, 
+                     woodbury_ainv_factor(X_, Gamma_), sylv, chol, true)
+    {}
+    ~PibbleCollapsedT(){}                      // destructor
     
     // Update with Eta when it comes in as a vector
+    // Note: all storage is reused after the first call (no reallocation 
+    //   unless eta changes size) 
     void updateWithEtaLL(const Ref<const VectorXd>& etavec){
       const Map<const MatrixXd> eta(etavec.data(), D-1, N);
-      E = eta - ThetaX;
-      if (sylv & (N < (D-1))){
-        S.noalias() = AInv*E.transpose()*KInv*E;
-        S.diagonal() += VectorXd::Ones(N);
+      E = eta.template cast<Scalar>() - ThetaX;
+      if (chol){
+        // S = I + L'*E*C*L formed as (L'*E)*(C*L), never multiplying by KInv
+        if (sylv & (N < (D-1))){
+          C.noalias() = KInv*E;
+          LE.noalias() = L.template triangularView<Eigen::Lower>().transpose()*E.transpose();
+        } else {
+          updateC();
+          LE.noalias() = L.template triangularView<Eigen::Lower>().transpose()*E;
+        }
+        CL.noalias() = C*L.template triangularView<Eigen::Lower>();
+        S.noalias() = LE*CL;
+        S.diagonal().array() += 1;
+        Sllt.compute(S);
+        if (Sllt.info() != Eigen::Success)
+          throw std::runtime_error("Cholesky decomposition of I + L'EAE'L failed");
+      } else if (sylv & (N < (D-1))){
+        C.noalias() = KInv*E;
+        EC.noalias() = E.transpose()*C;
+        S.noalias() = AInv*EC;
+        S.diagonal().array() += 1;
+        Sdec.compute(S);
       } else {
-        S.noalias() = KInv*E*AInv*E.transpose();
-        S.diagonal() += VectorXd::Ones(D-1);  
+        updateC();
+        EC.noalias() = E*C;
+        S.noalias() = KInv*EC;
+        S.diagonal().array() += 1;  
+        Sdec.compute(S);
+      }
+      // exp, column sums and normalization in one sweep over columns
+      rhomat.resize(D-1, N);
+      m.resize(N);
+      #pragma omp parallel for if(parcols())
+      for (int j=0; j<N; j++){
+        rhomat.col(j) = eta.col(j).template cast<Scalar>().array().exp().matrix();
+        m(j) = 1 + rhomat.col(j).sum();
+        rhomat.col(j) /= m(j);
       }
-      Sdec.compute(S);
-      O = eta.array().exp();
-      m = O.colwise().sum();
-      m += Eigen::ArrayXd::Ones(N);
     }
     
     // Must be called after updateWithEtaLL 
     void updateWithEtaGH(){
-      rhomat = (O.rowwise()/m.transpose()).matrix();
-      Map<VectorXd> rhovec(rhomat.data() , rhomat.size());
-      rho = rhovec; // probably could be done in one line rather than 2 (above)
-      if (sylv & (N < (D-1))){
-        C.noalias() = KInv*E;
+      if (chol){
+        // S^{-1}KInv = L*T^{-1}*L' = W'W with W = U^{-1}L' and T = UU'
+        W = L.transpose();
+        Sllt.matrixL().solveInPlace(W);
+        R.noalias() = W.transpose()*W;
+      } else if (sylv & (N < (D-1))){
         R.noalias() = Sdec.solve(AInv); // S^{-1}AInv
       } else {
-        C.noalias() = AInv*E.transpose();
         R.noalias() = Sdec.solve(KInv); // S^{-1}KInv    
       }
     }
@@ -108,17 +294,49 @@ class PibbleCollapsed : public mongrel::MongrelModel {
     double calcLogLik(const Ref<const VectorXd>& etavec){
       const Map<const MatrixXd> eta(etavec.data(), D-1, N);
       double ll=0.0;
-      // start with multinomial ll
-      ll += (Y.topRows(D-1)*eta.array()).sum() - n*m.log().matrix();
+      // start with multinomial ll (summed per sample then reduced)
+      if (sparseY){
+        #pragma omp parallel for reduction(+:ll) if(parcols())
+        for (int j=0; j<N; j++){
+          Scalar yeta = 0.0;
+          for (typename SparseMatrixs::InnerIterator it(Ysp, j); it; ++it){
+            if (it.row() < D-1) yeta += it.value()*Scalar(eta(it.row(), j));
+          }
+          ll += yeta - n(j)*std::log(m(j));
+        }
+      } else {
+        #pragma omp parallel for reduction(+:ll) if(parcols())
+        for (int j=0; j<N; j++){
+          Scalar yeta = Y.col(j).head(D-1).matrix().dot(
+            eta.col(j).template cast<Scalar>());
+          ll += yeta - n(j)*std::log(m(j));
+        }
+      }
       // Now compute collapsed prior ll
+      if (chol){
+        double ld = 0.0;
+        for (int i=0; i<Sllt.matrixLLT().rows(); i++)
+          ld += log(Sllt.matrixLLT()(i,i));
+        ll -= 2.0*delta*ld;
+        return ll;
+      }
       //ll -= delta*Sdec.logAbsDeterminant();
       // Following was adapted from : 
       //   https://gist.github.com/redpony/fc8a0db6b20f7b1a3f23
       double ld = 0.0;
-      double c = Sdec.permutationP().determinant();
-      VectorXd diagLU = Sdec.matrixLU().diagonal();
-      for (unsigned i = 0; i < diagLU.rows(); ++i) {
-        const double& lii = diagLU(i);
+      // sign of permutation (PermutationBase::determinant allocates)
+      const auto& perm = Sdec.permutationP().indices();
+      double c = 1.0;
+      permvisit.setZero(perm.size());
+      for (int i=0; i<perm.size(); i++){
+        if (permvisit(i)) continue;
+        int k = i;
+        int len = 0;
+        while (!permvisit(k)){ permvisit(k) = 1; k = perm(k); len++; }
+        if (len % 2 == 0) c *= -1; // even length cycle is an odd permutation
+      }
+      for (unsigned i = 0; i < Sdec.matrixLU().rows(); ++i) {
+        const double lii = Sdec.matrixLU()(i,i);
         if (lii < 0.0) c *= -1;
         ld += log(std::abs(lii));
       }
@@ -128,91 +346,89 @@ class PibbleCollapsed : public mongrel::MongrelModel {
     }
     
     // Must have called updateWithEtaLL and then updateWithEtaGH first 
-    VectorXd calcGrad(){
+    // computes gradient into workspace g (as D-1 x N matrix)
+    void updateGrad(){
       // For Multinomial
-      MatrixXd g = (Y.topRows(D-1) - (rhomat.array().rowwise()*n.array())).matrix();
-      //Rcout << "dim Y:" << Y.size() << std::endl;
-      //Rcout << "dim g multinomial: " << g.size() << std::endl;
-      //Rcout << "dim g t: " << (delta*C*(R+R.transpose()).eval()).size() << std::endl;
+      g.resize(D-1, N);
+      #pragma omp parallel for if(parcols())
+      for (int j=0; j<N; j++){
+        if (sparseY){
+          g.col(j) = -n(j)*rhomat.col(j);
+          for (typename SparseMatrixs::InnerIterator it(Ysp, j); it; ++it){
+            if (it.row() < D-1) g(it.row(), j) += it.value();
+          }
+        } else {
+          g.col(j) = Y.col(j).head(D-1).matrix() - n(j)*rhomat.col(j);
+        }
+      }
       // For MatrixVariate T
+      RRT = R + R.transpose();
       if (sylv & (N < (D-1))){
-        g.noalias() += -delta*C*(R+R.transpose());
+        g.noalias() -= delta*C*RRT;
       } else {
-        g.noalias() += -delta*(R + R.transpose())*C.transpose();        
+        g.noalias() -= delta*RRT*C.transpose();        
       }
-      Map<VectorXd> grad(g.data(), g.size()); 
-      return grad; // not transposing (leaving as vector)
+    }
+    
+    // Must have called updateWithEtaLL and then updateWithEtaGH first 
+    VectorXd calcGrad(){
+      updateGrad();
+      Map<VectorXs> grad(g.data(), g.size()); 
+      return grad.template cast<double>(); // not transposing (leaving as vector)
     }
     
     
     // Must have called updateWithEtaLL and then updateWithEtaGH first 
-    MatrixXd calcHess(){
-      bool tmp_sylv = sylv;
+    // Hessian in factored form (nothing of size N(D-1) x N(D-1) is formed)
+    mongrel::StructuredHessian calcStructuredHess(){
+      const MatrixXd& AInvh = toDouble(AInv, AInvd);
       if (sylv & (N < (D-1))){
-        MatrixXd eta = E + ThetaX;
-        Map<VectorXd> etavec(eta.data(), N*(D-1));
-        this->sylv=false;
-        updateWithEtaLL(etavec);
-        updateWithEtaGH();
-      }
-      // for MatrixVariate T
-      MatrixXd H(N*(D-1), N*(D-1));
-      MatrixXd RCT(D-1, N);
-      MatrixXd CR(N, D-1);
-      MatrixXd L(N*(D-1), N*(D-1));
-      RCT.noalias() = R*C.transpose();
-      CR.noalias() = C*R;
-      krondense_inplace(L, C*RCT, R.transpose());
-      //L.noalias() = krondense(C*RCT, R.transpose());
-      krondense_inplace(H, AInv, R+R.transpose());
-      //H.noalias() = krondense(AInv, R+R.transpose());
-      H.noalias() -= L+L.transpose();
-      krondense_inplace(L, RCT, RCT.transpose());
-      //L.noalias() = krondense(RCT, RCT.transpose()); // reuse L
-      krondense_inplace_add(L, CR.transpose(), CR);
-      //L.noalias() += krondense(CR.transpose(), CR); // reuse L
-      tveclmult_minus(N, D-1, L, H);
-      //H.noalias() -= tveclmult(N, D-1, L);
-      H.noalias() = -delta * H;
-      
-      // For Multinomial
-      VectorXd rho_parallel;
-      VectorXd n_parallel;
-      rho_parallel = rho; 
-      n_parallel = n;
-      
-      #pragma omp parallel shared(rho_parallel, n_parallel)
-      {
-      MatrixXd W(D-1, D-1);
-      //VectorXd rhoseg(D-1);
-      #pragma omp for 
-      for (int j=0; j<N; j++){
-        //rhoseg = rho.segment(j*(D-1), D-1);
-        Eigen::Ref<VectorXd> rhoseg = rho_parallel.segment(j*(D-1), D-1);
-        W.noalias() = rhoseg*rhoseg.transpose();
-        W.diagonal() -= rhoseg;
-        H.block(j*(D-1), j*(D-1), D-1, D-1).noalias()  += n_parallel(j)*W;
+        // Hessian is written in terms of C and R without sylvester identity
+        //   Woodbury: S_{D-1}^{-1}KInv = KInv - KInv*E*S_N^{-1}*AInv*E'*KInv
+        MatrixXs Cf = AInv*E.transpose();
+        MatrixXs Rf = KInv;
+        Rf.noalias() -= C*R*C.transpose();
+        return mongrel::StructuredHessian(AInvh, Rf.template cast<double>(), 
+                                          Cf.template cast<double>(), 
+                                          rhomat.template cast<double>(), 
+                                          n.template cast<double>(), delta);
       }
+      if (lowrank){
+        return mongrel::StructuredHessian(toDouble(Vlr, Vlrd), 
+                                          R.template cast<double>(), 
+                                          C.template cast<double>(), 
+                                          rhomat.template cast<double>(), 
+                                          n.template cast<double>(), delta, 
+                                          true);
       }
-      // Turn back on sylv option if it was wanted:
-      this->sylv = tmp_sylv;
-      return H;
+      return mongrel::StructuredHessian(AInvh, R.template cast<double>(), 
+                                        C.template cast<double>(), 
+                                        rhomat.template cast<double>(), 
+                                        n.template cast<double>(), delta);
     }
     
-    // function to quickly calculate approximation of hessian-vector product
+    // Must have called updateWithEtaLL and then updateWithEtaGH first 
+    MatrixXd calcHess(){
+      return calcStructuredHess().toDense();
+    }
+    
+    // Must have called updateWithEtaLL and then updateWithEtaGH first 
+    // Exact hessian-vector product H*v using the kronecker / commutation 
+    //   structure of the hessian without ever forming the N(D-1) x N(D-1) 
+    //   matrix (see StructuredHessian)
+    //  @param v vector to multiply by (length N(D-1))
+    VectorXd calcHessVectorProd(const Ref<const VectorXd>& v){
+      return calcStructuredHess().matvec(v);
+    }
+    
+    // Exact hessian-vector product evaluated at etavec 
     //  @param etavec eta at which to calculate hessian
     //  @param v vector to multiply by
-    //  @param r size of hessian-vector product difference 
-    //  @ref https://justindomke.wordpress.com/2009/01/17/hessian-vector-products/
     VectorXd calcHessVectorProd(const Ref<const VectorXd>& etavec, 
-                                VectorXd v, double r=0.001){
-      updateWithEtaLL(etavec+r*v);
-      updateWithEtaGH();
-      VectorXd g1 = calcGrad();
-      updateWithEtaLL(etavec-r*v);
+                                const Ref<const VectorXd>& v){
+      updateWithEtaLL(etavec);
       updateWithEtaGH();
-      VectorXd g2 = calcGrad();
-      return (g1-g2).array()/(2.0*r);
+      return calcHessVectorProd(v);
     }
     
     int getN() { return N; }
@@ -223,12 +439,16 @@ class PibbleCollapsed : public mongrel::MongrelModel {
     virtual double f_grad(Numer::Constvec& eta, Numer::Refvec grad){
       updateWithEtaLL(eta);    // precompute things needed for LogLik
       updateWithEtaGH();       // precompute things needed for gradient and hessian
-      grad = -calcGrad();      // negative because wraper minimizes
+      updateGrad();
+      Map<VectorXs> gvec(g.data(), g.size()); 
+      grad = -gvec.template cast<double>(); // negative because wraper minimizes
       return -calcLogLik(eta); // negative because wraper minimizes
     }
     
 };
 
+typedef PibbleCollapsedT<double> PibbleCollapsed;
+typedef PibbleCollapsedT<float> PibbleCollapsedFloat;
 
 
 
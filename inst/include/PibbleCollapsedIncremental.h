@@ -0,0 +1,202 @@
+#ifndef MONGREL_MMTC_INCR_H
+#define MONGREL_MMTC_INCR_H
+
+#include <MatrixAlgebra.h>
+#include <vector>
+
+using namespace Rcpp;
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::ArrayXXd;
+using Eigen::VectorXd;
+using Eigen::RowVectorXd;
+using Eigen::Ref;
+
+/* Collapsed Pibble model (see PibbleCollapsedT) evaluated incrementally
+ *  when only a subset of the N columns (samples) of eta change, for use by
+ *  adam::optim_adam_minibatch.
+ *
+ *  Notation: P = D-1, B a set of sample indices, Z_B the columns of Z in B
+ *  (rows for C). Cached are E = eta - ThetaX, C = AInv*E' (N x P),
+ *  M = E*AInv*E' (P x P) and the per-sample multinomial log-likelihood.
+ *  When columns B change by dE_B, with X = dE_B*C_B
+ *    M <- M + X + X' + dE_B*AInv_BB*dE_B'
+ *    C <- C + AInv_.B*dE_B'
+ *  so an update costs O(|B|NP + |B|P^2 + P^3) rather than O(N^2P).
+ *  If lowrank=true (AInv = I_N - V'V, see woodbury_ainv_factor) C is not
+ *  stored, instead W = V*E' (Q x P) is and C_B = E_B' - V_B'W, so an
+ *  update costs O(|B|QP + |B|P^2 + P^3) independent of N.
+ *
+ *  The gradient for columns B is exact (not an estimate) given the current
+ *  eta. Cached quantities drift with rounding error, call reset
+ *  periodically.
+ */
+class PibbleCollapsedIncremental {
+  private:
+    const ArrayXXd Y;
+    const double upsilon;
+    const MatrixXd ThetaX;
+    const MatrixXd KInv;
+    const MatrixXd AInv; // N x N, or Q x N V if lowrank
+    const bool lowrank;
+    int D;
+    int N;
+    int P;
+    double delta;
+    RowVectorXd n;
+    // cached quantities
+    MatrixXd eta;       // P x N
+    MatrixXd E;         // eta-ThetaX
+    MatrixXd C;         // N x P AInv*E' (empty if lowrank)
+    MatrixXd W;         // Q x P V*E' (empty unless lowrank)
+    MatrixXd M;         // P x P E*AInv*E'
+    VectorXd llmult;    // per sample multinomial log-likelihood
+    MatrixXd rhomat;    // P x N multinomial probabilities
+    Eigen::PartialPivLU<MatrixXd> Sdec; // S = I + KInv*M
+    MatrixXd R;         // S^{-1}*KInv
+
+    // multinomial terms of column j
+    void updateColumnMult(int j){
+      double m = 1.0;
+      for (int i=0; i<P; i++){
+        rhomat(i,j) = exp(eta(i,j));
+        m += rhomat(i,j);
+      }
+      rhomat.col(j) /= m;
+      llmult(j) = Y.col(j).head(P).matrix().dot(eta.col(j)) - n(j)*log(m);
+    }
+
+    // S and R from M
+    void updateS(){
+      MatrixXd S = KInv*M;
+      S.diagonal().array() += 1;
+      Sdec.compute(S);
+      R = Sdec.solve(KInv);
+    }
+
+    // rows B of C (P x |B|, transposed)
+    MatrixXd CBt(const std::vector<int>& idx) const {
+      int b = idx.size();
+      MatrixXd CB(P, b);
+      if (lowrank){
+        MatrixXd VB(AInv.rows(), b);
+        for (int k=0; k<b; k++){
+          CB.col(k) = E.col(idx[k]);
+          VB.col(k) = AInv.col(idx[k]);
+        }
+        CB.noalias() -= W.transpose()*VB;
+      } else {
+        for (int k=0; k<b; k++) CB.col(k) = C.row(idx[k]).transpose();
+      }
+      return CB;
+    }
+
+  public:
+    PibbleCollapsedIncremental(const ArrayXXd& Y_,
+                               const double upsilon_,
+                               const MatrixXd& ThetaX_,
+                               const MatrixXd& KInv_,
+                               const MatrixXd& AInv_,
+                               bool lowrank_=false) :
+    Y(Y_), upsilon(upsilon_), ThetaX(ThetaX_), KInv(KInv_), AInv(AInv_),
+    lowrank(lowrank_)
+    {
+      D = Y.rows();
+      N = Y.cols();
+      P = D-1;
+      n = Y.colwise().sum();
+      delta = 0.5*(upsilon + N + D - 2.0);
+    }
+    ~PibbleCollapsedIncremental(){}
+
+    int nblocks() const { return N; }
+    int blocksize() const { return P; }
+
+    // recompute all cached quantities at etavec, returns negative LogLik
+    double reset(const Ref<const VectorXd>& etavec){
+      eta = Map<const MatrixXd>(etavec.data(), P, N);
+      E = eta - ThetaX;
+      if (lowrank){
+        W.noalias() = AInv*E.transpose();
+        M.noalias() = E*E.transpose();
+        M.noalias() -= W.transpose()*W;
+      } else {
+        C.noalias() = AInv*E.transpose();
+        M.noalias() = E*C;
+      }
+      rhomat.resize(P, N);
+      llmult.resize(N);
+      for (int j=0; j<N; j++) updateColumnMult(j);
+      updateS();
+      return nll();
+    }
+
+    // negative LogLik at current eta (S = I + KInv*M has positive determinant)
+    double nll() const {
+      double ld = Sdec.matrixLU().diagonal().cwiseAbs().array().log().sum();
+      return -(llmult.sum() - delta*ld);
+    }
+
+    // negative gradient with respect to columns idx at current eta (P x |idx|)
+    MatrixXd gradBlocks(const std::vector<int>& idx) const {
+      int b = idx.size();
+      MatrixXd g(P, b);
+      for (int k=0; k<b; k++){
+        int j = idx[k];
+        g.col(k) = Y.col(j).head(P).matrix() - n(j)*rhomat.col(j);
+      }
+      g.noalias() -= delta*(R + R.transpose())*CBt(idx);
+      return -g;
+    }
+
+    // negative gradient with respect to all of eta at current eta
+    VectorXd grad() const {
+      std::vector<int> idx(N);
+      for (int j=0; j<N; j++) idx[j] = j;
+      MatrixXd g = gradBlocks(idx);
+      Map<VectorXd> gv(g.data(), g.size());
+      return gv;
+    }
+
+    // replace columns idx of eta with etaB (P x |idx|)
+    void updateBlocks(const std::vector<int>& idx,
+                      const Ref<const MatrixXd>& etaB){
+      int b = idx.size();
+      MatrixXd dE(P, b);
+      for (int k=0; k<b; k++) dE.col(k) = etaB.col(k) - eta.col(idx[k]);
+      MatrixXd CB = CBt(idx);
+      MatrixXd ABB(b, b);
+      MatrixXd VB(AInv.rows(), b); // columns B of V (AInv if not lowrank)
+      for (int k=0; k<b; k++) VB.col(k) = AInv.col(idx[k]);
+      if (lowrank){
+        ABB.noalias() = -VB.transpose()*VB;
+        ABB.diagonal().array() += 1;
+      } else {
+        for (int k=0; k<b; k++) ABB.row(k) = VB.row(idx[k]);
+      }
+      MatrixXd X(P, P);
+      X.noalias() = dE*CB.transpose();
+      M += X + X.transpose();
+      M.noalias() += dE*ABB*dE.transpose();
+      if (lowrank){
+        W.noalias() += VB*dE.transpose();
+      } else {
+        C.noalias() += VB*dE.transpose();
+      }
+      for (int k=0; k<b; k++){
+        int j = idx[k];
+        eta.col(j) = etaB.col(k);
+        E.col(j) += dE.col(k);
+        updateColumnMult(j);
+      }
+      updateS();
+    }
+
+    // current eta as a vector
+    VectorXd getEta() const {
+      Map<const VectorXd> ev(eta.data(), eta.size());
+      return ev;
+    }
+};
+
+#endif
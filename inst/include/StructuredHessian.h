@@ -0,0 +1,263 @@
+#ifndef MONGREL_STRUCTHESS_H
+#define MONGREL_STRUCTHESS_H
+
+#include <MatrixAlgebra.h>
+
+using namespace Rcpp;
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+using Eigen::RowVectorXd;
+using Eigen::Ref;
+
+namespace mongrel {
+
+/* Adds the multinomial blocks n_j*(rho_j*rho_j' - diag(rho_j)) to H. Block
+ *  j is placed at rows j*P and columns j*P (diag=true, full hessian) or
+ *  column 0 (diag=false, blocks row bound together).
+ *  Pf is P if known at compile time (else Eigen::Dynamic) so that the
+ *  per-sample temporaries live on the stack and loops unroll.
+ */
+template <int Pf>
+inline void add_multinomial_blocks_fixed(Ref<MatrixXd> H,
+                                         const Ref<const MatrixXd>& rhomat,
+                                         const Ref<const RowVectorXd>& n,
+                                         bool diag){
+  const int P = rhomat.rows();
+  const int N = rhomat.cols();
+  #pragma omp parallel for shared(H)
+  for (int j=0; j<N; j++){
+    Eigen::Matrix<double, Pf, 1> rj = rhomat.col(j);
+    Eigen::Matrix<double, Pf, Pf> W;
+    W.noalias() = rj*rj.transpose();
+    W.diagonal() -= rj;
+    H.template block<Pf, Pf>(j*P, diag ? j*P : 0, P, P) += n(j)*W;
+  }
+}
+
+// dispatch of add_multinomial_blocks_fixed on P (fixed sizes for small D)
+inline void add_multinomial_blocks(Ref<MatrixXd> H,
+                                   const Ref<const MatrixXd>& rhomat,
+                                   const Ref<const RowVectorXd>& n,
+                                   bool diag){
+  switch (rhomat.rows()){
+    case 2: add_multinomial_blocks_fixed<2>(H, rhomat, n, diag); break;
+    case 3: add_multinomial_blocks_fixed<3>(H, rhomat, n, diag); break;
+    case 4: add_multinomial_blocks_fixed<4>(H, rhomat, n, diag); break;
+    case 5: add_multinomial_blocks_fixed<5>(H, rhomat, n, diag); break;
+    case 6: add_multinomial_blocks_fixed<6>(H, rhomat, n, diag); break;
+    case 7: add_multinomial_blocks_fixed<7>(H, rhomat, n, diag); break;
+    default: add_multinomial_blocks_fixed<Eigen::Dynamic>(H, rhomat, n, diag);
+  }
+}
+
+/* Hessian of the collapsed multinomial matrix-t log-likelihood stored by
+ *  its factors rather than as a dense N(D-1) x N(D-1) matrix.
+ *
+ *  Notation: P = D-1, V = matrix(v, P, N), blocks of the hessian are P x P
+ *  and indexed by sample. With C = AInv*E' and R = S^{-1}*KInv
+ *  (both without sylvester identity) the hessian is given by
+ *    H = -delta*[AInv (x) (R+R') - (CRC' (x) R') - (CRC' (x) R')'
+ *                - TVEC(N,P)*(RC' (x) CR + R'C' (x) CR')]
+ *        + blockdiag_j(n_j*(rho_j*rho_j' - diag(rho_j)))
+ *
+ *  Storage is O(N^2 + NP + P^2). Note: AInv is not copied, the object
+ *  is only valid while the matrix it was constructed from is alive and
+ *  unchanged (e.g., until the model it came from is next updated).
+ *
+ *  If lowrank=true the first argument is instead a Q x N matrix V with
+ *  AInv = I_N - V'V (see woodbury_ainv_factor) and storage is
+ *  O(NQ + NP + P^2), AInv is only formed by toDense (or toDenseNegLower).
+ */
+class StructuredHessian {
+  private:
+    int N;
+    int P;
+    double delta;
+    Map<const MatrixXd> AInv; // N x N (A for maltipoo), Q x N V if lowrank
+    MatrixXd R;               // P x P
+    MatrixXd C;               // N x P
+    MatrixXd RCT;             // P x N
+    MatrixXd rhomat;          // P x N multinomial probabilities
+    RowVectorXd n;            // total counts per sample
+    bool lowrank;
+
+    // Z*AInv for Z with N columns
+    MatrixXd rmultAInv(const Ref<const MatrixXd>& Z) const {
+      if (!lowrank) return Z*AInv;
+      MatrixXd ZA = Z;
+      ZA.noalias() -= (Z*AInv.transpose())*AInv;
+      return ZA;
+    }
+
+    // AInv as a dense N x N matrix
+    MatrixXd denseAInv() const {
+      if (!lowrank) return AInv;
+      MatrixXd A = MatrixXd::Identity(N, N);
+      A.noalias() -= AInv.transpose()*AInv;
+      return A;
+    }
+
+  public:
+    StructuredHessian(const Ref<const MatrixXd>& AInv_,
+                      const Ref<const MatrixXd>& R_,
+                      const Ref<const MatrixXd>& C_,
+                      const Ref<const MatrixXd>& rhomat_,
+                      const Ref<const RowVectorXd>& n_,
+                      double delta_,
+                      bool lowrank_=false) :
+    AInv(AInv_.data(), AInv_.rows(), AInv_.cols()),
+    R(R_), C(C_), rhomat(rhomat_), n(n_), lowrank(lowrank_)
+    {
+      N = C.rows();
+      P = C.cols();
+      delta = delta_;
+      RCT.noalias() = R*C.transpose();
+    }
+    ~StructuredHessian(){}
+
+    int rows() const { return N*P; }
+    int cols() const { return N*P; }
+    int nblocks() const { return N; }
+    int blocksize() const { return P; }
+    const MatrixXd& getRhomat() const { return rhomat; }
+    const RowVectorXd& getN() const { return n; }
+
+    // j-th P x P multinomial block n_j*(rho_j*rho_j' - diag(rho_j))
+    MatrixXd block(int j) const {
+      MatrixXd W(P, P);
+      W.noalias() = rhomat.col(j)*rhomat.col(j).transpose();
+      W.diagonal() -= rhomat.col(j);
+      W *= n(j);
+      return W;
+    }
+
+    // multinomial blocks row bound together into a N*P x P matrix
+    // (same layout as MaltipooCollapsed::calcPartialHess)
+    MatrixXd blocks() const {
+      MatrixXd B = MatrixXd::Zero(N*P, P);
+      add_multinomial_blocks(B, rhomat, n, false);
+      return B;
+    }
+
+    // H*v
+    VectorXd matvec(const Ref<const VectorXd>& v) const {
+      const Map<const MatrixXd> V(v.data(), P, N);
+      MatrixXd CRT(P, N); // (CR)' = R'C'
+      MatrixXd VC(P, P);
+      MatrixXd h(P, N);
+      CRT.noalias() = R.transpose()*C.transpose();
+      VC.noalias() = V*C;
+
+      // for MatrixVariate T
+      h.noalias() = (R + R.transpose())*rmultAInv(V);
+      h.noalias() -= R.transpose()*VC*CRT;
+      h.noalias() -= R*VC*RCT;
+      h.noalias() -= (RCT*V.transpose())*RCT;
+      h.noalias() -= (CRT*V.transpose())*CRT;
+      h *= -delta;
+
+      // For Multinomial
+      for (int j=0; j<N; j++){
+        double rv = rhomat.col(j).dot(V.col(j));
+        h.col(j).noalias() += n(j)*(rv*rhomat.col(j) -
+          rhomat.col(j).cwiseProduct(V.col(j)));
+      }
+      Map<VectorXd> hv(h.data(), h.size());
+      return hv;
+    }
+
+    // diagonal of H without forming H
+    VectorXd diagonal() const {
+      MatrixXd d(P, N);
+      VectorXd Rdiag = R.diagonal();
+      for (int j=0; j<N; j++){
+        double crcjj = C.row(j).dot(RCT.col(j));
+        double ajj = lowrank ? 1.0 - AInv.col(j).squaredNorm() : AInv(j,j);
+        for (int i=0; i<P; i++){
+          double cr = C.row(j).dot(R.col(i)); // (CR)_{ji}
+          d(i,j) = 2.0*(ajj - crcjj)*Rdiag(i) - RCT(i,j)*RCT(i,j) - cr*cr;
+        }
+      }
+      d *= -delta;
+      d.array() += (rhomat.array().square() - rhomat.array()).rowwise()*n.array();
+      Map<VectorXd> dv(d.data(), d.size());
+      return dv;
+    }
+
+    // P x P diagonal blocks of H (multinomial and matrix-t parts) row bound 
+    //   together into a N*P x P matrix (layout of blocks()), block j is 
+    //   -delta*[(AInv_jj - c_j)(R+R') - a_j*a_j' - b_j*b_j'] + multinomial 
+    //   block, c_j = C_j*R*C_j', a_j = R*C_j', b_j = R'*C_j' (C_j row j of C)
+    MatrixXd diagonalBlocks() const {
+      MatrixXd B(N*P, P);
+      MatrixXd RRT = R + R.transpose();
+      MatrixXd CRT(P, N);
+      CRT.noalias() = R.transpose()*C.transpose();
+      #pragma omp parallel for shared(B)
+      for (int j=0; j<N; j++){
+        double crcjj = C.row(j).dot(RCT.col(j));
+        double ajj = lowrank ? 1.0 - AInv.col(j).squaredNorm() : AInv(j,j);
+        MatrixXd Bj = (ajj - crcjj)*RRT;
+        Bj.noalias() -= RCT.col(j)*RCT.col(j).transpose();
+        Bj.noalias() -= CRT.col(j)*CRT.col(j).transpose();
+        Bj *= -delta;
+        Bj.noalias() += n(j)*rhomat.col(j)*rhomat.col(j).transpose();
+        Bj.diagonal() -= n(j)*rhomat.col(j);
+        B.middleRows(j*P, P) = Bj;
+      }
+      return B;
+    }
+
+    // Writes the NEGATIVE hessian into H (N*P x N*P, e.g., the buffer a 
+    //   cholesky then factors in place) block by block, only the blocks on 
+    //   and below the block diagonal are written (blocks above are left 
+    //   untouched). Block (i,k) of the matrix-t part is 
+    //   AInv_ik(R+R') - M_ik*R' - M_ki*R - a_k*a_i' - b_k*b_i' with M = CRC', 
+    //   a_j = R*C_j' and b_j = R'*C_j' (the TVEC term) so beyond H only 
+    //   O(N^2 + NP) storage is needed
+    void toDenseNegLower(Ref<MatrixXd> H) const {
+      MatrixXd Alr; // AInv only formed if lowrank
+      if (lowrank) Alr = denseAInv();
+      const Map<const MatrixXd> A(lowrank ? Alr.data() : AInv.data(), N, N);
+      MatrixXd M(N, N);
+      MatrixXd CRT(P, N); // (CR)' = R'C'
+      M.noalias() = C*RCT;
+      CRT.noalias() = R.transpose()*C.transpose();
+      const MatrixXd dRRT = delta*(R + R.transpose());
+      const MatrixXd dR = delta*R;
+      const MatrixXd dRT = dR.transpose();
+      const MatrixXd dRCT = delta*RCT;
+      const MatrixXd dCRT = delta*CRT;
+      #pragma omp parallel for schedule(dynamic) shared(H)
+      for (int k=0; k<N; k++){
+        for (int i=k; i<N; i++){
+          Eigen::Block<Ref<MatrixXd> > Hb = H.block(i*P, k*P, P, P);
+          // for MatrixVariate T
+          Hb.noalias() = A(i,k)*dRRT - M(i,k)*dRT - M(k,i)*dR;
+          Hb.noalias() -= RCT.col(k)*dRCT.col(i).transpose();
+          Hb.noalias() -= CRT.col(k)*dCRT.col(i).transpose();
+        }
+        // For Multinomial
+        Eigen::Block<Ref<MatrixXd> > Hk = H.block(k*P, k*P, P, P);
+        Hk.noalias() -= n(k)*rhomat.col(k)*rhomat.col(k).transpose();
+        Hk.diagonal() += n(k)*rhomat.col(k);
+      }
+    }
+
+    // Assemble the dense N*P x N*P hessian (from toDenseNegLower, no
+    //   scratch matrix of the same size)
+    MatrixXd toDense() const {
+      MatrixXd H(N*P, N*P);
+      toDenseNegLower(H);
+      #pragma omp parallel for shared(H)
+      for (int j=1; j<N*P; j++)
+        H.col(j).head(j) = H.row(j).head(j).transpose();
+      H *= -1;
+      return H;
+    }
+};
+
+}
+
+#endif
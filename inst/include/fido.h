@@ -19,7 +19,13 @@
 #include "MatDist.h"
 #include "MultDirichletBoot.h"
 #include "SpecialFunctions.h"
+#include "StructuredHessian.h"
 #include "LaplaceApproximation.h"
 #include "PibbleCollapsed.h"
+#include "PibbleCollapsedIncremental.h"
 #include "MaltipooCollapsed.h"
-#include "AdamOptim.h"
\ No newline at end of file
+#include "OptimTrace.h"
+#include "AdamOptim.h"
+#include "NewtonCGOptim.h"
+#include "PLBFGSOptim.h"
+#include "MaltipooBlockCoordinate.h"
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include <fido.h>
+
+#ifdef FIDO_USE_PARALLEL
+#include <omp.h>
+#endif
+
+using namespace Rcpp;
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+using Eigen::Map;
+
+// sampler behind a LaplaceFactor (see returnFactor in optimPibbleCollapsed)
+static lapap::LaplaceSampler& getLaplaceFactor(SEXP factor){
+  if (!Rf_inherits(factor, "laplacefactor"))
+    Rcpp::stop("factor must be a LaplaceFactor (see optimPibbleCollapsed)");
+  XPtr<lapap::LaplaceSampler> xp(factor);
+  if (xp.get() == NULL)
+    Rcpp::stop("LaplaceFactor is no longer valid (external pointers do not "
+               "survive saving and reloading), refit with returnFactor=TRUE");
+  return *xp;
+}
+
+//' Draw More Samples from a Stored Laplace Approximation
+//'
+//' Draws samples of eta from the Laplace approximation whose decomposition of
+//' the Hessian was kept by \code{\link{optimPibbleCollapsed}} with
+//' \code{returnFactor=TRUE} (or by \code{\link{pibble}}, as element
+//' \code{laplace_factor} of the pibblefit, in alr coordinates) without redoing
+//' the optimization or the decomposition. A sample costs O((N*(D-1))^2) for
+//' decomp_method "cholesky" and "eigen" (O(N*D^2) for "partial" and
+//' O((k+D)*N*D) for "lowrank").
+//'
+//' @param factor \code{LaplaceFactor} returned by
+//'   \code{\link{optimPibbleCollapsed}}
+//' @param n_samples number of samples
+//' @param seed (default: -1) random seed, if not -1 samples come from the
+//'   same counter based streams as those of the fit (so with the seed of
+//'   the fit the first samples repeat the fit's samples, use a different
+//'   seed, or \code{stream0} past the samples already drawn, for new ones)
+//' @param stream0 (default: 0) first stream of \code{seed} used (non-negative)
+//' @param ncores (default:-1) number of cores to use, if ncores==-1 then
+//'   uses default from OpenMP
+//' @return (D-1) x N x n_samples array of samples of eta
+//' @seealso \code{\link{logDensityLaplaceFactor}}
+//' @export
+//' @examples
+//' sim <- pibble_sim()
+//' fit <- optimPibbleCollapsed(sim$Y, sim$upsilon, sim$Theta%*%sim$X, sim$KInv,
+//'                             sim$AInv, random_pibble_init(sim$Y),
+//'                             n_samples=0, returnFactor=TRUE)
+//' eta <- sampleLaplaceFactor(fit$LaplaceFactor, 1000, seed=1)
+// [[Rcpp::export]]
+NumericVector sampleLaplaceFactor(SEXP factor, int n_samples, long seed=-1,
+                                  double stream0=0, int ncores=-1){
+  #ifdef FIDO_USE_PARALLEL
+    Eigen::initParallel();
+    if (ncores > 0) Eigen::setNbThreads(ncores);
+    if (ncores > 0) {
+      omp_set_num_threads(ncores);
+    } else {
+      omp_set_num_threads(omp_get_max_threads());
+    }
+  #endif
+  if (!((stream0 >= 0) && (stream0 < 18446744073709551616.0))) // [0, 2^64)
+    Rcpp::stop("stream0 must be non-negative (and below 2^64)");
+  lapap::LaplaceSampler& sampler = getLaplaceFactor(factor);
+  sampler.reseed(seed, (uint64_t)stream0);
+  NumericVector samples(Rcpp::no_init(sampler.rows()*n_samples));
+  Map<MatrixXd> samp(samples.begin(), sampler.rows(), n_samples);
+  if (sampler.sample(samp) != 0)
+    Rcpp::stop("Sampling from LaplaceFactor failed");
+  IntegerVector dims = RObject(factor).attr("dims");
+  samples.attr("dim") = IntegerVector::create(dims[0], dims[1], n_samples);
+  return samples;
+}
+
+//' Log Density of a Stored Laplace Approximation
+//'
+//' Evaluates the log density of the Laplace approximation (multivariate normal
+//' at the MAP estimate with covariance the inverse of the decomposed negative
+//' Hessian, directions chopped by eigvalthresh are ignored) kept by
+//' \code{\link{optimPibbleCollapsed}} with \code{returnFactor=TRUE}.
+//'
+//' @param factor \code{LaplaceFactor} returned by
+//'   \code{\link{optimPibbleCollapsed}}
+//' @param eta (D-1) x N matrix or (D-1) x N x K array of values of eta
+//'   (alr coordinates)
+//' @return vector of K log densities
+//' @seealso \code{\link{sampleLaplaceFactor}}
+//' @export
+// [[Rcpp::export]]
+Eigen::VectorXd logDensityLaplaceFactor(SEXP factor, NumericVector eta){
+  lapap::LaplaceSampler& sampler = getLaplaceFactor(factor);
+  int p = sampler.rows();
+  if ((eta.size() == 0) || ((eta.size() % p) != 0))
+    Rcpp::stop("eta must have (D-1) x N entries per value");
+  Map<MatrixXd> etam(eta.begin(), p, eta.size()/p);
+  VectorXd out(etam.cols());
+  if (sampler.logdensity(etam, out) != 0)
+    Rcpp::stop("Log density not available for this LaplaceFactor");
+  return out;
+}
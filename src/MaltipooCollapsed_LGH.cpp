@@ -22,6 +22,9 @@ using Eigen::VectorXd;
 //' @param eta matrix (D-1)xN of parameter values at which to calculate quantities
 //' @param sylv (default:false) if true and if N < D-1 will use sylvester determinant
 //'   identity to speed computation
+//' @param chol (default:false) if true factors S in its symmetric positive 
+//'   definite form with a Cholesky decomposition rather than LU 
+//'   (see \code{useChol} in \code{\link{optimPibbleCollapsed}})
 //' @param ell P-vector of scale factors for each variance component (aka VCScale) 
 //' @name loglikMaltipooCollapsed
 //' @export
@@ -34,8 +37,9 @@ double loglikMaltipooCollapsed(const Eigen::ArrayXXd Y,
                   const Eigen::MatrixXd U,
                   Eigen::MatrixXd eta,
                   Eigen::VectorXd ell,
-                  bool sylv=false){
-  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U, sylv);
+                  bool sylv=false,
+                  bool chol=false){
+  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U, sylv, chol);
   Map<VectorXd> etavec(eta.data(), eta.size());
   cm.updateWithEtaLL(etavec, ell);
   return cm.calcLogLik(etavec);
@@ -52,8 +56,9 @@ Eigen::VectorXd gradMaltipooCollapsed(const Eigen::ArrayXXd Y,
                          const Eigen::MatrixXd U,
                          Eigen::MatrixXd eta,
                          Eigen::VectorXd ell,
-                         bool sylv=false){
-  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U, sylv);
+                         bool sylv=false,
+                         bool chol=false){
+  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U, sylv, chol);
   Map<VectorXd> etavec(eta.data(), eta.size());
   cm.updateWithEtaLL(etavec, ell);
   cm.updateWithEtaGH();
@@ -71,8 +76,9 @@ Eigen::MatrixXd hessMaltipooCollapsed(const Eigen::ArrayXXd Y,
                          const Eigen::MatrixXd U,
                          Eigen::MatrixXd eta,
                          Eigen::VectorXd ell,
-                         bool sylv=false){
-  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U, sylv);
+                         bool sylv=false,
+                         bool chol=false){
+  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U, sylv, chol);
   Map<VectorXd> etavec(eta.data(), eta.size());
   cm.updateWithEtaLL(etavec, ell);
   cm.updateWithEtaGH();
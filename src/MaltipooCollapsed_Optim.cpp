@@ -39,10 +39,35 @@ using Eigen::VectorXd;
 //' @param verbose_rate (ADAM) rate to print verbose stats to screen
 //' @param decomp_method decomposition of hessian for Laplace approximation
 //'   'eigen' (more stable-slightly, slower) or 'cholesky' (less stable, faster, default)
+//'   or 'krylov' (never forms the hessian; samples are drawn using lanczos 
+//'   approximations to products with the inverse square root of the hessian 
+//'   and logInvNegHessDet is a stochastic lanczos quadrature estimate) 
+//'   or 'partial' (block diagonal approximation: only the N (D-1)x(D-1) 
+//'   diagonal blocks of the hessian, one per sample, are formed and 
+//'   factored (cholesky, in parallel), O(N*D^3) time and O(N*D^2) memory, 
+//'   ignores posterior correlation between samples) 
+//'   or 'lowrank' (the 'partial' blocks corrected by the k=20 eigenpairs of 
+//'   the hessian whitened by those blocks furthest from 1, found by lanczos 
+//'   over hessian-vector products; never forms the hessian, O((k+D)*N*D) per 
+//'   sample and for logInvNegHessDet, exact if k >= N*(D-1))
 //' @param eigvalthresh threshold for negative eigenvalues in 
 //'   decomposition of negative inverse hessian (should be <=0)
 //' @param jitter (default: 0) if >0 then adds that factor to diagonal of Hessian 
 //' before decomposition (to improve matrix conditioning)
+//' @param useChol (default: false) if true S and A^{-1} are factored in 
+//'   symmetric positive definite form with Cholesky decompositions rather 
+//'   than LU (see \code{\link{optimPibbleCollapsed}})
+//' @param optim_method (default: "adam") joint ADAM over eta and ell or 
+//'   "block_coordinate" which alternates \code{block_iter} ADAM 
+//'   steps on eta with A held fixed (set once per block, so no O(N^3) work 
+//'   per step) and damped newton updates of each ell_i computed in the 
+//'   eigenbasis of X'U_iX at O(N^2(D-1)) per newton step. For P=1 that 
+//'   eigenbasis is computed once and A is kept in Woodbury form, so an 
+//'   update of ell is O(N^2(D-1)) overall; for P>1 each update of ell_i 
+//'   also decomposes X'U_iX and A, O(N^3). 
+//'   \code{max_iter} counts ADAM steps on eta. 
+//' @param block_iter (default: 100) number of ADAM steps on eta between 
+//'   updates of ell (only used if optim_method="block_coordinate")
 //'   
 //' @details Notation: Let Z_j denote the J-th row of a matrix Z.
 //' Model:
@@ -110,10 +135,13 @@ List optimMaltipooCollapsed(const Eigen::ArrayXXd Y,
                int verbose_rate=10,
                String decomp_method="cholesky",
                double eigvalthresh=0, 
-               double jitter=0){  
+               double jitter=0, 
+               bool useChol=false, 
+               String optim_method="adam", 
+               int block_iter=100){  
   int N = Y.cols();
   int D = Y.rows();
-  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U);
+  MaltipooCollapsed cm(Y, upsilon, Theta, X, KInv, U, false, useChol);
   Map<VectorXd> eta(init.data(), init.size()); // will rewrite by optim
   VectorXd pars(init.size()+ellinit.size());
   pars.head(init.size()) = eta;
@@ -126,8 +154,30 @@ List optimMaltipooCollapsed(const Eigen::ArrayXXd Y,
   // Pick optimizer (ADAM - without perturbation appears to be best)
   //   ADAM with perturbations not fully implemented
   // int status = Numer::optim_lbfgs(cm, eta, nllopt);
-  int status = adam::optim_adam(cm, pars, nllopt, b1, b2, step_size, epsilon,
-                                eps_f, eps_g, max_iter, verbose, verbose_rate);
+  int status;
+  if (optim_method=="adam"){
+    status = adam::optim_adam(cm, pars, nllopt, b1, b2, step_size, epsilon,
+                              eps_f, eps_g, max_iter, verbose, verbose_rate);
+  } else if (optim_method=="block_coordinate"){
+    int P = ellinit.size();
+    int Q = X.rows();
+    MatrixXd XTUX(P*N, N);
+    for (int i=0; i<P; i++){
+      XTUX.middleRows(N*i, N).noalias() = X.transpose()*U.middleRows(Q*i, Q)*X;
+    }
+    VectorXd ellopt = ellinit;
+    Numer::Refvec etapars(pars.head(init.size()));
+    status = maltipoo::optim_block_coordinate(Y, upsilon, Theta*X, KInv, XTUX, 
+                                              etapars, ellopt, nllopt, 
+                                              block_iter, b1, b2, step_size, 
+                                              epsilon, eps_f, eps_g, max_iter, 
+                                              verbose, verbose_rate, useChol);
+    pars.tail(ellinit.size()) = ellopt;
+    VectorXd g(pars.size());
+    nllopt = cm.f_grad(pars, g); // leaves cm evaluated at the optima
+  } else {
+    Rcpp::stop("unrecognized optimization method");
+  }
   // //int status = adamperturb::optim_adam(cm, eta, nllopt); 
   
   if (status<0)
@@ -140,18 +190,34 @@ List optimMaltipooCollapsed(const Eigen::ArrayXXd Y,
   out[5] = ell.array().exp().matrix();
   
   if (n_samples > 0 || calcGradHess){
-    if (verbose) Rcout << "Allocating for Hessian" << std::endl;
-    MatrixXd hess(N*(D-1), N*(D-1));
+    MatrixXd hess; // don't preallocate this thing could be unneeded
     VectorXd grad(N*(D-1));
     if (verbose) Rcout << "Calculating Hessian" << std::endl;
     grad = cm.calcGrad(ell); // should have eta at optima already
-    hess = -cm.calcHess(ell); // should have eta at optima already
-    out[1] = grad;
-    if ((N * (D-1)) > 44750){
+    // factored form, only made dense if returned or decomposed
+    mongrel::StructuredHessian shess = cm.calcStructuredHess();
+    bool returnHess = calcGradHess;
+    if (calcGradHess && ((N * (D-1)) > 44750)){
       Rcpp::warning("Hessian is to large to return to R");
-    } else {
-      if (calcGradHess)
-        out[2] = hess;    
+      returnHess = false;
+    }
+    bool krylov = (decomp_method=="krylov");
+    bool partial = (decomp_method=="partial");
+    bool lowrank = (decomp_method=="lowrank");
+    bool dense = (n_samples>0) && !krylov && !partial && !lowrank;
+    if (returnHess || dense){
+      // lower triangle of the negative hessian, factored in place
+      hess.resize(N*(D-1), N*(D-1));
+      shess.toDenseNegLower(hess); // should have eta at optima already
+    }
+    out[1] = grad;
+    if (returnHess){
+      NumericVector nvHess(Rcpp::no_init(hess.size()));
+      nvHess.attr("dim") = IntegerVector::create(hess.rows(), hess.cols());
+      Map<MatrixXd> H(nvHess.begin(), hess.rows(), hess.cols());
+      H = hess.selfadjointView<Eigen::Lower>();
+      out[2] = nvHess;
+      if (!dense) hess.resize(0, 0);
     }
     
     if (n_samples>0){
@@ -159,10 +225,28 @@ List optimMaltipooCollapsed(const Eigen::ArrayXXd Y,
       int status;
       MatrixXd samp = MatrixXd::Zero(N*(D-1), n_samples);
       double logInvNegHessDet;
-      status = lapap::LaplaceApproximation(samp, eta, hess, 
-                                           decomp_method, eigvalthresh, 
-                                           jitter, 
-                                           logInvNegHessDet);
+      if (krylov){
+        status = lapap::LaplaceApproximationKrylov(samp, eta, shess, 
+                                                   eigvalthresh, jitter, 
+                                                   logInvNegHessDet);
+      } else if (partial){
+        MatrixXd hessblocks = -shess.diagonalBlocks();
+        status = lapap::LaplaceApproximation(samp, eta, hessblocks, 
+                                             "cholesky", eigvalthresh, 
+                                             jitter, 
+                                             logInvNegHessDet);
+      } else if (lowrank){
+        MatrixXd hessblocks = -shess.diagonalBlocks();
+        status = lapap::LaplaceApproximationLowRank(samp, eta, shess, 
+                                                    hessblocks, eigvalthresh, 
+                                                    jitter, 
+                                                    logInvNegHessDet);
+      } else {
+        status = lapap::LaplaceApproximation(samp, eta, hess, 
+                                             decomp_method, eigvalthresh, 
+                                             jitter, 
+                                             logInvNegHessDet);
+      }
       if (status != 0){
         Rcpp::warning("Decomposition of Hessian Failed, returning MAP Estimate only");
         return out;
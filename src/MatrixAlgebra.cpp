@@ -100,3 +100,21 @@ void tveclmult_minus(const int m, const int n, Ref<MatrixXd> A,
   #endif 
 }
 
+// computes V (QxN) such that (I_N + X'*Gamma*X)^{-1} = I_N - V'V (Woodbury)
+//   with Gamma = GG', V = L^{-1}G'X where LL' = I_Q + G'XX'G 
+//   (Gamma need only be positive semi-definite)
+MatrixXd woodbury_ainv_factor(const Ref<const MatrixXd>& X, 
+                              const Ref<const MatrixXd>& Gamma){
+  int Q = X.rows();
+  Eigen::LDLT<MatrixXd> Gldlt(Gamma);
+  if ((Gldlt.info() != Eigen::Success) || (Gldlt.vectorD().minCoeff() < 0))
+    Rcpp::stop("Gamma must be positive semi-definite");
+  MatrixXd V = Gldlt.transpositionsP()*X;
+  V = Gldlt.matrixU()*V; // G' = D^{1/2}L'P
+  V = Gldlt.vectorD().cwiseSqrt().asDiagonal()*V;
+  MatrixXd M = MatrixXd::Identity(Q, Q);
+  M.selfadjointView<Eigen::Lower>().rankUpdate(V);
+  Eigen::LLT<MatrixXd> Mllt(M);
+  Mllt.matrixL().solveInPlace(V);
+  return V;
+}
@@ -0,0 +1,257 @@
+#include <fido.h>
+
+#ifdef FIDO_USE_PARALLEL
+#include <omp.h>
+#endif
+
+// [[Rcpp::depends(RcppNumerical)]]
+// [[Rcpp::depends(RcppEigen)]]
+
+using namespace Rcpp;
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::ArrayXXd;
+using Eigen::VectorXd;
+
+//' Optimize the Collapsed Pibble Model for many datasets at once
+//'
+//' Fits many independent collapsed pibble models that share the same prior
+//' (\code{upsilon}, \code{KInv}) concurrently, one dataset per thread.
+//' Useful when fitting many small count tables (e.g., one per subject or
+//' study site) where the overhead of calling \code{\link{optimPibbleCollapsed}}
+//' from R for each dataset dominates. See \code{\link{optimPibbleCollapsed}}
+//' for model details.
+//'
+//' @param Y list of D x N_i matrices of counts
+//' @param upsilon (must be > D) shared by all datasets
+//' @param ThetaX list of D-1 x N_i matrices formed by Theta*X_i (if of
+//'   length 1 it is shared by all datasets)
+//' @param KInv D-1 x D-1 precision matrix (inverse of Xi) shared by all datasets
+//' @param AInv list of N_i x N_i precision matrices given by
+//'   (I_N + X_i'*Gamma*X_i)^{-1} (if of length 1 it is shared by all datasets)
+//' @param init list of D-1 x N_i matrices of initial guess for eta
+//' @param n_samples number of samples for Laplace Approximation (=0 very fast
+//'    as no inversion or decomposition of Hessian is required)
+//' @param b1 (ADAM) 1st moment decay parameter (recommend 0.9) "aka momentum"
+//' @param b2 (ADAM) 2nd moment decay parameter (recommend 0.99 or 0.999)
+//' @param step_size (ADAM) step size for descent (recommend 0.001-0.003)
+//' @param epsilon (ADAM) parameter to avoid divide by zero
+//' @param eps_f (ADAM) normalized function improvement stopping criteria
+//' @param eps_g (ADAM) normalized gradient magnitude stopping criteria
+//' @param max_iter (ADAM) maximum number of iterations before stopping
+//' @param decomp_method decomposition of hessian for Laplace approximation
+//'   'eigen', 'cholesky' (default), 'krylov', 'partial' or 'lowrank'
+//'   (see \code{\link{optimPibbleCollapsed}})
+//' @param optim_method (default:"adam") or "lbfgs" or "newton_cg" or
+//'   "plbfgs"
+//' @param eigvalthresh threshold for negative eigenvalues in
+//'   decomposition of negative inverse hessian (should be <=0)
+//' @param jitter (default: 0) if >=0 then adds that factor to diagonal of Hessian
+//' before decomposition (to improve matrix conditioning)
+//' @param useSylv (default: true) if N<D-1 uses Sylvester Determinant Identity
+//'   to speed up calculation of log-likelihood and gradients.
+//' @param ncores (default:-1) number of cores to use, if ncores==-1 then
+//' uses default from OpenMP typically to use all available cores.
+//' @param seed (random seed for Laplace approximation -- integer), dataset
+//'   i (1-based) uses its own (counter based, philox) random number streams 
+//'   keyed by seed and i so results do not depend on the number of cores or 
+//'   scheduling (if -1 a seed is drawn from R's random number generator, see 
+//'   \code{set.seed})
+//'
+//' @details Each dataset is fit by its own model object within a single
+//' thread (parallelism is across datasets rather than within them).
+//' Warnings (e.g., max iterations hit or failed decomposition) are
+//' collected and reported after all datasets have been fit.
+//' @return List with one element per dataset, each a list containing
+//' 1. LogLik - Log Likelihood of collapsed model (up to proportionality constant)
+//' 2. Pars - Parameter value of eta at optima
+//' 3. Samples - (D-1) x N_i x n_samples array containing posterior samples of eta
+//'   based on Laplace approximation (if n_samples>0 and decomposition succeeded)
+//' 4. logInvNegHessDet - the log determinant of the covariacne of the Laplace
+//'    approximation, useful for calculating marginal likelihood
+//' @md
+//' @export
+//' @name optimPibbleCollapsedBatch
+//' @seealso \code{\link{optimPibbleCollapsed}}
+//' @examples
+//' sim <- pibble_sim()
+//' Y <- list(sim$Y, sim$Y[,sample(1:sim$N)])
+//' init <- lapply(Y, random_pibble_init)
+//' fit <- optimPibbleCollapsedBatch(Y, sim$upsilon, list(sim$Theta%*%sim$X),
+//'                                  sim$KInv, list(sim$AInv), init)
+// [[Rcpp::export]]
+List optimPibbleCollapsedBatch(List Y,
+                               const double upsilon,
+                               List ThetaX,
+                               const Eigen::MatrixXd KInv,
+                               List AInv,
+                               List init,
+                               int n_samples=2000,
+                               double b1 = 0.9,
+                               double b2 = 0.99,
+                               double step_size = 0.003,
+                               double epsilon = 10e-7,
+                               double eps_f=1e-10,
+                               double eps_g=1e-4,
+                               int max_iter=10000,
+                               std::string decomp_method="cholesky",
+                               std::string optim_method="adam",
+                               double eigvalthresh=0,
+                               double jitter=0,
+                               bool useSylv = true,
+                               int ncores=-1,
+                               long seed=-1){
+  int B = Y.size();
+  if (init.size() != B)
+    Rcpp::stop("Y and init must be lists of the same length");
+  if ((ThetaX.size() != 1) && (ThetaX.size() != B))
+    Rcpp::stop("ThetaX must be a list of length 1 or the same length as Y");
+  if ((AInv.size() != 1) && (AInv.size() != B))
+    Rcpp::stop("AInv must be a list of length 1 or the same length as Y");
+  if ((optim_method != "adam") && (optim_method != "lbfgs") &&
+      (optim_method != "newton_cg") && (optim_method != "plbfgs"))
+    Rcpp::stop("unrecognized optimization method");
+  if (seed == -1) seed = philox::seed_from_R(); // before the parallel loop
+
+  // Copy out of R objects on the main thread, nothing below may touch R
+  std::vector<ArrayXXd> Ys(B);
+  std::vector<MatrixXd> inits(B);
+  std::vector<MatrixXd> ThetaXs(ThetaX.size());
+  std::vector<MatrixXd> AInvs(AInv.size());
+  for (int b=0; b<B; b++){
+    Ys[b] = as<ArrayXXd>(Y[b]);
+    inits[b] = as<MatrixXd>(init[b]);
+  }
+  for (int b=0; b<ThetaX.size(); b++) ThetaXs[b] = as<MatrixXd>(ThetaX[b]);
+  for (int b=0; b<AInv.size(); b++) AInvs[b] = as<MatrixXd>(AInv[b]);
+  for (int b=0; b<B; b++){
+    const MatrixXd& TX = ThetaXs[(ThetaXs.size()==1) ? 0 : b];
+    const MatrixXd& AI = AInvs[(AInvs.size()==1) ? 0 : b];
+    int D = Ys[b].rows();
+    int N = Ys[b].cols();
+    if ((KInv.rows() != D-1) || (TX.rows() != D-1) || (TX.cols() != N) ||
+        (AI.rows() != N) || (AI.cols() != N) ||
+        (inits[b].rows() != D-1) || (inits[b].cols() != N))
+      Rcpp::stop("Dimension mismatch in dataset " + std::to_string(b+1));
+  }
+
+  // per dataset results
+  std::vector<double> loglik(B);
+  std::vector<double> logdet(B);
+  std::vector<MatrixXd> samples(B);
+  std::vector<int> optstatus(B, 0);
+  std::vector<int> lapstatus(B, 0);
+  std::vector<std::string> errors(B);
+
+  #ifdef FIDO_USE_PARALLEL
+    Eigen::initParallel();
+    if (ncores > 0) {
+      omp_set_num_threads(ncores);
+    } else {
+      omp_set_num_threads(omp_get_max_threads());
+    }
+    Eigen::setNbThreads(1);
+  #endif
+  #pragma omp parallel for schedule(dynamic)
+  for (int b=0; b<B; b++){
+    try {
+      const MatrixXd& TX = ThetaXs[(ThetaXs.size()==1) ? 0 : b];
+      const MatrixXd& AI = AInvs[(AInvs.size()==1) ? 0 : b];
+      int D = Ys[b].rows();
+      int N = Ys[b].cols();
+      PibbleCollapsed cm(Ys[b], upsilon, TX, KInv, AI, useSylv);
+      Map<VectorXd> eta(inits[b].data(), inits[b].size()); // rewritten by optim
+      double nllopt;
+      if (optim_method=="lbfgs"){
+        optstatus[b] = Numer::optim_lbfgs(cm, eta, nllopt, max_iter, eps_f, eps_g);
+      } else if (optim_method=="newton_cg"){
+        optstatus[b] = newtoncg::optim_newton_cg(cm, eta, nllopt, eps_f, eps_g,
+                                                 max_iter, false, 10, 0, false);
+      } else if (optim_method=="plbfgs"){
+        optstatus[b] = plbfgs::optim_plbfgs(cm, eta, nllopt, eps_f, eps_g,
+                                            max_iter, false, 10, 10, 6, false);
+      } else {
+        adam::ADAMFun fun(cm);
+        Numer::Refvec etaref(eta);
+        adam::ADAMOptim optim(fun, etaref, b1, b2, step_size, epsilon,
+                              eps_f, eps_g, max_iter, false, 10, false);
+        int status = 0;
+        while (status == 0){
+          status = optim.step();
+        }
+        optstatus[b] = status;
+        nllopt = optim.getVal();
+        eta = optim.getTheta();
+      }
+      loglik[b] = -nllopt;
+
+      if (n_samples > 0){
+        cm.calcGrad(); // updates model at optima
+        mongrel::StructuredHessian shess = cm.calcStructuredHess();
+        // dataset b takes philox streams b*2^32, b*2^32+1, ... of seed
+        lapap::lappars pars = lapap::init_lappars(eigvalthresh, seed, 
+                                                  (uint64_t)b << 32);
+        pars.quiet = true;
+        samples[b] = MatrixXd::Zero(N*(D-1), n_samples);
+        if (decomp_method=="krylov"){
+          lapstatus[b] = lapap::LaplaceApproximationKrylov(samples[b], eta, shess,
+                                                           jitter, pars);
+        } else if (decomp_method=="partial"){
+          MatrixXd hessblocks = -shess.diagonalBlocks();
+          lapstatus[b] = lapap::LaplaceApproximation(samples[b], eta, hessblocks,
+                                                     "cholesky", jitter, pars);
+        } else if (decomp_method=="lowrank"){
+          MatrixXd hessblocks = -shess.diagonalBlocks();
+          lapstatus[b] = lapap::LaplaceApproximationLowRank(samples[b], eta, shess,
+                                                            hessblocks, jitter, pars);
+        } else {
+          MatrixXd hess(N*(D-1), N*(D-1)); // lower triangle, factored in place
+          shess.toDenseNegLower(hess);
+          lapstatus[b] = lapap::LaplaceApproximation(samples[b], eta, hess,
+                                                     decomp_method, jitter, pars);
+        }
+        logdet[b] = pars.logInvNegHessDet;
+      }
+    } catch (std::exception& e){
+      errors[b] = e.what();
+    }
+  }
+  #ifdef FIDO_USE_PARALLEL
+  if (ncores > 0){
+    Eigen::setNbThreads(ncores);
+  } else {
+    Eigen::setNbThreads(omp_get_max_threads());
+  }
+  #endif
+
+  // Collect results (and report warnings) back on the main thread
+  List out(B);
+  for (int b=0; b<B; b++){
+    if (!errors[b].empty())
+      Rcpp::stop("Dataset " + std::to_string(b+1) + ": " + errors[b]);
+    int D = Ys[b].rows();
+    int N = Ys[b].cols();
+    List res(4);
+    res.names() = CharacterVector::create("LogLik", "Pars", "Samples",
+              "logInvNegHessDet");
+    if (optstatus[b] < 0)
+      Rcpp::warning("Dataset " + std::to_string(b+1) +
+                    ": Max Iterations Hit, May not be at optima");
+    res[0] = loglik[b];
+    res[1] = inits[b];
+    if (n_samples > 0){
+      if (lapstatus[b] != 0){
+        Rcpp::warning("Dataset " + std::to_string(b+1) +
+                      ": Decomposition of Hessian Failed, returning MAP Estimate only");
+      } else {
+        IntegerVector d = IntegerVector::create(D-1, N, n_samples);
+        NumericVector s = wrap(samples[b]);
+        s.attr("dim") = d; // convert to 3d array for return to R
+        res[2] = s;
+        res[3] = logdet[b];
+      }
+    }
+    out[b] = res;
+  }
+  return out;
+}
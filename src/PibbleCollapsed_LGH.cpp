@@ -27,11 +27,16 @@ using Eigen::VectorXd;
 //' @param eta matrix (D-1)xN of parameter values at which to calculate quantities
 //' @param sylv (default:false) if true and if N < D-1 will use sylvester determinant
 //'   identity to speed computation
+//' @param chol (default:false) if true factors S in its symmetric positive 
+//'   definite form with a Cholesky decomposition rather than LU 
+//'   (see \code{useChol} in \code{\link{optimPibbleCollapsed}})
 //' @return see below
 //'   \itemize{
 //'     \item loglikPibbleCollapsed - double
 //'     \item gradPibbleCollapsed - vector
 //'     \item hessPibbleCollapsed- matrix
+//'     \item hessVectorProdPibbleCollapsed - vector (exact product of hessian 
+//'       with \code{v}, computed without forming the hessian)
 //'   }
 //' @md
 //' @export
@@ -66,6 +71,8 @@ using Eigen::VectorXd;
 //' loglikPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, Eta)
 //' gradPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, Eta)[1:5]
 //' hessPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, Eta)[1:5,1:5]
+//' hessVectorProdPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, Eta, 
+//'                               rep(1, N*(D-1)))[1:5]
 // [[Rcpp::export]]
 double loglikPibbleCollapsed(const Eigen::ArrayXXd Y,
                   const double upsilon,
@@ -73,9 +80,10 @@ double loglikPibbleCollapsed(const Eigen::ArrayXXd Y,
                   const Eigen::MatrixXd KInv,
                   const Eigen::MatrixXd AInv,
                   Eigen::MatrixXd eta,
-                  bool sylv=false){
+                  bool sylv=false,
+                  bool chol=false){
   // note inverting naming structure here to accord with manuscript
-  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv); 
+  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv, chol); 
   Map<VectorXd> etavec(eta.data(), eta.size());
   cm.updateWithEtaLL(etavec);
   return cm.calcLogLik(etavec);
@@ -91,9 +99,10 @@ Eigen::VectorXd gradPibbleCollapsed(const Eigen::ArrayXXd Y,
                          const Eigen::MatrixXd KInv,
                          const Eigen::MatrixXd AInv,
                          Eigen::MatrixXd eta,
-                         bool sylv=false){
+                         bool sylv=false,
+                         bool chol=false){
   // note inverting naming structure here to accord with manuscript
-  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv);
+  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv, chol);
   Map<VectorXd> etavec(eta.data(), eta.size());
   cm.updateWithEtaLL(etavec);
   cm.updateWithEtaGH();
@@ -109,33 +118,34 @@ Eigen::MatrixXd hessPibbleCollapsed(const Eigen::ArrayXXd Y,
                          const Eigen::MatrixXd KInv,
                          const Eigen::MatrixXd AInv,
                          Eigen::MatrixXd eta,
-                         bool sylv=false){
+                         bool sylv=false,
+                         bool chol=false){
   // note inverting naming structure here to accord with manuscript
-  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv);
+  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv, chol);
   Map<VectorXd> etavec(eta.data(), eta.size());
   cm.updateWithEtaLL(etavec);
   cm.updateWithEtaGH();
   return cm.calcHess();
 }
 
-// //' Hessian Vector Product using Finite Differences
-// //' @rdname hessVectorProd
-// //' @export
-// // [[Rcpp::export]]
-// Eigen::VectorXd hessVectorProd(const Eigen::ArrayXXd Y,
-//                          const double upsilon,
-//                          const Eigen::MatrixXd ThetaX,
-//                          const Eigen::MatrixXd KInv,
-//                          const Eigen::MatrixXd AInv,
-//                          Eigen::MatrixXd eta,
-//                          Eigen::VectorXd v,
-//                          double r,
-//                          bool sylv=false){
-//   // note inverting naming structure here to accord with manuscript
-//   PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv);
-//   Map<VectorXd> etavec(eta.data(), eta.size());
-//   return cm.calcHessVectorProd(etavec, v, r);
-// }
+//' @param v vector of length N*(D-1) to multiply the hessian by
+//' @rdname loglikPibbleCollapsed
+//' @export
+// [[Rcpp::export]]
+Eigen::VectorXd hessVectorProdPibbleCollapsed(const Eigen::ArrayXXd Y,
+                         const double upsilon,
+                         const Eigen::MatrixXd ThetaX,
+                         const Eigen::MatrixXd KInv,
+                         const Eigen::MatrixXd AInv,
+                         Eigen::MatrixXd eta,
+                         Eigen::VectorXd v,
+                         bool sylv=false,
+                         bool chol=false){
+  // note inverting naming structure here to accord with manuscript
+  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, sylv, chol);
+  Map<VectorXd> etavec(eta.data(), eta.size());
+  return cm.calcHessVectorProd(etavec, v);
+}
 
 // //' Backtracking line search
 // //' @rdname lineSearch
@@ -1,5 +1,11 @@
 #include <fido.h>.h>
 #include <Rcpp/Benchmark/Timer.h>
+#include <algorithm>
+#include <memory>
+
+#ifdef FIDO_USE_PARALLEL
+#include <omp.h>
+#endif
 
 // [[Rcpp::depends(RcppNumerical)]]
 // [[Rcpp::depends(RcppEigen)]]
@@ -12,6 +18,666 @@ using Eigen::MatrixXd;
 using Eigen::ArrayXXd;
 using Eigen::VectorXd;
 
+// Optimizer state carried into (warm starts) and out of the optimizers
+struct PibbleOptimState {
+  adam::ADAMState adam;        // "adam" and "adam_minibatch"
+  newtoncg::NewtonCGStats ncg; // "newton_cg" (iteration counts and radius)
+  VectorXd nllstart;           // multiple starts, negative LogLik of each
+  int winner;                  // multiple starts, index of best start
+  optimtrace::OptimTrace* trace; // per iteration trace (null if off)
+  PibbleOptimState() : winner(-1), trace(0) {}
+};
+
+// Finds the MAP estimate of eta (overwriting eta) using model cm, P is D-1 if
+//   known at compile time (see PibbleCollapsedT), returns optimizer status
+template <int P, typename YType>
+int optimPibbleEta(PibbleCollapsedT<double, P>& cm, 
+                   const YType& Y, const double upsilon, 
+                   const Eigen::MatrixXd& ThetaX, const Eigen::MatrixXd& KInv, 
+                   const Eigen::MatrixXd& AInv, 
+                   Map<VectorXd>& eta, double& nllopt, 
+                   double b1, double b2, double step_size, double epsilon, 
+                   double eps_f, double eps_g, int max_iter, 
+                   bool verbose, int verbose_rate, 
+                   String optim_method, bool useSylv, bool useFloat, 
+                   bool useChol, bool lowrankAInv, 
+                   PibbleOptimState& ostate){
+  int status;
+  if (useFloat && (optim_method!="adam")){
+    Rcpp::stop("useFloat is only implemented for optim_method='adam'");
+  }
+  if ((optim_method=="lbfgs") && ostate.trace){
+    optimtrace::TracedFun cmt(cm, *ostate.trace);
+    status = Numer::optim_lbfgs(cmt, eta, nllopt, max_iter, eps_f, eps_g);
+  } else if (optim_method=="lbfgs"){
+    status = Numer::optim_lbfgs(cm, eta, nllopt, max_iter, eps_f, eps_g);
+  } else if (useFloat){
+    PibbleCollapsedT<float, P> cmf(Y, upsilon, ThetaX, KInv, AInv, useSylv, 
+                                   useChol, lowrankAInv);
+    status = adam::optim_adam_mixed(cmf, cm, eta, nllopt, b1, b2, step_size, 
+                                    epsilon, eps_f, eps_g, max_iter, verbose, 
+                                    verbose_rate, &ostate.adam, ostate.trace);
+  } else if (optim_method=="adam"){
+    status = adam::optim_adam(cm, eta, nllopt, b1, b2, step_size, epsilon, 
+                              eps_f, eps_g, max_iter, verbose, verbose_rate, 
+                              &ostate.adam, ostate.trace);  
+  } else if (optim_method=="newton_cg"){
+    status = newtoncg::optim_newton_cg(cm, eta, nllopt, eps_f, eps_g, max_iter, 
+                                       verbose, verbose_rate, &ostate.ncg, 
+                                       true, ostate.trace);
+  } else if (optim_method=="plbfgs"){
+    status = plbfgs::optim_plbfgs(cm, eta, nllopt, eps_f, eps_g, max_iter, 
+                                  verbose, verbose_rate, 10, 6, true, 
+                                  ostate.trace);
+  } else {
+    Rcpp::stop("unrecognized optimization method");
+  }
+  return status;
+}
+
+// optimPibbleEta using a fixed size (stack allocated) model with P = D-1
+template <int P>
+int optimPibbleEtaFixed(const Eigen::ArrayXXd& Y, const double upsilon, 
+                        const Eigen::MatrixXd& ThetaX, 
+                        const Eigen::MatrixXd& KInv, 
+                        const Eigen::MatrixXd& AInv, 
+                        Map<VectorXd>& eta, double& nllopt, 
+                        double b1, double b2, double step_size, 
+                        double epsilon, double eps_f, double eps_g, 
+                        int max_iter, bool verbose, int verbose_rate, 
+                        String optim_method, bool useSylv, bool useFloat, 
+                        bool useChol, bool lowrankAInv, 
+                        PibbleOptimState& ostate){
+  PibbleCollapsedT<double, P> cmf(Y, upsilon, ThetaX, KInv, AInv, false, 
+                                  useChol, lowrankAInv);
+  return optimPibbleEta(cmf, Y, upsilon, ThetaX, KInv, AInv, eta, nllopt, 
+                        b1, b2, step_size, epsilon, eps_f, eps_g, max_iter, 
+                        verbose, verbose_rate, optim_method, useSylv, useFloat, 
+                        useChol, lowrankAInv, ostate);
+}
+
+// optimPibbleEta using a fixed size (stack allocated) model for small D, 
+//   cm (dynamic) otherwise
+int optimPibbleEtaDispatch(PibbleCollapsed& cm, const Eigen::ArrayXXd& Y, 
+                           const double upsilon, 
+                           const Eigen::MatrixXd& ThetaX, 
+                           const Eigen::MatrixXd& KInv, 
+                           const Eigen::MatrixXd& AInv, 
+                           Map<VectorXd>& eta, double& nllopt, 
+                           double b1, double b2, double step_size, 
+                           double epsilon, double eps_f, double eps_g, 
+                           int max_iter, bool verbose, int verbose_rate, 
+                           String optim_method, bool useSylv, bool useFloat, 
+                           bool useChol, bool lowrankAInv, 
+                           PibbleOptimState& ostate){
+  switch (Y.rows()){
+    case 3: return optimPibbleEtaFixed<2>(Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                          nllopt, b1, b2, step_size, epsilon, 
+                                          eps_f, eps_g, max_iter, verbose, 
+                                          verbose_rate, optim_method, useSylv, 
+                                          useFloat, useChol, lowrankAInv, 
+                                          ostate);
+    case 4: return optimPibbleEtaFixed<3>(Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                          nllopt, b1, b2, step_size, epsilon, 
+                                          eps_f, eps_g, max_iter, verbose, 
+                                          verbose_rate, optim_method, useSylv, 
+                                          useFloat, useChol, lowrankAInv, 
+                                          ostate);
+    case 5: return optimPibbleEtaFixed<4>(Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                          nllopt, b1, b2, step_size, epsilon, 
+                                          eps_f, eps_g, max_iter, verbose, 
+                                          verbose_rate, optim_method, useSylv, 
+                                          useFloat, useChol, lowrankAInv, 
+                                          ostate);
+    case 6: return optimPibbleEtaFixed<5>(Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                          nllopt, b1, b2, step_size, epsilon, 
+                                          eps_f, eps_g, max_iter, verbose, 
+                                          verbose_rate, optim_method, useSylv, 
+                                          useFloat, useChol, lowrankAInv, 
+                                          ostate);
+    case 7: return optimPibbleEtaFixed<6>(Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                          nllopt, b1, b2, step_size, epsilon, 
+                                          eps_f, eps_g, max_iter, verbose, 
+                                          verbose_rate, optim_method, useSylv, 
+                                          useFloat, useChol, lowrankAInv, 
+                                          ostate);
+    case 8: return optimPibbleEtaFixed<7>(Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                          nllopt, b1, b2, step_size, epsilon, 
+                                          eps_f, eps_g, max_iter, verbose, 
+                                          verbose_rate, optim_method, useSylv, 
+                                          useFloat, useChol, lowrankAInv, 
+                                          ostate);
+    default: return optimPibbleEta(cm, Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                   nllopt, b1, b2, step_size, epsilon, eps_f, 
+                                   eps_g, max_iter, verbose, verbose_rate, 
+                                   optim_method, useSylv, useFloat, useChol, 
+                                   lowrankAInv, ostate);
+  }
+}
+
+// Sparse counts are typically wide tables, no fixed size dispatch
+int optimPibbleEtaDispatch(PibbleCollapsed& cm, 
+                           const Eigen::SparseMatrix<double>& Y, 
+                           const double upsilon, 
+                           const Eigen::MatrixXd& ThetaX, 
+                           const Eigen::MatrixXd& KInv, 
+                           const Eigen::MatrixXd& AInv, 
+                           Map<VectorXd>& eta, double& nllopt, 
+                           double b1, double b2, double step_size, 
+                           double epsilon, double eps_f, double eps_g, 
+                           int max_iter, bool verbose, int verbose_rate, 
+                           String optim_method, bool useSylv, bool useFloat, 
+                           bool useChol, bool lowrankAInv, 
+                           PibbleOptimState& ostate){
+  return optimPibbleEta(cm, Y, upsilon, ThetaX, KInv, AInv, eta, nllopt, 
+                        b1, b2, step_size, epsilon, eps_f, eps_g, max_iter, 
+                        verbose, verbose_rate, optim_method, useSylv, useFloat, 
+                        useChol, lowrankAInv, ostate);
+}
+
+// Dense copy of counts (needed by MultDirichletBoot)
+inline Eigen::ArrayXXd denseCounts(const Eigen::ArrayXXd& Y){ return Y; }
+inline Eigen::ArrayXXd denseCounts(const Eigen::SparseMatrix<double>& Y){ 
+  return MatrixXd(Y).array(); 
+}
+
+// Finds the MAP estimate of eta (overwriting eta) with mini-batch ADAM over 
+//   samples (optim_method="adam_minibatch"), returns optimizer status
+template <typename YType>
+int optimPibbleEtaMinibatch(const YType& Y, const double upsilon, 
+                            const Eigen::MatrixXd& ThetaX, 
+                            const Eigen::MatrixXd& KInv, 
+                            const Eigen::MatrixXd& AInv, 
+                            Map<VectorXd>& eta, double& nllopt, 
+                            int batch_size, double b1, double b2, 
+                            double step_size, double epsilon, double eps_f, 
+                            double eps_g, int max_iter, bool verbose, 
+                            int verbose_rate, bool useFloat, bool lowrankAInv, 
+                            long seed, adam::ADAMState& state, 
+                            optimtrace::OptimTrace* trace){
+  if (useFloat)
+    Rcpp::stop("useFloat is only implemented for optim_method='adam'");
+  if (seed == -1) seed = philox::seed_from_R(); // batch order
+  PibbleCollapsedIncremental cmi(denseCounts(Y), upsilon, ThetaX, KInv, AInv, 
+                                 lowrankAInv);
+  return adam::optim_adam_minibatch(cmi, eta, nllopt, batch_size, 
+                                    seed, b1, b2, step_size, 
+                                    epsilon, eps_f, eps_g, max_iter, verbose, 
+                                    verbose_rate, &state, trace);
+}
+
+// Finds the MAP estimate of eta (overwriting eta) from K starts (columns of
+//   inits) optimized concurrently, one model per start (multi-start). Each
+//   round every remaining start takes up to race_iter iterations, then starts
+//   whose negative LogLik is more than race_tol*|best| above the best start
+//   are dropped (racing). "lbfgs" (RcppNumerical) and "plbfgs" can't be 
+//   paused so their starts run to completion in a single round. ostate resumes the first
+//   start and is overwritten with the state of the winner (along with the
+//   last negative LogLik of each start and the index of the winner, and if 
+//   traced the trace of the winner).
+//   Returns optimizer status of the winner.
+template <typename YType>
+int optimPibbleEtaMultistart(const YType& Y, const double upsilon,
+                             const Eigen::MatrixXd& ThetaX,
+                             const Eigen::MatrixXd& KInv,
+                             const Eigen::MatrixXd& AInv,
+                             Eigen::MatrixXd& inits, Map<VectorXd>& eta,
+                             double& nllopt, double b1, double b2,
+                             double step_size, double epsilon, double eps_f,
+                             double eps_g, int max_iter, bool verbose,
+                             String optim_method, bool useSylv, bool useFloat,
+                             bool useChol, bool lowrankAInv, double race_tol,
+                             int ncores, PibbleOptimState& ostate){
+  if (useFloat)
+    Rcpp::stop("useFloat is not implemented for multiple starts");
+  if ((optim_method != "adam") && (optim_method != "lbfgs") &&
+      (optim_method != "newton_cg") && (optim_method != "plbfgs"))
+    Rcpp::stop("multiple starts are only implemented for optim_method 'adam', 'lbfgs', 'newton_cg' and 'plbfgs'");
+  int K = inits.cols();
+  bool isadam = (optim_method=="adam");
+  bool isncg = (optim_method=="newton_cg");
+  bool isplbfgs = (optim_method=="plbfgs");
+  int race_iter = isadam ? 100 : (isncg ? 5 : max_iter);
+
+  // per start models and state, nothing below may touch R until joined
+  std::vector<std::unique_ptr<PibbleCollapsed> > models(K);
+  for (int k=0; k<K; k++){
+    models[k].reset(new PibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv,
+                                        useSylv, useChol, lowrankAInv));
+  }
+  std::vector<adam::ADAMState> astate(K);
+  std::vector<newtoncg::NewtonCGStats> nstate(K);
+  std::vector<int> tmax(K, max_iter); // per start iteration limit
+  astate[0] = ostate.adam;
+  nstate[0] = ostate.ncg;
+  if (isadam && (astate[0].t > 0)) tmax[0] = max_iter + astate[0].t - 1;
+  std::vector<int> iter(K, 0);
+  std::vector<int> status(K, 0);
+  std::vector<bool> alive(K, true);
+  std::vector<std::string> errors(K);
+  std::vector<optimtrace::OptimTrace> traces;
+  if (ostate.trace) traces.assign(K, *ostate.trace);
+  VectorXd& nllstart = ostate.nllstart;
+  int& winner = ostate.winner;
+  nllstart = VectorXd::Constant(K, R_PosInf);
+
+  #ifdef FIDO_USE_PARALLEL
+    if (ncores > 0) {
+      omp_set_num_threads(ncores);
+    } else {
+      omp_set_num_threads(omp_get_max_threads());
+    }
+    Eigen::setNbThreads(1);
+  #endif
+  int round = 0;
+  bool running = true;
+  while (running){
+    R_CheckUserInterrupt();
+    #pragma omp parallel for schedule(dynamic)
+    for (int k=0; k<K; k++){
+      if (!alive[k] || (status[k] != 0)) continue;
+      try {
+        PibbleCollapsed& cm = *models[k];
+        Numer::Refvec etak(inits.col(k));
+        optimtrace::OptimTrace* tracek = ostate.trace ? &traces[k] : 0;
+        if (isadam){
+          adam::ADAMFun fun(cm);
+          adam::ADAMOptim optim(fun, etak, b1, b2, step_size, epsilon, eps_f,
+                                eps_g, tmax[k], false, 10, false);
+          if (astate[k].t > 0) optim.setState(astate[k]);
+          optim.setTrace(tracek);
+          for (int i=0; (i<race_iter) && (status[k]==0); i++){
+            status[k] = optim.step();
+          }
+          astate[k] = optim.getState();
+          etak = optim.getTheta();
+          // getVal is at the iterate before the last step, race on etak
+          cm.updateWithEtaLL(etak);
+          nllstart(k) = -cm.calcLogLik(etak);
+          iter[k] = astate[k].t;
+        } else if (isncg){
+          int rmax = std::min(race_iter, max_iter - iter[k]);
+          newtoncg::NewtonCGStats s = nstate[k];
+          status[k] = newtoncg::optim_newton_cg(cm, etak, nllstart(k), eps_f,
+                                                eps_g, rmax, false, 1, &s,
+                                                false, tracek);
+          s.iter += nstate[k].iter;
+          s.cg_iter += nstate[k].cg_iter;
+          s.nfeval += nstate[k].nfeval;
+          nstate[k] = s;
+          iter[k] = s.iter;
+          // not at the overall limit, keep racing
+          if ((status[k] == -1) && (iter[k] < max_iter)) status[k] = 0;
+        } else if (isplbfgs){
+          status[k] = plbfgs::optim_plbfgs(cm, etak, nllstart(k), eps_f, eps_g,
+                                           max_iter, false, 1, 10, 6, false,
+                                           tracek);
+          if (status[k] == 0) status[k] = 2; // one round only
+        } else if (tracek){
+          optimtrace::TracedFun cmt(cm, *tracek);
+          status[k] = Numer::optim_lbfgs(cmt, etak, nllstart(k), max_iter,
+                                         eps_f, eps_g);
+          if (status[k] == 0) status[k] = 2; // one round only
+        } else {
+          status[k] = Numer::optim_lbfgs(cm, etak, nllstart(k), max_iter,
+                                         eps_f, eps_g);
+          if (status[k] == 0) status[k] = 2; // one round only
+        }
+      } catch (std::exception& e){
+        errors[k] = e.what();
+        status[k] = -2;
+      }
+    }
+    for (int k=0; k<K; k++){
+      if (!errors[k].empty()){
+        #ifdef FIDO_USE_PARALLEL
+          Eigen::setNbThreads((ncores > 0) ? ncores : omp_get_max_threads());
+        #endif
+        Rcpp::stop("Start " + std::to_string(k+1) + ": " + errors[k]);
+      }
+    }
+
+    // race: keep starts within race_tol of the best
+    winner = -1;
+    for (int k=0; k<K; k++){
+      if (alive[k] && ((winner < 0) || (nllstart(k) < nllstart(winner))))
+        winner = k;
+    }
+    double cutoff = nllstart(winner) + race_tol*std::abs(nllstart(winner));
+    running = false;
+    for (int k=0; k<K; k++){
+      if (!alive[k]) continue;
+      if (nllstart(k) > cutoff) alive[k] = false;
+      if (alive[k] && (status[k] == 0)) running = true;
+    }
+    round++;
+    if (verbose){
+      Rcout << "multi-start round " << round << ", best start " << winner+1
+            << ", -Log Like: " << nllstart(winner) << ", starts remaining: "
+            << std::count(alive.begin(), alive.end(), true) << std::endl;
+    }
+  }
+  #ifdef FIDO_USE_PARALLEL
+    Eigen::setNbThreads((ncores > 0) ? ncores : omp_get_max_threads());
+  #endif
+
+  eta = inits.col(winner);
+  nllopt = nllstart(winner);
+  ostate.adam = astate[winner];
+  ostate.ncg = nstate[winner];
+  if (ostate.trace) *ostate.trace = traces[winner];
+  return status[winner];
+}
+
+// Iteration counts of newton_cg are attached to the Timer as attributes
+//   (OptimIterations and CGIterations) as are the LogLik of each start and 
+//   the index of the best start with multiple starts (StartLogLik and 
+//   StartWinner)
+inline void addOptimStats(NumericVector& t, const String& optim_method, 
+                          const PibbleOptimState& ostate){
+  if (ostate.winner >= 0){
+    VectorXd ll = -ostate.nllstart;
+    t.attr("StartLogLik") = ll;
+    t.attr("StartWinner") = ostate.winner + 1;
+  }
+  if (optim_method!="newton_cg") return;
+  t.attr("OptimIterations") = ostate.ncg.iter;
+  t.attr("CGIterations") = ostate.ncg.cg_iter;
+}
+
+// Optimizer state given as optim_state (see optimPibbleCollapsed), state of 
+//   another optim_method or of a different number of parameters is ignored 
+//   (with a warning)
+inline PibbleOptimState readOptimState(SEXP optim_state, 
+                                       const String& optim_method, 
+                                       int D, int N){
+  PibbleOptimState ostate;
+  if (Rf_isNull(optim_state)) return ostate;
+  List sl(optim_state);
+  if (!sl.containsElementNamed("method") || 
+      (as<std::string>(sl["method"]) != std::string(optim_method))){
+    Rcpp::warning("optim_state is from a different optim_method, ignoring it");
+    return ostate;
+  }
+  if ((optim_method=="adam") || (optim_method=="adam_minibatch")){
+    VectorXd mt = as<VectorXd>(sl["mt"]);
+    VectorXd vt = as<VectorXd>(sl["vt"]);
+    Eigen::VectorXi t = as<Eigen::VectorXi>(sl["t"]);
+    bool minibatch = (optim_method=="adam_minibatch");
+    if ((mt.size() != N*(D-1)) || (vt.size() != N*(D-1)) || 
+        (t.size() != (minibatch ? N : 1))){
+      Rcpp::warning("optim_state does not match dimensions of eta, ignoring it");
+      return ostate;
+    }
+    ostate.adam.mt = mt;
+    ostate.adam.vt = vt;
+    if (minibatch){
+      ostate.adam.tblock = t;
+      ostate.adam.t = std::max(t.maxCoeff(), 1);
+    } else {
+      ostate.adam.t = t(0);
+    }
+  } else if (optim_method=="newton_cg"){
+    ostate.ncg.delta = as<double>(sl["delta"]);
+  }
+  return ostate;
+}
+
+// Optimizer state returned as OptimState (lbfgs, from RcppNumerical, does 
+//   not expose its curvature pairs so only the method is recorded)
+inline List wrapOptimState(const PibbleOptimState& ostate, 
+                           const String& optim_method){
+  if ((optim_method=="adam") || (optim_method=="adam_minibatch")){
+    bool minibatch = (optim_method=="adam_minibatch");
+    Eigen::VectorXi t(1);
+    t(0) = ostate.adam.t;
+    return List::create(Named("method") = optim_method, 
+                        Named("mt") = ostate.adam.mt, 
+                        Named("vt") = ostate.adam.vt, 
+                        Named("t") = minibatch ? ostate.adam.tblock : t);
+  } else if (optim_method=="newton_cg"){
+    return List::create(Named("method") = optim_method, 
+                        Named("delta") = ostate.ncg.delta);
+  }
+  return List::create(Named("method") = optim_method);
+}
+
+// Optimizer trace returned as Trace (a data.frame, oldest record first)
+inline DataFrame wrapTrace(const optimtrace::OptimTrace& trace){
+  VectorXd loglik = -trace.getNll();
+  return DataFrame::create(Named("iter") = trace.getIter(), 
+                           Named("LogLik") = loglik, 
+                           Named("gnorm") = trace.getGnorm(), 
+                           Named("relimp") = trace.getRelimp(), 
+                           Named("stepnorm") = trace.getStepnorm(), 
+                           Named("time") = trace.getTime());
+}
+
+// optimPibbleCollapsed for dense (ArrayXXd) or sparse (SparseMatrix) counts
+template <typename YType>
+List optimPibbleCollapsedY(const YType& Y, const double upsilon, 
+                           const Eigen::MatrixXd& ThetaX, 
+                           const Eigen::MatrixXd& KInv, 
+                           const Eigen::MatrixXd& AInv, 
+                           Eigen::MatrixXd inits, int n_samples, 
+                           bool calcGradHess, double b1, double b2, 
+                           double step_size, double epsilon, double eps_f, 
+                           double eps_g, int max_iter, bool verbose, 
+                           int verbose_rate, String decomp_method, 
+                           String optim_method, double eigvalthresh, 
+                           double jitter, double multDirichletBoot, 
+                           bool useSylv, int ncores, long seed, bool useFloat, 
+                           bool useChol, bool lowrankAInv, int batch_size, 
+                           SEXP optim_state, double race_tol, 
+                           int trace_rate, int trace_size, 
+                           bool returnFactor){  
+  #ifdef FIDO_USE_PARALLEL 
+    Eigen::initParallel();
+    if (ncores > 0) Eigen::setNbThreads(ncores);
+    // threads for the per-sample loops of the model (see PibbleCollapsedT)
+    if (ncores > 0) {
+      omp_set_num_threads(ncores);
+    } else {
+      omp_set_num_threads(omp_get_max_threads());
+    }
+  #endif 
+  Timer timer;
+  timer.step("Overall_start");
+  int N = Y.cols();
+  int D = Y.rows();
+  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, useSylv, useChol, 
+                     lowrankAInv);
+  if (inits.rows() != N*(D-1))
+    Rcpp::stop("init must have dimensions D-1 x N (or D-1 x N x starts)");
+  VectorXd init = inits.col(0);
+  Map<VectorXd> eta(init.data(), init.size()); // will rewrite by optim
+  double nllopt; // NEGATIVE LogLik at optim
+  List out(10);
+  out.names() = CharacterVector::create("LogLik", "Gradient", "Hessian",
+            "Pars", "Samples", "Timer", "logInvNegHessDet", "OptimState", 
+            "Trace", "LaplaceFactor");
+  
+  // Pick optimizer (ADAM - without perturbation appears to be best)
+  //   ADAM with perturbations not fully implemented
+  timer.step("Optimization_start");
+  int status;
+  PibbleOptimState ostate = readOptimState(optim_state, optim_method, D, N);
+  std::unique_ptr<optimtrace::OptimTrace> trace;
+  if (trace_rate > 0){
+    trace.reset(new optimtrace::OptimTrace(trace_size, trace_rate));
+    ostate.trace = trace.get();
+  }
+  if (inits.cols() > 1){
+    status = optimPibbleEtaMultistart(Y, upsilon, ThetaX, KInv, AInv, inits, 
+                                      eta, nllopt, b1, b2, step_size, epsilon, 
+                                      eps_f, eps_g, max_iter, verbose, 
+                                      optim_method, useSylv, useFloat, useChol, 
+                                      lowrankAInv, race_tol, ncores, ostate);
+  } else if (optim_method=="adam_minibatch"){
+    status = optimPibbleEtaMinibatch(Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                     nllopt, batch_size, b1, b2, step_size, 
+                                     epsilon, eps_f, eps_g, max_iter, verbose, 
+                                     verbose_rate, useFloat, lowrankAInv, seed, 
+                                     ostate.adam, ostate.trace);
+  } else {
+    status = optimPibbleEtaDispatch(cm, Y, upsilon, ThetaX, KInv, AInv, eta, 
+                                    nllopt, b1, b2, step_size, epsilon, eps_f, 
+                                    eps_g, max_iter, verbose, verbose_rate, 
+                                    optim_method, useSylv, useFloat, useChol, 
+                                    lowrankAInv, ostate);
+  }
+   
+  timer.step("Optimization_stop");
+
+  if (status<0)
+    Rcpp::warning("Max Iterations Hit, May not be at optima");
+  Map<MatrixXd> etamat(eta.data(), D-1, N);
+  out[0] = -nllopt; // Return (positive) LogLik
+  out[3] = etamat;
+  out[7] = wrapOptimState(ostate, optim_method);
+  if (trace) out[8] = wrapTrace(*trace);
+  
+  if (n_samples > 0 || calcGradHess || returnFactor){
+    if (verbose) Rcout << "Allocating for Gradient" << std::endl;
+    VectorXd grad(N*(D-1));
+    MatrixXd hess; // don't preallocate this thing could be unneeded
+    if (verbose) Rcout << "Calculating Gradient" << std::endl;
+    cm.updateWithEtaLL(eta); // cm may not have been used by the optimizer
+    cm.updateWithEtaGH();
+    grad = cm.calcGrad();
+    
+    // "Multinomial-Dirichlet" option
+    if (multDirichletBoot>=0.0){
+      timer.step("MultDirichletBoot_start");
+      if (verbose) Rcout << "Performing Multinomial Dirichlet Bootstrap" << std::endl;
+      MatrixXd samp = MultDirichletBoot::MultDirichletBoot(n_samples, etamat, denseCounts(Y), 
+                                                           multDirichletBoot, 
+                                                           seed);
+      timer.step("MultDirichletBoot_stop");
+      out[1] = R_NilValue;
+      out[2] = R_NilValue;
+      IntegerVector d = IntegerVector::create(D-1, N, n_samples);
+      NumericVector samples = wrap(samp);
+      samples.attr("dim") = d; // convert to 3d array for return to R
+      out[4] = samples;
+      timer.step("Overall_stop");
+      NumericVector t(timer);
+      addOptimStats(t, optim_method, ostate);
+      out[5] = t;
+      return out;
+    }
+    // "Multinomial-Dirchlet" option 
+    if (verbose) Rcout << "Calculating Hessian" << std::endl;
+    timer.step("HessianCalculation_start");
+    // factored form, only made dense if returned or decomposed
+    mongrel::StructuredHessian shess = cm.calcStructuredHess(); 
+    bool returnHess = calcGradHess;
+    if (calcGradHess && ((N * (D-1)) > 44750)){
+      Rcpp::warning("Hessian is to large to return to R");
+      returnHess = false;
+    }
+    bool krylov = (decomp_method=="krylov");
+    bool partial = (decomp_method=="partial");
+    bool lowrank = (decomp_method=="lowrank");
+    if (returnFactor && krylov){
+      Rcpp::warning("LaplaceFactor is not available for decomp_method krylov");
+      returnFactor = false;
+    }
+    bool dense = ((n_samples>0) || returnFactor) && !krylov && !partial && 
+      !lowrank;
+    if (returnHess || dense){
+      // lower triangle of the negative hessian, assembled in the buffer 
+      //   the laplace approximation then factors in place
+      hess.resize(N*(D-1), N*(D-1));
+      shess.toDenseNegLower(hess); // should have eta at optima already
+    }
+    timer.step("HessianCalculation_Stop");
+    out[1] = grad;
+    if (returnHess){
+      // symmetrized directly into the returned R object
+      NumericVector nvHess(Rcpp::no_init(hess.size()));
+      nvHess.attr("dim") = IntegerVector::create(hess.rows(), hess.cols());
+      Map<MatrixXd> H(nvHess.begin(), hess.rows(), hess.cols());
+      H = hess.selfadjointView<Eigen::Lower>();
+      out[2] = nvHess;
+      if (!dense) hess.resize(0, 0);
+    }
+
+    if ((n_samples>0) || returnFactor){
+      // Laplace Approximation
+      int status;
+      timer.step("LaplaceApproximation_start");
+      MatrixXd samp = MatrixXd::Zero(N*(D-1), n_samples);
+      double logInvNegHessDet;
+      if (returnFactor){
+        // decomposed into a sampler owned by the returned handle so more 
+        //   samples can be drawn later (see sampleLaplaceFactor)
+        XPtr<lapap::LaplaceSampler> factor(new lapap::LaplaceSampler(eta, 
+                                             eigvalthresh, seed), true);
+        if (partial){
+          MatrixXd hessblocks = -shess.diagonalBlocks();
+          status = factor->decompose(hessblocks, "cholesky", jitter);
+        } else if (lowrank){
+          MatrixXd hessblocks = -shess.diagonalBlocks();
+          status = factor->decompose(shess, hessblocks, jitter);
+        } else {
+          status = factor->decompose(hess, decomp_method, jitter);
+        }
+        if (status == 0) status = factor->sample(samp);
+        logInvNegHessDet = factor->pars.logInvNegHessDet;
+        if (status == 0){
+          factor.attr("class") = "laplacefactor";
+          factor.attr("dims") = IntegerVector::create(D-1, N);
+          out[9] = factor;
+        }
+      } else if (krylov){
+        status = lapap::LaplaceApproximationKrylov(samp, eta, shess, 
+                                                   eigvalthresh, jitter, 
+                                                   logInvNegHessDet, 
+                                                   seed);
+      } else if (partial){
+        MatrixXd hessblocks = -shess.diagonalBlocks();
+        status = lapap::LaplaceApproximation(samp, eta, hessblocks, 
+                                             "cholesky", eigvalthresh, 
+                                             jitter, 
+                                             logInvNegHessDet, 
+                                             seed);
+      } else if (lowrank){
+        MatrixXd hessblocks = -shess.diagonalBlocks();
+        status = lapap::LaplaceApproximationLowRank(samp, eta, shess, 
+                                                    hessblocks, eigvalthresh, 
+                                                    jitter, 
+                                                    logInvNegHessDet, 
+                                                    seed);
+      } else {
+        status = lapap::LaplaceApproximation(samp, eta, hess, 
+                                             decomp_method, eigvalthresh, 
+                                             jitter, 
+                                             logInvNegHessDet, 
+                                             seed);
+      }
+      timer.step("LaplaceApproximation_stop");
+      if (status != 0){
+        Rcpp::warning("Decomposition of Hessian Failed, returning MAP Estimate only");
+        return out;
+      }
+      out[6] = logInvNegHessDet;
+      
+      if (n_samples>0){
+        IntegerVector d = IntegerVector::create(D-1, N, n_samples);
+        NumericVector samples = wrap(samp);
+        samples.attr("dim") = d; // convert to 3d array for return to R
+        out[4] = samples;
+      }
+    } // endif n_samples || calcGradHess
+  } // endif n_samples || calcGradHess
+  timer.step("Overall_stop");
+  NumericVector t(timer);
+  addOptimStats(t, optim_method, ostate);
+  out[5] = t;
+  return out;
+}
+
 //' Function to Optimize the Collapsed Pibble Model
 //' 
 //' See details for model. Should likely be followed by function 
@@ -19,13 +685,25 @@ using Eigen::VectorXd;
 //' \code{D} is number of multinomial categories, and \code{Q} is number
 //' of covariates. 
 //' 
-//' @param Y D x N matrix of counts
+//' @param Y D x N matrix of counts (either a dense matrix or a sparse 
+//'   \code{dgCMatrix} from the Matrix package, with sparse counts only 
+//'   non-zero counts are visited when computing the multinomial terms)
 //' @param upsilon (must be > D)
 //' @param ThetaX D-1 x N matrix formed by Theta*X (Theta is Prior mean 
 //'    for regression coefficients) 
 //' @param KInv D-1 x D-1 precision matrix (inverse of Xi)
-//' @param AInv N x N precision matrix given by (I_N + X'*Gamma*X)^{-1}
-//' @param init D-1 x N matrix of initial guess for eta used for optimization
+//' @param AInv N x N precision matrix given by (I_N + X'*Gamma*X)^{-1} or 
+//'   a list with elements X (Q x N) and Gamma (Q x Q) in which case AInv is 
+//'   never formed (it is applied through the Woodbury identity, much faster 
+//'   and smaller when Q << N)
+//' @param init D-1 x N matrix of initial guess for eta used for optimization 
+//'   or D-1 x N x K array of K initial guesses (multi-start), the K starts 
+//'   are optimized concurrently (one thread each, see \code{race_tol}) and 
+//'   only the best is used for the Hessian and Laplace approximation. 
+//'   LogLik of each start and the index of the best are returned as 
+//'   attributes StartLogLik and StartWinner of Timer. Multiple starts are 
+//'   implemented for optim_method "adam", "lbfgs", "newton_cg" and 
+//'   "plbfgs". 
 //' @param n_samples number of samples for Laplace Approximation (=0 very fast
 //'    as no inversion or decomposition of Hessian is required)
 //' @param calcGradHess if n_samples=0 should Gradient and Hessian 
@@ -42,7 +720,27 @@ using Eigen::VectorXd;
 //' @param verbose_rate (ADAM) rate to print verbose stats to screen
 //' @param decomp_method decomposition of hessian for Laplace approximation
 //'   'eigen' (more stable-slightly, slower) or 'cholesky' (less stable, faster, default)
-//' @param optim_method (default:"adam") or "lbfgs"
+//'   or 'krylov' (never forms the hessian; samples are drawn using lanczos 
+//'   approximations to products with the inverse square root of the hessian 
+//'   and logInvNegHessDet is a stochastic lanczos quadrature estimate) 
+//'   or 'partial' (block diagonal approximation: only the N (D-1)x(D-1) 
+//'   diagonal blocks of the hessian, one per sample, are formed and 
+//'   factored (cholesky, in parallel), O(N*D^3) time and O(N*D^2) memory, 
+//'   ignores posterior correlation between samples) 
+//'   or 'lowrank' (the 'partial' blocks corrected by the k=20 eigenpairs of 
+//'   the hessian whitened by those blocks furthest from 1, found by lanczos 
+//'   over hessian-vector products; never forms the hessian, O((k+D)*N*D) per 
+//'   sample and for logInvNegHessDet, exact if k >= N*(D-1))
+//' @param optim_method (default:"adam") or "lbfgs" or "newton_cg" (trust 
+//'   region newton method with steps by conjugate gradient, preconditioned 
+//'   by the block diagonal multinomial part of the hessian, number of 
+//'   newton and conjugate gradient iterations are returned as attributes 
+//'   OptimIterations and CGIterations of Timer) or "adam_minibatch" 
+//'   (stochastic ADAM updating only \code{batch_size} randomly chosen 
+//'   samples per step, see \code{batch_size}) or "plbfgs" (L-BFGS whose 
+//'   initial inverse hessian is the inverse of the block diagonal 
+//'   multinomial part of the hessian, rebuilt every 10 iterations; much 
+//'   faster than "lbfgs" or "adam" when sequencing depth is high)
 //' @param eigvalthresh threshold for negative eigenvalues in 
 //'   decomposition of negative inverse hessian (should be <=0)
 //' @param jitter (default: 0) if >=0 then adds that factor to diagonal of Hessian 
@@ -52,8 +750,60 @@ using Eigen::VectorXd;
 //' @param useSylv (default: true) if N<D-1 uses Sylvester Determinant Identity
 //'   to speed up calculation of log-likelihood and gradients. 
 //' @param ncores (default:-1) number of cores to use, if ncores==-1 then 
-//' uses default from OpenMP typically to use all available cores. 
-//' @param seed (random seed for Laplace approximation -- integer)
+//' uses default from OpenMP typically to use all available cores. Used for 
+//' matrix products and, during optimization, for the per-sample terms of 
+//' the log-likelihood and gradient (large N*(D-1) only). 
+//' @param seed (random seed for Laplace approximation -- integer) if not -1 
+//'   also used for multDirichletBoot (in parallel over samples) and for the 
+//'   order of mini-batches (if -1 that order is drawn from R's random number 
+//'   generator, see \code{set.seed})
+//' @param useFloat (default: false) if true (and optim_method="adam") 
+//'   optimization starts with log-likelihood and gradient evaluated in single 
+//'   precision (float) and, once stopping criteria are met, continues from the
+//'   same optimizer state in double precision. Hessian and Laplace 
+//'   approximation are always computed in double precision. 
+//' @param useChol (default: false) if true the (D-1)x(D-1) matrix 
+//'   S = I + KInv E AInv E' (N x N with useSylv) is never factored directly, 
+//'   instead the symmetric positive definite matrix it is similar to 
+//'   (I + L' E AInv E' L where KInv = LL') is factored with a Cholesky 
+//'   decomposition in place of an LU decomposition. Cheaper and more stable 
+//'   for large D. 
+//' @param batch_size (default: 100, only used if optim_method="adam_minibatch") 
+//'   number of samples (columns of eta) updated per step. The collapsed 
+//'   likelihood and the exact gradient of the chosen samples are updated 
+//'   incrementally so a step costs O(batch_size*Q) (O(batch_size*N) with 
+//'   dense AInv) rather than O(N^2). Stopping criteria use the full 
+//'   gradient and are only checked once per pass over the samples; 
+//'   \code{max_iter} counts steps. Ignores \code{useSylv} and \code{useChol}. 
+//'   Batches are drawn in an order keyed by \code{seed} (without a seed the 
+//'   order follows \code{set.seed}). 
+//' @param optim_state (default: NULL) \code{OptimState} returned by a previous 
+//'   call with the same \code{optim_method} and dimensions, optimization then 
+//'   resumes from that optimizer state (ADAM moments and timestep, or the 
+//'   trust region radius for "newton_cg") rather than starting cold. Use 
+//'   together with \code{init} set to the previous \code{Pars} (e.g., to refit 
+//'   after small changes to the priors). "lbfgs" and "plbfgs" keep no state. With 
+//'   multiple starts the state resumes the first start. 
+//' @param race_tol (default: 0.01, only used with multiple starts) starts are 
+//'   optimized in rounds (100 iterations for "adam", 5 for "newton_cg", 
+//'   "lbfgs" runs to completion), after each round starts whose negative 
+//'   LogLik is more than \code{race_tol} times |LogLik| of the best start 
+//'   above it are dropped. Set to \code{Inf} to run every start to 
+//'   completion. 
+//' @param trace_rate (default: 0, off) if > 0 every \code{trace_rate}-th 
+//'   iteration of the optimizer is recorded and returned as \code{Trace}. 
+//'   With "lbfgs" every function evaluation (line search included) counts 
+//'   as an iteration, with "adam_minibatch" every pass over the samples. 
+//'   With multiple starts the trace of the best start is returned. 
+//' @param trace_size (default: 1000) maximum number of records kept (a ring 
+//'   buffer allocated up front, once full the oldest records are dropped)
+//' @param returnFactor (default: false) if true the decomposition of the 
+//'   Hessian at the optima (even if \code{n_samples}=0, not available for 
+//'   decomp_method "krylov") is kept and returned as \code{LaplaceFactor} 
+//'   so that more samples can be drawn, or the Laplace density evaluated, 
+//'   without refitting (see \code{\link{sampleLaplaceFactor}}). Holds the 
+//'   factor (N*(D-1) x N*(D-1) for "cholesky" and "eigen") in memory for as 
+//'   long as it is referenced. 
 //'  
 //' @details Notation: Let Z_j denote the J-th row of a matrix Z.
 //' Model:
@@ -74,6 +824,7 @@ using Eigen::VectorXd;
 //' \code{upsilon} and \code{KInv}) were too specific and at odds with the observed data.
 //' If you get this warning try the following. 
 //' 1. Try restarting the optimization using a different initial guess for eta
+//'   (or several at once, see \code{init})
 //' 2. Try decreasing (or even increasing )\code{step_size} (by increments of 0.001 or 0.002) 
 //'   and increasing \code{max_iter} parameters in optimizer. Also can try 
 //'   increasing \code{b1} to 0.99 and decreasing \code{eps_f} by a few orders
@@ -93,6 +844,17 @@ using Eigen::VectorXd;
 //' 6. Timer - Vector of Execution Times
 //' 7. logInvNegHessDet - the log determinant of the covariacne of the Laplace 
 //'    approximation, useful for calculating marginal likelihood 
+//' 8. OptimState - state of the optimizer at the optima (list with element 
+//'    method and, for "adam" and "adam_minibatch", mt, vt and t, for 
+//'    "newton_cg", delta) that can be passed back as \code{optim_state}
+//' 9. Trace - (if \code{trace_rate} > 0) data.frame with one row per 
+//'    recorded iteration and columns iter, LogLik, gnorm (gradient norm), 
+//'    relimp (relative improvement in -LogLik over the previous iteration), 
+//'    stepnorm (norm of the step to that iteration) and time (seconds since 
+//'    the start of optimization)
+//' 10. LaplaceFactor - (if \code{returnFactor}=true) external pointer of 
+//'    class laplacefactor to the decomposition of the Hessian (see 
+//'    \code{\link{sampleLaplaceFactor}})
 //' @md 
 //' @export
 //' @name optimPibbleCollapsed
@@ -110,12 +872,12 @@ using Eigen::VectorXd;
 //' fit <- optimPibbleCollapsed(sim$Y, sim$upsilon, sim$Theta%*%sim$X, sim$KInv, 
 //'                              sim$AInv, random_pibble_init(sim$Y))  
 // [[Rcpp::export]]
-List optimPibbleCollapsed(const Eigen::ArrayXXd Y, 
+List optimPibbleCollapsed(SEXP Y, 
                const double upsilon, 
                const Eigen::MatrixXd ThetaX, 
                const Eigen::MatrixXd KInv, 
-               const Eigen::MatrixXd AInv, 
-               Eigen::MatrixXd init, 
+               SEXP AInv, 
+               SEXP init, 
                int n_samples=2000, 
                bool calcGradHess = true,
                double b1 = 0.9,         
@@ -134,107 +896,56 @@ List optimPibbleCollapsed(const Eigen::ArrayXXd Y,
                double multDirichletBoot = -1.0, 
                bool useSylv = true, 
                int ncores=-1, 
-               long seed=-1){  
-  #ifdef FIDO_USE_PARALLEL 
-    Eigen::initParallel();
-    if (ncores > 0) Eigen::setNbThreads(ncores);
-  #endif 
-  Timer timer;
-  timer.step("Overall_start");
-  int N = Y.cols();
-  int D = Y.rows();
-  PibbleCollapsed cm(Y, upsilon, ThetaX, KInv, AInv, useSylv);
-  Map<VectorXd> eta(init.data(), init.size()); // will rewrite by optim
-  double nllopt; // NEGATIVE LogLik at optim
-  List out(7);
-  out.names() = CharacterVector::create("LogLik", "Gradient", "Hessian",
-            "Pars", "Samples", "Timer", "logInvNegHessDet");
-  
-  // Pick optimizer (ADAM - without perturbation appears to be best)
-  //   ADAM with perturbations not fully implemented
-  timer.step("Optimization_start");
-  int status;
-  if (optim_method=="lbfgs"){
-    status = Numer::optim_lbfgs(cm, eta, nllopt, max_iter, eps_f, eps_g);
-  } else if (optim_method=="adam"){
-    status = adam::optim_adam(cm, eta, nllopt, b1, b2, step_size, epsilon, 
-                                  eps_f, eps_g, max_iter, verbose, verbose_rate);  
+               long seed=-1, 
+               bool useFloat=false, 
+               bool useChol=false, 
+               int batch_size=100, 
+               SEXP optim_state=R_NilValue, 
+               double race_tol=0.01, 
+               int trace_rate=0, 
+               int trace_size=1000, 
+               bool returnFactor=false){
+  // AInv either dense or as list(X, Gamma) in which case it is only applied 
+  //   through its (Q x N) woodbury factor
+  Eigen::MatrixXd AInvm;
+  bool lowrankAInv = Rcpp::is<List>(AInv);
+  if (lowrankAInv){
+    List AInvl(AInv);
+    if (!AInvl.containsElementNamed("X") || !AInvl.containsElementNamed("Gamma"))
+      Rcpp::stop("AInv given as a list must have elements X and Gamma");
+    AInvm = woodbury_ainv_factor(as<Eigen::MatrixXd>(AInvl["X"]), 
+                                 as<Eigen::MatrixXd>(AInvl["Gamma"]));
   } else {
-    Rcpp::stop("unrecognized optimization method");
+    AInvm = as<Eigen::MatrixXd>(AInv);
   }
-   
-  timer.step("Optimization_stop");
-
-  if (status<0)
-    Rcpp::warning("Max Iterations Hit, May not be at optima");
-  Map<MatrixXd> etamat(eta.data(), D-1, N);
-  out[0] = -nllopt; // Return (positive) LogLik
-  out[3] = etamat;
-  
-  if (n_samples > 0 || calcGradHess){
-    if (verbose) Rcout << "Allocating for Gradient" << std::endl;
-    VectorXd grad(N*(D-1));
-    MatrixXd hess; // don't preallocate this thing could be unneeded
-    if (verbose) Rcout << "Calculating Gradient" << std::endl;
-    grad = cm.calcGrad(); // should have eta at optima already
-    
-    // "Multinomial-Dirichlet" option
-    if (multDirichletBoot>=0.0){
-      timer.step("MultDirichletBoot_start");
-      if (verbose) Rcout << "Performing Multinomial Dirichlet Bootstrap" << std::endl;
-      MatrixXd samp = MultDirichletBoot::MultDirichletBoot(n_samples, etamat, Y, 
-                                                           multDirichletBoot);
-      timer.step("MultDirichletBoot_stop");
-      out[1] = R_NilValue;
-      out[2] = R_NilValue;
-      IntegerVector d = IntegerVector::create(D-1, N, n_samples);
-      NumericVector samples = wrap(samp);
-      samples.attr("dim") = d; // convert to 3d array for return to R
-      out[4] = samples;
-      timer.step("Overall_stop");
-      NumericVector t(timer);
-      out[5] = t;
-      return out;
-    }
-    // "Multinomial-Dirchlet" option 
-    if (verbose) Rcout << "Calculating Hessian" << std::endl;
-    timer.step("HessianCalculation_start");
-    hess = -cm.calcHess(); // should have eta at optima already
-    timer.step("HessianCalculation_Stop");
-    out[1] = grad;
-    if ((N * (D-1)) > 44750){
-      Rcpp::warning("Hessian is to large to return to R");
-    } else {
-      if (calcGradHess)
-        out[2] = hess;    
-    }
-
-    if (n_samples>0){
-      // Laplace Approximation
-      int status;
-      timer.step("LaplaceApproximation_start");
-      MatrixXd samp = MatrixXd::Zero(N*(D-1), n_samples);
-      double logInvNegHessDet;
-      status = lapap::LaplaceApproximation(samp, eta, hess, 
-                                           decomp_method, eigvalthresh, 
-                                           jitter, 
-                                           logInvNegHessDet, 
-                                           seed);
-      timer.step("LaplaceApproximation_stop");
-      if (status != 0){
-        Rcpp::warning("Decomposition of Hessian Failed, returning MAP Estimate only");
-        return out;
-      }
-      out[6] = logInvNegHessDet;
-      
-      IntegerVector d = IntegerVector::create(D-1, N, n_samples);
-      NumericVector samples = wrap(samp);
-      samples.attr("dim") = d; // convert to 3d array for return to R
-      out[4] = samples;
-    } // endif n_samples || calcGradHess
-  } // endif n_samples || calcGradHess
-  timer.step("Overall_stop");
-  NumericVector t(timer);
-  out[5] = t;
-  return out;
+  // init either a D-1 x N matrix or a D-1 x N x K array of K starts (stored 
+  //   as the K columns of inits)
+  NumericVector initv(init);
+  IntegerVector initdim = initv.attr("dim");
+  if ((initdim.size() != 2) && (initdim.size() != 3))
+    Rcpp::stop("init must be a matrix or a 3 dimensional array");
+  int K = (initdim.size() == 3) ? initdim[2] : 1;
+  Eigen::MatrixXd inits = Map<MatrixXd>(initv.begin(), initdim[0]*initdim[1], K);
+  if (Rf_inherits(Y, "dgCMatrix")){
+    Eigen::SparseMatrix<double> Ysp = as<Eigen::SparseMatrix<double> >(Y);
+    return optimPibbleCollapsedY(Ysp, upsilon, ThetaX, KInv, AInvm, inits, 
+                                 n_samples, calcGradHess, b1, b2, step_size, 
+                                 epsilon, eps_f, eps_g, max_iter, verbose, 
+                                 verbose_rate, decomp_method, optim_method, 
+                                 eigvalthresh, jitter, multDirichletBoot, 
+                                 useSylv, ncores, seed, useFloat, useChol, 
+                                 lowrankAInv, batch_size, optim_state, 
+                                 race_tol, trace_rate, trace_size, 
+                                 returnFactor);
+  }
+  Eigen::ArrayXXd Yd = as<Eigen::ArrayXXd>(Y);
+  return optimPibbleCollapsedY(Yd, upsilon, ThetaX, KInv, AInvm, inits, 
+                               n_samples, calcGradHess, b1, b2, step_size, 
+                               epsilon, eps_f, eps_g, max_iter, verbose, 
+                               verbose_rate, decomp_method, optim_method, 
+                               eigvalthresh, jitter, multDirichletBoot, 
+                               useSylv, ncores, seed, useFloat, useChol, 
+                               lowrankAInv, batch_size, optim_state, 
+                               race_tol, trace_rate, trace_size, 
+                               returnFactor);
 }
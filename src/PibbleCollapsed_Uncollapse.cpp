@@ -1,6 +1,9 @@
 #include <fido.h>
 #include <Rcpp/Benchmark/Timer.h>
 #include <boost/random/mersenne_twister.hpp>
+#include <PhiloxRNG.h>
+#include <algorithm>
+#include <vector>
 
 #ifdef FIDO_USE_PARALLEL
 #include <omp.h>
@@ -15,6 +18,80 @@ using Eigen::Lower;
 
 //Eta should be array with dim [D-1, N, iter]
 
+// Posterior of Lambda and Sigma given a sample of Eta (everything that does 
+//   not depend on Eta is computed once on construction), shared by 
+//   uncollapsePibble and uncollapsePibbleLaplace
+class PibbleUncollapse {
+  private:
+    int D, N, Q;
+    double upsilonN;
+    const Eigen::Ref<const MatrixXd> X;
+    const Eigen::Ref<const MatrixXd> Theta;
+    const Eigen::Ref<const MatrixXd> Xi;
+    MatrixXd GammaInv;
+    MatrixXd LGammaN;
+    MatrixXd ThetaGammaInvGammaN;
+    MatrixXd XTGammaN;
+  
+  public:
+    // storage for computation (one per thread)
+    struct Work {
+      MatrixXd LambdaN, XiN, LSigmaDraw, ELambda, EEta;
+      Work(int D, int N, int Q) : LambdaN(D-1, Q), XiN(D-1, D-1), 
+        LSigmaDraw(D-1, D-1), ELambda(D-1, Q), EEta(D-1, N) {}
+    };
+    
+    PibbleUncollapse(const Eigen::Ref<const MatrixXd>& X_, 
+                     const Eigen::Ref<const MatrixXd>& Theta_, 
+                     const Eigen::Ref<const MatrixXd>& Gamma, 
+                     const Eigen::Ref<const MatrixXd>& Xi_, 
+                     const double upsilon) : 
+    X(X_), Theta(Theta_), Xi(Xi_) {
+      Q = Gamma.rows();
+      D = Xi.rows()+1;
+      N = X.cols();
+      upsilonN = upsilon + N;
+      GammaInv = Gamma.lu().inverse();
+      const MatrixXd GammaInvN(GammaInv + X*X.transpose());
+      const MatrixXd GammaN(GammaInvN.lu().inverse());
+      LGammaN = GammaN.llt().matrixL();
+      ThetaGammaInvGammaN = Theta*GammaInv*GammaN;
+      XTGammaN = X.transpose()*GammaN;
+    }
+    
+    Work work() const { return Work(D, N, Q); }
+    
+    // philox stream of draw i, draws are then reproducible regardless of 
+    //   threads and disjoint from the streams lapap::LaplaceSampler uses for 
+    //   samples of eta with the same seed
+    static uint64_t stream(long i){ return ((uint64_t)1 << 63) + i; }
+    
+    template <typename RNG>
+    // Writes a draw (or the posterior mean if ret_mean) of Lambda 
+    //   ((D-1)xQ) and Sigma ((D-1)x(D-1)) given Eta ((D-1)xN)
+    void draw(const Map<const MatrixXd>& Eta, Map<MatrixXd>& LambdaDraw, 
+              Map<MatrixXd>& SigmaDraw, bool ret_mean, RNG& rng, 
+              Work& w) const {
+      w.LambdaN.noalias() = Eta*XTGammaN+ThetaGammaInvGammaN;
+      w.ELambda = w.LambdaN-Theta;
+      w.EEta.noalias() = Eta-w.LambdaN*X;
+      w.XiN.noalias() = Xi+ w.EEta*w.EEta.transpose() + 
+        w.ELambda*GammaInv*w.ELambda.transpose();
+      
+      if (ret_mean){
+        LambdaDraw = w.LambdaN;
+        SigmaDraw = (upsilonN-D)*w.XiN; // mean of inverse wishart
+      } else {
+        // Draw Random Component
+        rInvWishRevCholesky_thread_inplace(w.LSigmaDraw, upsilonN, w.XiN, rng);
+        // Note: Below is valid even though LSigmaDraw is reverse cholesky factor
+        rMatNormalCholesky_thread_inplace(LambdaDraw, w.LambdaN, w.LSigmaDraw, 
+                                          LGammaN.matrix(), rng);
+        SigmaDraw.noalias() = w.LSigmaDraw*w.LSigmaDraw.transpose();
+      }
+    }
+};
+
 
 //' Uncollapse output from optimPibbleCollapsed to full pibble Model
 //' 
@@ -35,7 +112,9 @@ using Eigen::Lower;
 //'   corresponding to each sample of eta rather than sampling from 
 //'   posterior of Lambda and Sigma (useful if Laplace approximation
 //'   is not used (or fails) in optimPibbleCollapsed)
-//' @param seed seed to use for random number generation 
+//' @param seed seed to use for random number generation (draw i uses its 
+//'   own stream of a counter based generator so results do not depend on 
+//'   \code{ncores})
 //' @param ncores (default:-1) number of cores to use, if ncores==-1 then 
 //' uses default from OpenMP typically to use all available cores. 
 //'  
@@ -105,14 +184,7 @@ List uncollapsePibble(const Eigen::Map<Eigen::VectorXd> eta, // note this is ess
   int D = Xi.rows()+1;
   int N = X.cols();
   int iter = eta.size()/(N*(D-1)); // assumes result is an integer !!!
-  double upsilonN = upsilon + N;
-  const MatrixXd GammaInv(Gamma.lu().inverse());
-  const MatrixXd GammaInvN(GammaInv + X*X.transpose());
-  const MatrixXd GammaN(GammaInvN.lu().inverse());
-  const MatrixXd LGammaN(GammaN.llt().matrixL());
-  //const Map<const MatrixXd> Eta(NULL);
-  const MatrixXd ThetaGammaInvGammaN(Theta*GammaInv*GammaN);
-  const MatrixXd XTGammaN(X.transpose()*GammaN);
+  const PibbleUncollapse unc(X, Theta, Gamma, Xi, upsilon);
 
   // Storage for output
   MatrixXd LambdaDraw0((D-1)*Q, iter);
@@ -125,45 +197,17 @@ List uncollapsePibble(const Eigen::Map<Eigen::VectorXd> eta, // note this is ess
   #endif 
   #pragma omp parallel shared(D, N, Q, LambdaDraw0, SigmaDraw0)
   {
-  #ifdef FIDO_USE_PARALLEL
-    boost::random::mt19937 rng(omp_get_thread_num()+seed);
-  #else 
-    boost::random::mt19937 rng(seed);
-  #endif 
   // storage for computation
-  MatrixXd LambdaN(D-1, Q);
-  MatrixXd XiN(D-1, D-1);
-  MatrixXd LSigmaDraw(D-1, D-1);
-  MatrixXd ELambda(D-1, Q);
-  MatrixXd EEta(D-1, N);
+  PibbleUncollapse::Work w = unc.work();
   #pragma omp for 
   for (int i=0; i < iter; i++){
     //R_CheckUserInterrupt();
+    // generator keyed by draw (not thread) so results don't depend on ncores
+    philox::PhiloxEngine rng(seed, PibbleUncollapse::stream(i));
     const Map<const MatrixXd> Eta(&eta(i*N*(D-1)),D-1, N);
-    LambdaN.noalias() = Eta*XTGammaN+ThetaGammaInvGammaN;
-    ELambda = LambdaN-Theta;
-    EEta.noalias() = Eta-LambdaN*X;
-    XiN.noalias() = Xi+ EEta*EEta.transpose() + ELambda*GammaInv*ELambda.transpose();
-    
-    if (ret_mean){
-      Map<VectorXd> LambdaNVec(LambdaN.data(), LambdaN.size());
-      Map<VectorXd> XiNVec(XiN.data(), XiN.size());
-      LambdaDraw0.col(i) = LambdaNVec;
-      SigmaDraw0.col(i) = (upsilonN-D)*XiNVec; // mean of inverse wishart
-    } else {
-      // Draw Random Component
-      rInvWishRevCholesky_thread_inplace(LSigmaDraw, upsilonN, XiN, rng);
-      // Note: Below is valid even though LSigmaDraw is reverse cholesky factor
-      Eigen::Ref<VectorXd> LambdaDraw_tmp = LambdaDraw0.col(i);
-      Eigen::Map<MatrixXd> LambdaDraw(LambdaDraw_tmp.data(), D-1, Q);
-      rMatNormalCholesky_thread_inplace(LambdaDraw, LambdaN, LSigmaDraw, 
-                                        LGammaN.matrix(), rng);
-
-      Eigen::Ref<VectorXd> SigmaDraw_tmp = SigmaDraw0.col(i);
-      Eigen::Map<MatrixXd> SigmaDraw_tosquare(SigmaDraw_tmp.data(), D-1, D-1);
-      SigmaDraw_tosquare.noalias() = LSigmaDraw*LSigmaDraw.transpose();
-      
-    }
+    Map<MatrixXd> LambdaDraw(&LambdaDraw0(0, i), D-1, Q);
+    Map<MatrixXd> SigmaDraw(&SigmaDraw0(0, i), D-1, D-1);
+    unc.draw(Eta, LambdaDraw, SigmaDraw, ret_mean, rng, w);
   }
   }
   #ifdef FIDO_USE_PARALLEL
@@ -188,6 +232,265 @@ List uncollapsePibble(const Eigen::Map<Eigen::VectorXd> eta, // note this is ess
   return out;
 }
 
+// uncollapsePibbleLaplace for dense (ArrayXXd) or sparse (SparseMatrix) counts
+template <typename YType>
+List uncollapsePibbleLaplaceY(const YType& Y, const double upsilon, 
+                              const Eigen::MatrixXd& Theta, 
+                              const Eigen::MatrixXd& X, 
+                              const Eigen::MatrixXd& Gamma, 
+                              const Eigen::MatrixXd& Xi, 
+                              const Eigen::MatrixXd& eta, int n_samples, 
+                              const CharacterVector& pars, int chunk_size, 
+                              String decomp_method, double eigvalthresh, 
+                              double jitter, bool useChol, long seed, 
+                              bool ret_mean, int ncores){
+  #ifdef FIDO_USE_PARALLEL
+    Eigen::initParallel();
+    if (ncores > 0) Eigen::setNbThreads(ncores);
+    if (ncores > 0) {
+      omp_set_num_threads(ncores);
+    } else {
+      omp_set_num_threads(omp_get_max_threads());
+    }
+    int nthreads = omp_get_max_threads();
+  #else 
+    int nthreads = 1;
+  #endif 
+  Timer timer;
+  timer.step("Overall_start");
+  int N = Y.cols();
+  int D = Y.rows();
+  int Q = X.rows();
+  if (eta.size() != N*(D-1))
+    Rcpp::stop("eta must have dimensions D-1 x N");
+  if (chunk_size < 1) chunk_size = 1;
+  auto inpars = [&pars](const char* p){ 
+    return std::find(pars.begin(), pars.end(), p) != pars.end(); 
+  };
+  bool retEta = inpars("Eta");
+  bool retLambda = inpars("Lambda");
+  bool retSigma = inpars("Sigma");
+  List out(5);
+  out.names() = CharacterVector::create("Eta", "Lambda", "Sigma", 
+            "logInvNegHessDet", "Timer");
+  
+  // hessian of the collapsed model at eta (AInv through its woodbury 
+  //   factor when Q < N as in pibble)
+  timer.step("HessianCalculation_start");
+  const MatrixXd KInv(Xi.llt().solve(MatrixXd::Identity(D-1, D-1)));
+  bool lowrankAInv = (Q < N);
+  MatrixXd AInv;
+  if (lowrankAInv){
+    AInv = woodbury_ainv_factor(X, Gamma);
+  } else {
+    MatrixXd A = X.transpose()*Gamma*X;
+    A.diagonal().array() += 1;
+    AInv = A.llt().solve(MatrixXd::Identity(N, N));
+  }
+  PibbleCollapsed cm(Y, upsilon, Theta*X, KInv, AInv, false, useChol, 
+                     lowrankAInv);
+  const VectorXd m = Map<const VectorXd>(eta.data(), eta.size());
+  cm.updateWithEtaLL(m);
+  cm.updateWithEtaGH();
+  mongrel::StructuredHessian shess = cm.calcStructuredHess();
+  timer.step("HessianCalculation_Stop");
+  
+  // decomposed once, samples are then drawn chunk by chunk
+  timer.step("LaplaceApproximation_start");
+  lapap::LaplaceSampler sampler(m, eigvalthresh, seed);
+  int status;
+  if (decomp_method=="krylov"){
+    status = sampler.decompose(shess, jitter);
+  } else if (decomp_method=="partial"){
+    MatrixXd hessblocks = -shess.diagonalBlocks();
+    status = sampler.decompose(hessblocks, "cholesky", jitter);
+  } else if (decomp_method=="lowrank"){
+    MatrixXd hessblocks = -shess.diagonalBlocks();
+    status = sampler.decompose(shess, hessblocks, jitter);
+  } else {
+    MatrixXd hess(N*(D-1), N*(D-1)); // lower triangle, factored in place
+    shess.toDenseNegLower(hess);
+    status = sampler.decompose(hess, decomp_method, jitter);
+  }
+  timer.step("LaplaceApproximation_stop");
+  if (status != 0){
+    Rcpp::warning("Decomposition of Hessian Failed, returning MAP Estimate only");
+    timer.step("Overall_stop");
+    out[4] = timer;
+    return out;
+  }
+  
+  // only the requested parameters are stored (written in place)
+  NumericVector nvEta, nvLambda, nvSigma;
+  if (retEta){
+    nvEta = NumericVector(Rcpp::no_init((D-1)*N*n_samples));
+    nvEta.attr("dim") = IntegerVector::create(D-1, N, n_samples);
+  }
+  if (retLambda){
+    nvLambda = NumericVector(Rcpp::no_init((D-1)*Q*n_samples));
+    nvLambda.attr("dim") = IntegerVector::create(D-1, Q, n_samples);
+  }
+  if (retSigma){
+    nvSigma = NumericVector(Rcpp::no_init((D-1)*(D-1)*n_samples));
+    nvSigma.attr("dim") = IntegerVector::create(D-1, D-1, n_samples);
+  }
+  
+  // one workspace per thread, kept across chunks
+  timer.step("StreamingUncollapse_start");
+  const PibbleUncollapse unc(X, Theta, Gamma, Xi, upsilon);
+  std::vector<PibbleUncollapse::Work> works;
+  std::vector<MatrixXd> Lscratch(nthreads, MatrixXd(D-1, Q));
+  std::vector<MatrixXd> Sscratch(nthreads, MatrixXd(D-1, D-1));
+  for (int t=0; t<nthreads; t++) works.push_back(unc.work());
+  MatrixXd z(N*(D-1), std::min(chunk_size, std::max(n_samples, 1)));
+  for (int start=0; start < n_samples; start+=chunk_size){
+    R_CheckUserInterrupt();
+    int nc = std::min(chunk_size, n_samples-start);
+    if (sampler.sample(z.leftCols(nc)) != 0){
+      Rcpp::warning("Laplace Approximation Failed, returning MAP Estimate only");
+      out[3] = R_NilValue;
+      timer.step("Overall_stop");
+      out[4] = timer;
+      return out;
+    }
+    if (retEta){
+      Map<MatrixXd> Etaout(nvEta.begin(), N*(D-1), n_samples);
+      Etaout.middleCols(start, nc) = z.leftCols(nc);
+    }
+    if (!retLambda && !retSigma) continue;
+    #ifdef FIDO_USE_PARALLEL
+      Eigen::setNbThreads(1);
+    #endif 
+    #pragma omp parallel for
+    for (int i=0; i < nc; i++){
+      #ifdef FIDO_USE_PARALLEL
+        int t = omp_get_thread_num();
+      #else 
+        int t = 0;
+      #endif 
+      const Map<const MatrixXd> Eta(&z(0, i), D-1, N);
+      Map<MatrixXd> LambdaDraw(retLambda ? &nvLambda[(start+i)*(D-1)*Q] : 
+                                 Lscratch[t].data(), D-1, Q);
+      Map<MatrixXd> SigmaDraw(retSigma ? &nvSigma[(start+i)*(D-1)*(D-1)] : 
+                                Sscratch[t].data(), D-1, D-1);
+      philox::PhiloxEngine rng(seed, PibbleUncollapse::stream(start+i));
+      unc.draw(Eta, LambdaDraw, SigmaDraw, ret_mean, rng, works[t]);
+    }
+    #ifdef FIDO_USE_PARALLEL
+    if (ncores > 0){
+      Eigen::setNbThreads(ncores);
+    } else {
+      Eigen::setNbThreads(omp_get_max_threads());  
+    }
+    #endif 
+  }
+  timer.step("StreamingUncollapse_stop");
+  if (retEta) out[0] = nvEta;
+  if (retLambda) out[1] = nvLambda;
+  if (retSigma) out[2] = nvSigma;
+  out[3] = sampler.pars.logInvNegHessDet;
+  timer.step("Overall_stop");
+  NumericVector t(timer);
+  out[4] = timer;
+  return out;
+}
+
+//' Laplace Approximation of the Collapsed Pibble Model Streamed Through 
+//' Uncollapsing
+//' 
+//' Fused counterpart of \code{\link{optimPibbleCollapsed}} (Laplace 
+//' approximation only) followed by \code{\link{uncollapsePibble}}. The 
+//' Hessian of the collapsed model at \code{eta} (e.g., \code{Pars} from 
+//' \code{optimPibbleCollapsed} with \code{n_samples=0}) is decomposed once, 
+//' samples of eta are then drawn \code{chunk_size} at a time and each chunk 
+//' is uncollapsed immediately. Only the parameters in \code{pars} are stored 
+//' so, unless "Eta" is requested, memory for samples is bounded by 
+//' \code{chunk_size} rather than \code{n_samples} (the decomposition of the 
+//' Hessian itself is not, use \code{decomp_method} "partial", "lowrank" or "krylov" 
+//' for large N*(D-1)). Notation as in \code{\link{uncollapsePibble}}. 
+//' 
+//' @param Y D x N matrix of counts (dense or \code{dgCMatrix})
+//' @param upsilon scalar (must be > D) degrees of freedom for InvWishart prior
+//' @param Theta matrix of prior mean of dimension (D-1) x Q
+//' @param X matrix of covariates of dimension Q x N
+//' @param Gamma covariance matrix of dimension Q x Q
+//' @param Xi covariance matrix of dimension (D-1) x (D-1)
+//' @param eta D-1 x N matrix, MAP estimate of eta (mean of the Laplace 
+//'   approximation)
+//' @param n_samples number of samples 
+//' @param pars character vector of parameters to return (any of "Eta", 
+//'   "Lambda", and "Sigma")
+//' @param chunk_size (default: 100) number of samples drawn and uncollapsed 
+//'   at a time
+//' @param decomp_method decomposition of hessian for Laplace approximation 
+//'   (see \code{\link{optimPibbleCollapsed}})
+//' @param eigvalthresh threshold for negative eigenvalues in 
+//'   decomposition of negative inverse hessian (should be <=0)
+//' @param jitter (default: 0) if >0 then adds that factor to diagonal of 
+//'   Hessian before decomposition 
+//' @param useChol (default: false) see \code{\link{optimPibbleCollapsed}}
+//' @param seed seed to use for random number generation (if -1 one is drawn 
+//'   from R's random number generator, see \code{set.seed})
+//' @param ret_mean if true then uses posterior mean of Lambda and Sigma 
+//'   corresponding to each sample of eta (see \code{\link{uncollapsePibble}})
+//' @param ncores (default:-1) number of cores to use, if ncores==-1 then 
+//' uses default from OpenMP typically to use all available cores. 
+//' @details With the same \code{seed} samples of eta are those of 
+//'   \code{optimPibbleCollapsed} and samples of Lambda and Sigma are those of 
+//'   \code{uncollapsePibble} (for any \code{chunk_size} and \code{ncores}). 
+//' @return List with components 
+//' 1. Eta Array of dimension (D-1) x N x n_samples (if requested)
+//' 2. Lambda Array of dimension (D-1) x Q x n_samples (if requested)
+//' 3. Sigma Array of dimension (D-1) x (D-1) x n_samples (if requested)
+//' 4. logInvNegHessDet - the log determinant of the covariance of the Laplace 
+//'    approximation (NULL if the decomposition failed, then no samples are 
+//'    returned)
+//' 5. Timer
+//' @export
+//' @md
+//' @seealso \code{\link{optimPibbleCollapsed}}, \code{\link{uncollapsePibble}}
+//' @examples
+//' sim <- pibble_sim()
+//' fit <- optimPibbleCollapsed(sim$Y, sim$upsilon, sim$Theta%*%sim$X, sim$KInv, 
+//'                              sim$AInv, random_pibble_init(sim$Y), 
+//'                              n_samples=0)  
+//' fit2 <- uncollapsePibbleLaplace(sim$Y, sim$upsilon, sim$Theta, sim$X, 
+//'                                 sim$Gamma, sim$Xi, fit$Pars, 
+//'                                 n_samples=1000, pars=c("Lambda", "Sigma"), 
+//'                                 seed=2849)
+// [[Rcpp::export]]
+List uncollapsePibbleLaplace(SEXP Y, 
+                             const double upsilon, 
+                             const Eigen::MatrixXd Theta, 
+                             const Eigen::MatrixXd X, 
+                             const Eigen::MatrixXd Gamma, 
+                             const Eigen::MatrixXd Xi, 
+                             const Eigen::MatrixXd eta, 
+                             int n_samples=2000, 
+                             CharacterVector pars=CharacterVector::create("Eta", "Lambda", "Sigma"), 
+                             int chunk_size=100, 
+                             String decomp_method="cholesky", 
+                             double eigvalthresh=0, 
+                             double jitter=0, 
+                             bool useChol=false, 
+                             long seed=-1, 
+                             bool ret_mean=false, 
+                             int ncores=-1){
+  if (seed == -1) seed = philox::seed_from_R(); // eta, Lambda and Sigma
+  if (Rf_inherits(Y, "dgCMatrix")){
+    Eigen::SparseMatrix<double> Ysp = as<Eigen::SparseMatrix<double> >(Y);
+    return uncollapsePibbleLaplaceY(Ysp, upsilon, Theta, X, Gamma, Xi, eta, 
+                                    n_samples, pars, chunk_size, decomp_method, 
+                                    eigvalthresh, jitter, useChol, seed, 
+                                    ret_mean, ncores);
+  }
+  Eigen::ArrayXXd Yd = as<Eigen::ArrayXXd>(Y);
+  return uncollapsePibbleLaplaceY(Yd, upsilon, Theta, X, Gamma, Xi, eta, 
+                                  n_samples, pars, chunk_size, decomp_method, 
+                                  eigvalthresh, jitter, useChol, seed, 
+                                  ret_mean, ncores);
+}
+
 // A few functions for testing MatDist Functions
 // [[Rcpp::export]]
 Eigen::MatrixXd rMatNormalCholesky_test(Eigen::MatrixXd M, 
@@ -24,9 +24,36 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// sampleLaplaceFactor
+NumericVector sampleLaplaceFactor(SEXP factor, int n_samples, long seed, double stream0, int ncores);
+RcppExport SEXP _fido_sampleLaplaceFactor(SEXP factorSEXP, SEXP n_samplesSEXP, SEXP seedSEXP, SEXP stream0SEXP, SEXP ncoresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type factor(factorSEXP);
+    Rcpp::traits::input_parameter< int >::type n_samples(n_samplesSEXP);
+    Rcpp::traits::input_parameter< long >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< double >::type stream0(stream0SEXP);
+    Rcpp::traits::input_parameter< int >::type ncores(ncoresSEXP);
+    rcpp_result_gen = Rcpp::wrap(sampleLaplaceFactor(factor, n_samples, seed, stream0, ncores));
+    return rcpp_result_gen;
+END_RCPP
+}
+// logDensityLaplaceFactor
+Eigen::VectorXd logDensityLaplaceFactor(SEXP factor, NumericVector eta);
+RcppExport SEXP _fido_logDensityLaplaceFactor(SEXP factorSEXP, SEXP etaSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type factor(factorSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type eta(etaSEXP);
+    rcpp_result_gen = Rcpp::wrap(logDensityLaplaceFactor(factor, eta));
+    return rcpp_result_gen;
+END_RCPP
+}
 // loglikMaltipooCollapsed
-double loglikMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd eta, Eigen::VectorXd ell, bool sylv);
-RcppExport SEXP _fido_loglikMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP etaSEXP, SEXP ellSEXP, SEXP sylvSEXP) {
+double loglikMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd eta, Eigen::VectorXd ell, bool sylv, bool chol);
+RcppExport SEXP _fido_loglikMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP etaSEXP, SEXP ellSEXP, SEXP sylvSEXP, SEXP cholSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -39,13 +66,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< Eigen::VectorXd >::type ell(ellSEXP);
     Rcpp::traits::input_parameter< bool >::type sylv(sylvSEXP);
-    rcpp_result_gen = Rcpp::wrap(loglikMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, eta, ell, sylv));
+    Rcpp::traits::input_parameter< bool >::type chol(cholSEXP);
+    rcpp_result_gen = Rcpp::wrap(loglikMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, eta, ell, sylv, chol));
     return rcpp_result_gen;
 END_RCPP
 }
 // gradMaltipooCollapsed
-Eigen::VectorXd gradMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd eta, Eigen::VectorXd ell, bool sylv);
-RcppExport SEXP _fido_gradMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP etaSEXP, SEXP ellSEXP, SEXP sylvSEXP) {
+Eigen::VectorXd gradMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd eta, Eigen::VectorXd ell, bool sylv, bool chol);
+RcppExport SEXP _fido_gradMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP etaSEXP, SEXP ellSEXP, SEXP sylvSEXP, SEXP cholSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -58,13 +86,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< Eigen::VectorXd >::type ell(ellSEXP);
     Rcpp::traits::input_parameter< bool >::type sylv(sylvSEXP);
-    rcpp_result_gen = Rcpp::wrap(gradMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, eta, ell, sylv));
+    Rcpp::traits::input_parameter< bool >::type chol(cholSEXP);
+    rcpp_result_gen = Rcpp::wrap(gradMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, eta, ell, sylv, chol));
     return rcpp_result_gen;
 END_RCPP
 }
 // hessMaltipooCollapsed
-Eigen::MatrixXd hessMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd eta, Eigen::VectorXd ell, bool sylv);
-RcppExport SEXP _fido_hessMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP etaSEXP, SEXP ellSEXP, SEXP sylvSEXP) {
+Eigen::MatrixXd hessMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd eta, Eigen::VectorXd ell, bool sylv, bool chol);
+RcppExport SEXP _fido_hessMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP etaSEXP, SEXP ellSEXP, SEXP sylvSEXP, SEXP cholSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -77,13 +106,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< Eigen::VectorXd >::type ell(ellSEXP);
     Rcpp::traits::input_parameter< bool >::type sylv(sylvSEXP);
-    rcpp_result_gen = Rcpp::wrap(hessMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, eta, ell, sylv));
+    Rcpp::traits::input_parameter< bool >::type chol(cholSEXP);
+    rcpp_result_gen = Rcpp::wrap(hessMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, eta, ell, sylv, chol));
     return rcpp_result_gen;
 END_RCPP
 }
 // optimMaltipooCollapsed
-List optimMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd init, Eigen::VectorXd ellinit, int n_samples, bool calcGradHess, double b1, double b2, double step_size, double epsilon, double eps_f, double eps_g, int max_iter, bool verbose, int verbose_rate, String decomp_method, double eigvalthresh, double jitter);
-RcppExport SEXP _fido_optimMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP initSEXP, SEXP ellinitSEXP, SEXP n_samplesSEXP, SEXP calcGradHessSEXP, SEXP b1SEXP, SEXP b2SEXP, SEXP step_sizeSEXP, SEXP epsilonSEXP, SEXP eps_fSEXP, SEXP eps_gSEXP, SEXP max_iterSEXP, SEXP verboseSEXP, SEXP verbose_rateSEXP, SEXP decomp_methodSEXP, SEXP eigvalthreshSEXP, SEXP jitterSEXP) {
+List optimMaltipooCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd KInv, const Eigen::MatrixXd U, Eigen::MatrixXd init, Eigen::VectorXd ellinit, int n_samples, bool calcGradHess, double b1, double b2, double step_size, double epsilon, double eps_f, double eps_g, int max_iter, bool verbose, int verbose_rate, String decomp_method, double eigvalthresh, double jitter, bool useChol, String optim_method, int block_iter);
+RcppExport SEXP _fido_optimMaltipooCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP KInvSEXP, SEXP USEXP, SEXP initSEXP, SEXP ellinitSEXP, SEXP n_samplesSEXP, SEXP calcGradHessSEXP, SEXP b1SEXP, SEXP b2SEXP, SEXP step_sizeSEXP, SEXP epsilonSEXP, SEXP eps_fSEXP, SEXP eps_gSEXP, SEXP max_iterSEXP, SEXP verboseSEXP, SEXP verbose_rateSEXP, SEXP decomp_methodSEXP, SEXP eigvalthreshSEXP, SEXP jitterSEXP, SEXP useCholSEXP, SEXP optim_methodSEXP, SEXP block_iterSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -109,13 +139,47 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< String >::type decomp_method(decomp_methodSEXP);
     Rcpp::traits::input_parameter< double >::type eigvalthresh(eigvalthreshSEXP);
     Rcpp::traits::input_parameter< double >::type jitter(jitterSEXP);
-    rcpp_result_gen = Rcpp::wrap(optimMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, init, ellinit, n_samples, calcGradHess, b1, b2, step_size, epsilon, eps_f, eps_g, max_iter, verbose, verbose_rate, decomp_method, eigvalthresh, jitter));
+    Rcpp::traits::input_parameter< bool >::type useChol(useCholSEXP);
+    Rcpp::traits::input_parameter< String >::type optim_method(optim_methodSEXP);
+    Rcpp::traits::input_parameter< int >::type block_iter(block_iterSEXP);
+    rcpp_result_gen = Rcpp::wrap(optimMaltipooCollapsed(Y, upsilon, Theta, X, KInv, U, init, ellinit, n_samples, calcGradHess, b1, b2, step_size, epsilon, eps_f, eps_g, max_iter, verbose, verbose_rate, decomp_method, eigvalthresh, jitter, useChol, optim_method, block_iter));
+    return rcpp_result_gen;
+END_RCPP
+}
+// optimPibbleCollapsedBatch
+List optimPibbleCollapsedBatch(List Y, const double upsilon, List ThetaX, const Eigen::MatrixXd KInv, List AInv, List init, int n_samples, double b1, double b2, double step_size, double epsilon, double eps_f, double eps_g, int max_iter, std::string decomp_method, std::string optim_method, double eigvalthresh, double jitter, bool useSylv, int ncores, long seed);
+RcppExport SEXP _fido_optimPibbleCollapsedBatch(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP initSEXP, SEXP n_samplesSEXP, SEXP b1SEXP, SEXP b2SEXP, SEXP step_sizeSEXP, SEXP epsilonSEXP, SEXP eps_fSEXP, SEXP eps_gSEXP, SEXP max_iterSEXP, SEXP decomp_methodSEXP, SEXP optim_methodSEXP, SEXP eigvalthreshSEXP, SEXP jitterSEXP, SEXP useSylvSEXP, SEXP ncoresSEXP, SEXP seedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const double >::type upsilon(upsilonSEXP);
+    Rcpp::traits::input_parameter< List >::type ThetaX(ThetaXSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type KInv(KInvSEXP);
+    Rcpp::traits::input_parameter< List >::type AInv(AInvSEXP);
+    Rcpp::traits::input_parameter< List >::type init(initSEXP);
+    Rcpp::traits::input_parameter< int >::type n_samples(n_samplesSEXP);
+    Rcpp::traits::input_parameter< double >::type b1(b1SEXP);
+    Rcpp::traits::input_parameter< double >::type b2(b2SEXP);
+    Rcpp::traits::input_parameter< double >::type step_size(step_sizeSEXP);
+    Rcpp::traits::input_parameter< double >::type epsilon(epsilonSEXP);
+    Rcpp::traits::input_parameter< double >::type eps_f(eps_fSEXP);
+    Rcpp::traits::input_parameter< double >::type eps_g(eps_gSEXP);
+    Rcpp::traits::input_parameter< int >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< std::string >::type decomp_method(decomp_methodSEXP);
+    Rcpp::traits::input_parameter< std::string >::type optim_method(optim_methodSEXP);
+    Rcpp::traits::input_parameter< double >::type eigvalthresh(eigvalthreshSEXP);
+    Rcpp::traits::input_parameter< double >::type jitter(jitterSEXP);
+    Rcpp::traits::input_parameter< bool >::type useSylv(useSylvSEXP);
+    Rcpp::traits::input_parameter< int >::type ncores(ncoresSEXP);
+    Rcpp::traits::input_parameter< long >::type seed(seedSEXP);
+    rcpp_result_gen = Rcpp::wrap(optimPibbleCollapsedBatch(Y, upsilon, ThetaX, KInv, AInv, init, n_samples, b1, b2, step_size, epsilon, eps_f, eps_g, max_iter, decomp_method, optim_method, eigvalthresh, jitter, useSylv, ncores, seed));
     return rcpp_result_gen;
 END_RCPP
 }
 // loglikPibbleCollapsed
-double loglikPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd eta, bool sylv);
-RcppExport SEXP _fido_loglikPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP etaSEXP, SEXP sylvSEXP) {
+double loglikPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd eta, bool sylv, bool chol);
+RcppExport SEXP _fido_loglikPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP etaSEXP, SEXP sylvSEXP, SEXP cholSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -126,13 +190,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type AInv(AInvSEXP);
     Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< bool >::type sylv(sylvSEXP);
-    rcpp_result_gen = Rcpp::wrap(loglikPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, eta, sylv));
+    Rcpp::traits::input_parameter< bool >::type chol(cholSEXP);
+    rcpp_result_gen = Rcpp::wrap(loglikPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, eta, sylv, chol));
     return rcpp_result_gen;
 END_RCPP
 }
 // gradPibbleCollapsed
-Eigen::VectorXd gradPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd eta, bool sylv);
-RcppExport SEXP _fido_gradPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP etaSEXP, SEXP sylvSEXP) {
+Eigen::VectorXd gradPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd eta, bool sylv, bool chol);
+RcppExport SEXP _fido_gradPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP etaSEXP, SEXP sylvSEXP, SEXP cholSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -143,13 +208,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type AInv(AInvSEXP);
     Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< bool >::type sylv(sylvSEXP);
-    rcpp_result_gen = Rcpp::wrap(gradPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, eta, sylv));
+    Rcpp::traits::input_parameter< bool >::type chol(cholSEXP);
+    rcpp_result_gen = Rcpp::wrap(gradPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, eta, sylv, chol));
     return rcpp_result_gen;
 END_RCPP
 }
 // hessPibbleCollapsed
-Eigen::MatrixXd hessPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd eta, bool sylv);
-RcppExport SEXP _fido_hessPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP etaSEXP, SEXP sylvSEXP) {
+Eigen::MatrixXd hessPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd eta, bool sylv, bool chol);
+RcppExport SEXP _fido_hessPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP etaSEXP, SEXP sylvSEXP, SEXP cholSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -160,13 +226,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type AInv(AInvSEXP);
     Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< bool >::type sylv(sylvSEXP);
-    rcpp_result_gen = Rcpp::wrap(hessPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, eta, sylv));
+    Rcpp::traits::input_parameter< bool >::type chol(cholSEXP);
+    rcpp_result_gen = Rcpp::wrap(hessPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, eta, sylv, chol));
     return rcpp_result_gen;
 END_RCPP
 }
-// optimPibbleCollapsed
-List optimPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd init, int n_samples, bool calcGradHess, double b1, double b2, double step_size, double epsilon, double eps_f, double eps_g, int max_iter, bool verbose, int verbose_rate, String decomp_method, String optim_method, double eigvalthresh, double jitter, double multDirichletBoot, bool useSylv, int ncores, long seed);
-RcppExport SEXP _fido_optimPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP initSEXP, SEXP n_samplesSEXP, SEXP calcGradHessSEXP, SEXP b1SEXP, SEXP b2SEXP, SEXP step_sizeSEXP, SEXP epsilonSEXP, SEXP eps_fSEXP, SEXP eps_gSEXP, SEXP max_iterSEXP, SEXP verboseSEXP, SEXP verbose_rateSEXP, SEXP decomp_methodSEXP, SEXP optim_methodSEXP, SEXP eigvalthreshSEXP, SEXP jitterSEXP, SEXP multDirichletBootSEXP, SEXP useSylvSEXP, SEXP ncoresSEXP, SEXP seedSEXP) {
+// hessVectorProdPibbleCollapsed
+Eigen::VectorXd hessVectorProdPibbleCollapsed(const Eigen::ArrayXXd Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, const Eigen::MatrixXd AInv, Eigen::MatrixXd eta, Eigen::VectorXd v, bool sylv, bool chol);
+RcppExport SEXP _fido_hessVectorProdPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP etaSEXP, SEXP vSEXP, SEXP sylvSEXP, SEXP cholSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -175,7 +242,26 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type ThetaX(ThetaXSEXP);
     Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type KInv(KInvSEXP);
     Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type AInv(AInvSEXP);
-    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type init(initSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type v(vSEXP);
+    Rcpp::traits::input_parameter< bool >::type sylv(sylvSEXP);
+    Rcpp::traits::input_parameter< bool >::type chol(cholSEXP);
+    rcpp_result_gen = Rcpp::wrap(hessVectorProdPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, eta, v, sylv, chol));
+    return rcpp_result_gen;
+END_RCPP
+}
+// optimPibbleCollapsed
+List optimPibbleCollapsed(SEXP Y, const double upsilon, const Eigen::MatrixXd ThetaX, const Eigen::MatrixXd KInv, SEXP AInv, SEXP init, int n_samples, bool calcGradHess, double b1, double b2, double step_size, double epsilon, double eps_f, double eps_g, int max_iter, bool verbose, int verbose_rate, String decomp_method, String optim_method, double eigvalthresh, double jitter, double multDirichletBoot, bool useSylv, int ncores, long seed, bool useFloat, bool useChol, int batch_size, SEXP optim_state, double race_tol, int trace_rate, int trace_size, bool returnFactor);
+RcppExport SEXP _fido_optimPibbleCollapsed(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaXSEXP, SEXP KInvSEXP, SEXP AInvSEXP, SEXP initSEXP, SEXP n_samplesSEXP, SEXP calcGradHessSEXP, SEXP b1SEXP, SEXP b2SEXP, SEXP step_sizeSEXP, SEXP epsilonSEXP, SEXP eps_fSEXP, SEXP eps_gSEXP, SEXP max_iterSEXP, SEXP verboseSEXP, SEXP verbose_rateSEXP, SEXP decomp_methodSEXP, SEXP optim_methodSEXP, SEXP eigvalthreshSEXP, SEXP jitterSEXP, SEXP multDirichletBootSEXP, SEXP useSylvSEXP, SEXP ncoresSEXP, SEXP seedSEXP, SEXP useFloatSEXP, SEXP useCholSEXP, SEXP batch_sizeSEXP, SEXP optim_stateSEXP, SEXP race_tolSEXP, SEXP trace_rateSEXP, SEXP trace_sizeSEXP, SEXP returnFactorSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const double >::type upsilon(upsilonSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type ThetaX(ThetaXSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type KInv(KInvSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type AInv(AInvSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type init(initSEXP);
     Rcpp::traits::input_parameter< int >::type n_samples(n_samplesSEXP);
     Rcpp::traits::input_parameter< bool >::type calcGradHess(calcGradHessSEXP);
     Rcpp::traits::input_parameter< double >::type b1(b1SEXP);
@@ -195,7 +281,15 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< bool >::type useSylv(useSylvSEXP);
     Rcpp::traits::input_parameter< int >::type ncores(ncoresSEXP);
     Rcpp::traits::input_parameter< long >::type seed(seedSEXP);
-    rcpp_result_gen = Rcpp::wrap(optimPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, init, n_samples, calcGradHess, b1, b2, step_size, epsilon, eps_f, eps_g, max_iter, verbose, verbose_rate, decomp_method, optim_method, eigvalthresh, jitter, multDirichletBoot, useSylv, ncores, seed));
+    Rcpp::traits::input_parameter< bool >::type useFloat(useFloatSEXP);
+    Rcpp::traits::input_parameter< bool >::type useChol(useCholSEXP);
+    Rcpp::traits::input_parameter< int >::type batch_size(batch_sizeSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type optim_state(optim_stateSEXP);
+    Rcpp::traits::input_parameter< double >::type race_tol(race_tolSEXP);
+    Rcpp::traits::input_parameter< int >::type trace_rate(trace_rateSEXP);
+    Rcpp::traits::input_parameter< int >::type trace_size(trace_sizeSEXP);
+    Rcpp::traits::input_parameter< bool >::type returnFactor(returnFactorSEXP);
+    rcpp_result_gen = Rcpp::wrap(optimPibbleCollapsed(Y, upsilon, ThetaX, KInv, AInv, init, n_samples, calcGradHess, b1, b2, step_size, epsilon, eps_f, eps_g, max_iter, verbose, verbose_rate, decomp_method, optim_method, eigvalthresh, jitter, multDirichletBoot, useSylv, ncores, seed, useFloat, useChol, batch_size, optim_state, race_tol, trace_rate, trace_size, returnFactor));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -218,6 +312,33 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// uncollapsePibbleLaplace
+List uncollapsePibbleLaplace(SEXP Y, const double upsilon, const Eigen::MatrixXd Theta, const Eigen::MatrixXd X, const Eigen::MatrixXd Gamma, const Eigen::MatrixXd Xi, const Eigen::MatrixXd eta, int n_samples, CharacterVector pars, int chunk_size, String decomp_method, double eigvalthresh, double jitter, bool useChol, long seed, bool ret_mean, int ncores);
+RcppExport SEXP _fido_uncollapsePibbleLaplace(SEXP YSEXP, SEXP upsilonSEXP, SEXP ThetaSEXP, SEXP XSEXP, SEXP GammaSEXP, SEXP XiSEXP, SEXP etaSEXP, SEXP n_samplesSEXP, SEXP parsSEXP, SEXP chunk_sizeSEXP, SEXP decomp_methodSEXP, SEXP eigvalthreshSEXP, SEXP jitterSEXP, SEXP useCholSEXP, SEXP seedSEXP, SEXP ret_meanSEXP, SEXP ncoresSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const double >::type upsilon(upsilonSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type Theta(ThetaSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type Gamma(GammaSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type Xi(XiSEXP);
+    Rcpp::traits::input_parameter< const Eigen::MatrixXd >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< int >::type n_samples(n_samplesSEXP);
+    Rcpp::traits::input_parameter< CharacterVector >::type pars(parsSEXP);
+    Rcpp::traits::input_parameter< int >::type chunk_size(chunk_sizeSEXP);
+    Rcpp::traits::input_parameter< String >::type decomp_method(decomp_methodSEXP);
+    Rcpp::traits::input_parameter< double >::type eigvalthresh(eigvalthreshSEXP);
+    Rcpp::traits::input_parameter< double >::type jitter(jitterSEXP);
+    Rcpp::traits::input_parameter< bool >::type useChol(useCholSEXP);
+    Rcpp::traits::input_parameter< long >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< bool >::type ret_mean(ret_meanSEXP);
+    Rcpp::traits::input_parameter< int >::type ncores(ncoresSEXP);
+    rcpp_result_gen = Rcpp::wrap(uncollapsePibbleLaplace(Y, upsilon, Theta, X, Gamma, Xi, eta, n_samples, pars, chunk_size, decomp_method, eigvalthresh, jitter, useChol, seed, ret_mean, ncores));
+    return rcpp_result_gen;
+END_RCPP
+}
 // rMatNormalCholesky_test
 Eigen::MatrixXd rMatNormalCholesky_test(Eigen::MatrixXd M, Eigen::MatrixXd LU, Eigen::MatrixXd LV, int discard);
 RcppExport SEXP _fido_rMatNormalCholesky_test(SEXP MSEXP, SEXP LUSEXP, SEXP LVSEXP, SEXP discardSEXP) {
@@ -360,6 +481,36 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// krylov_lap_test
+List krylov_lap_test(int n_samples, Eigen::VectorXd m, Eigen::MatrixXd S, double eigvalthresh);
+RcppExport SEXP _fido_krylov_lap_test(SEXP n_samplesSEXP, SEXP mSEXP, SEXP SSEXP, SEXP eigvalthreshSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type n_samples(n_samplesSEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type m(mSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type S(SSEXP);
+    Rcpp::traits::input_parameter< double >::type eigvalthresh(eigvalthreshSEXP);
+    rcpp_result_gen = Rcpp::wrap(krylov_lap_test(n_samples, m, S, eigvalthresh));
+    return rcpp_result_gen;
+END_RCPP
+}
+// lowrank_lap_test
+List lowrank_lap_test(int n_samples, Eigen::VectorXd m, Eigen::MatrixXd S, int blocksize, int rank, double eigvalthresh);
+RcppExport SEXP _fido_lowrank_lap_test(SEXP n_samplesSEXP, SEXP mSEXP, SEXP SSEXP, SEXP blocksizeSEXP, SEXP rankSEXP, SEXP eigvalthreshSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type n_samples(n_samplesSEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type m(mSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type S(SSEXP);
+    Rcpp::traits::input_parameter< int >::type blocksize(blocksizeSEXP);
+    Rcpp::traits::input_parameter< int >::type rank(rankSEXP);
+    Rcpp::traits::input_parameter< double >::type eigvalthresh(eigvalthreshSEXP);
+    rcpp_result_gen = Rcpp::wrap(lowrank_lap_test(n_samples, m, S, blocksize, rank, eigvalthresh));
+    return rcpp_result_gen;
+END_RCPP
+}
 // alrInv_default_test
 Eigen::MatrixXd alrInv_default_test(Eigen::MatrixXd eta);
 RcppExport SEXP _fido_alrInv_default_test(SEXP etaSEXP) {
@@ -395,8 +546,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // MultDirichletBoot_test
-Eigen::MatrixXd MultDirichletBoot_test(int n_samples, Eigen::MatrixXd eta, Eigen::ArrayXXd Y, double pseudocount);
-RcppExport SEXP _fido_MultDirichletBoot_test(SEXP n_samplesSEXP, SEXP etaSEXP, SEXP YSEXP, SEXP pseudocountSEXP) {
+Eigen::MatrixXd MultDirichletBoot_test(int n_samples, Eigen::MatrixXd eta, Eigen::ArrayXXd Y, double pseudocount, long seed);
+RcppExport SEXP _fido_MultDirichletBoot_test(SEXP n_samplesSEXP, SEXP etaSEXP, SEXP YSEXP, SEXP pseudocountSEXP, SEXP seedSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -404,7 +555,8 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Eigen::MatrixXd >::type eta(etaSEXP);
     Rcpp::traits::input_parameter< Eigen::ArrayXXd >::type Y(YSEXP);
     Rcpp::traits::input_parameter< double >::type pseudocount(pseudocountSEXP);
-    rcpp_result_gen = Rcpp::wrap(MultDirichletBoot_test(n_samples, eta, Y, pseudocount));
+    Rcpp::traits::input_parameter< long >::type seed(seedSEXP);
+    rcpp_result_gen = Rcpp::wrap(MultDirichletBoot_test(n_samples, eta, Y, pseudocount, seed));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -421,15 +573,20 @@ END_RCPP
 
 static const R_CallMethodDef CallEntries[] = {
     {"_fido_conjugateLinearModel", (DL_FUNC) &_fido_conjugateLinearModel, 7},
-    {"_fido_loglikMaltipooCollapsed", (DL_FUNC) &_fido_loglikMaltipooCollapsed, 9},
-    {"_fido_gradMaltipooCollapsed", (DL_FUNC) &_fido_gradMaltipooCollapsed, 9},
-    {"_fido_hessMaltipooCollapsed", (DL_FUNC) &_fido_hessMaltipooCollapsed, 9},
-    {"_fido_optimMaltipooCollapsed", (DL_FUNC) &_fido_optimMaltipooCollapsed, 22},
-    {"_fido_loglikPibbleCollapsed", (DL_FUNC) &_fido_loglikPibbleCollapsed, 7},
-    {"_fido_gradPibbleCollapsed", (DL_FUNC) &_fido_gradPibbleCollapsed, 7},
-    {"_fido_hessPibbleCollapsed", (DL_FUNC) &_fido_hessPibbleCollapsed, 7},
-    {"_fido_optimPibbleCollapsed", (DL_FUNC) &_fido_optimPibbleCollapsed, 25},
+    {"_fido_sampleLaplaceFactor", (DL_FUNC) &_fido_sampleLaplaceFactor, 5},
+    {"_fido_logDensityLaplaceFactor", (DL_FUNC) &_fido_logDensityLaplaceFactor, 2},
+    {"_fido_loglikMaltipooCollapsed", (DL_FUNC) &_fido_loglikMaltipooCollapsed, 10},
+    {"_fido_gradMaltipooCollapsed", (DL_FUNC) &_fido_gradMaltipooCollapsed, 10},
+    {"_fido_hessMaltipooCollapsed", (DL_FUNC) &_fido_hessMaltipooCollapsed, 10},
+    {"_fido_optimMaltipooCollapsed", (DL_FUNC) &_fido_optimMaltipooCollapsed, 25},
+    {"_fido_optimPibbleCollapsedBatch", (DL_FUNC) &_fido_optimPibbleCollapsedBatch, 21},
+    {"_fido_loglikPibbleCollapsed", (DL_FUNC) &_fido_loglikPibbleCollapsed, 8},
+    {"_fido_gradPibbleCollapsed", (DL_FUNC) &_fido_gradPibbleCollapsed, 8},
+    {"_fido_hessPibbleCollapsed", (DL_FUNC) &_fido_hessPibbleCollapsed, 8},
+    {"_fido_hessVectorProdPibbleCollapsed", (DL_FUNC) &_fido_hessVectorProdPibbleCollapsed, 9},
+    {"_fido_optimPibbleCollapsed", (DL_FUNC) &_fido_optimPibbleCollapsed, 33},
     {"_fido_uncollapsePibble", (DL_FUNC) &_fido_uncollapsePibble, 9},
+    {"_fido_uncollapsePibbleLaplace", (DL_FUNC) &_fido_uncollapsePibbleLaplace, 17},
     {"_fido_rMatNormalCholesky_test", (DL_FUNC) &_fido_rMatNormalCholesky_test, 4},
     {"_fido_rInvWishRevCholesky_test", (DL_FUNC) &_fido_rInvWishRevCholesky_test, 2},
     {"_fido_rInvWishRevCholesky_thread_test", (DL_FUNC) &_fido_rInvWishRevCholesky_thread_test, 3},
@@ -441,10 +598,12 @@ static const R_CallMethodDef CallEntries[] = {
     {"_fido_eigen_lap_test", (DL_FUNC) &_fido_eigen_lap_test, 4},
     {"_fido_cholesky_lap_test", (DL_FUNC) &_fido_cholesky_lap_test, 4},
     {"_fido_LaplaceApproximation_test", (DL_FUNC) &_fido_LaplaceApproximation_test, 5},
+    {"_fido_krylov_lap_test", (DL_FUNC) &_fido_krylov_lap_test, 4},
+    {"_fido_lowrank_lap_test", (DL_FUNC) &_fido_lowrank_lap_test, 6},
     {"_fido_alrInv_default_test", (DL_FUNC) &_fido_alrInv_default_test, 1},
     {"_fido_alr_default_test", (DL_FUNC) &_fido_alr_default_test, 1},
     {"_fido_rDirichlet_test", (DL_FUNC) &_fido_rDirichlet_test, 2},
-    {"_fido_MultDirichletBoot_test", (DL_FUNC) &_fido_MultDirichletBoot_test, 4},
+    {"_fido_MultDirichletBoot_test", (DL_FUNC) &_fido_MultDirichletBoot_test, 5},
     {"_fido_fillUnitNormal_test", (DL_FUNC) &_fido_fillUnitNormal_test, 1},
     {NULL, NULL, 0}
 };
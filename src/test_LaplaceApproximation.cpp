@@ -44,4 +44,43 @@ Eigen::MatrixXd LaplaceApproximation_test(int n_samples, Eigen::VectorXd m,
                                            logInvNegHessDet);
   if (status==1) Rcpp::stop("decomposition failed");
   return z;
-}
\ No newline at end of file
+}
+
+// dense matrix posing as a hessian operator for testing the krylov method
+struct DenseHessOp {
+  MatrixXd H;
+  int rows() const { return H.rows(); }
+  VectorXd matvec(const Eigen::Ref<const VectorXd>& v) const { return H*v; }
+};
+
+// [[Rcpp::export]]
+List krylov_lap_test(int n_samples, Eigen::VectorXd m, 
+                     Eigen::MatrixXd S, double eigvalthresh){
+  int p=m.rows();
+  MatrixXd z = MatrixXd::Zero(p, n_samples);
+  DenseHessOp H = {-S}; // S is hessian of NEGATIVE log-likelihood
+  double logInvNegHessDet;
+  int status = lapap::LaplaceApproximationKrylov(z, m, H, eigvalthresh, 0, 
+                                                 logInvNegHessDet);
+  if (status==1) Rcpp::stop("decomposition failed");
+  return List::create(Named("Samples") = z, 
+                      Named("logInvNegHessDet") = logInvNegHessDet);
+}
+
+// [[Rcpp::export]]
+List lowrank_lap_test(int n_samples, Eigen::VectorXd m, Eigen::MatrixXd S, 
+                      int blocksize, int rank, double eigvalthresh){
+  int p=m.rows();
+  MatrixXd z = MatrixXd::Zero(p, n_samples);
+  DenseHessOp H = {-S}; // S is hessian of NEGATIVE log-likelihood
+  MatrixXd blocks(p, blocksize);
+  for (int i=0; i < p/blocksize; i++)
+    blocks.middleRows(i*blocksize, blocksize) = 
+      S.block(i*blocksize, i*blocksize, blocksize, blocksize);
+  lapap::lappars pars = lapap::init_lappars(eigvalthresh);
+  pars.lowrank_rank = rank;
+  int status = lapap::LaplaceApproximationLowRank(z, m, H, blocks, 0, pars);
+  if (status==1) Rcpp::stop("decomposition failed");
+  return List::create(Named("Samples") = z, 
+                      Named("logInvNegHessDet") = pars.logInvNegHessDet);
+}
@@ -28,6 +28,8 @@ Eigen::MatrixXd rDirichlet_test(int n_samples, Eigen::VectorXd alpha){
 // Wrapper functions 
 // [[Rcpp::export]]
 Eigen::MatrixXd MultDirichletBoot_test(int n_samples, Eigen::MatrixXd eta, 
-                                       Eigen::ArrayXXd Y, double pseudocount){
-  return MultDirichletBoot::MultDirichletBoot(n_samples, eta, Y, pseudocount);
+                                       Eigen::ArrayXXd Y, double pseudocount, 
+                                       long seed=-1){
+  return MultDirichletBoot::MultDirichletBoot(n_samples, eta, Y, pseudocount, 
+                                              seed);
 }
\ No newline at end of file